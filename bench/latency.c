@@ -0,0 +1,408 @@
+/*
+ * Request latency benchmark. Each connection runs in its own thread and
+ * sends keep alive GET requests one after another (closed loop), timing
+ * every response. Prints the latency distribution in microseconds.
+ *
+ * Compile: gcc -O2 -o bin/latency ./bench/latency.c -pthread
+ * Usage: bin/latency [-a address] [-p port] [-c connections] [-n requests]
+ *                    [-w warmup] [-u path] [-x address] [-d depth]
+ *
+ * e.g. compare the default configuration with BusyPoll 50 by running the
+ * server with each one and the same benchmark arguments.
+ *
+ * An address such as unix:/run/httpd.sock connects to the Unix listener
+ * instead (see Listen). With -x the benchmark runs against the -a address
+ * and then against the -x one and reports the gain of the second, e.g.
+ * -x unix:/run/httpd.sock to compare the Unix listener with loopback TCP
+ * on the same server.
+ *
+ * With -d the requests are pipelined: each connection sends depth
+ * requests at once and then reads their responses, each one timed from
+ * the send.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RESPONSE_MAX_SIZE	65536
+
+typedef struct result {
+	double throughput;				// req/s
+	double mean;					// us
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+	double max;
+} result_t;
+
+typedef struct client {
+	int id;
+	int requests;
+	int warmup;
+	uint64_t *samples;				// ns
+	pthread_t thread;
+} client_t;
+
+static char *address = "127.0.0.1";
+static int port = 80;
+static char *path = "/";
+static int depth = 1;
+
+static uint64_t now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static int compare(const void *a, const void *b) {
+
+	uint64_t x, y;
+
+	x = *(const uint64_t *) a;
+	y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+
+}
+
+/*
+ * Opens a connection to the server
+ *
+ * @return: the socket
+ */
+static int connect_server(void) {
+
+	int sockfd, one;
+
+	struct sockaddr_in server_addr;
+	struct sockaddr_un unix_addr;
+
+	if (strncmp(address, "unix:", strlen("unix:")) == 0) {
+
+		if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			exit(EXIT_FAILURE);
+		}
+
+		memset(&unix_addr, 0, sizeof(unix_addr));
+
+		unix_addr.sun_family = AF_UNIX;
+		strncpy(unix_addr.sun_path, address + strlen("unix:"), sizeof(unix_addr.sun_path) - 1);
+
+		if (connect(sockfd, (struct sockaddr *) &unix_addr, sizeof(unix_addr)) < 0) {
+			perror("connect");
+			exit(EXIT_FAILURE);
+		}
+
+		return sockfd;
+
+	}
+
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	one = 1;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	memset(&server_addr, 0, sizeof(server_addr));
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	inet_pton(AF_INET, address, &(server_addr.sin_addr));
+
+	if (connect(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+
+	return sockfd;
+
+}
+
+/*
+ * Receives one whole response (headers and Content-Length bytes of body)
+ *
+ * @param sockfd: the socket
+ * @param buffer: receive buffer of RESPONSE_MAX_SIZE bytes
+ * @param pending: bytes of the next responses at the start of the buffer,
+ * updated with the ones received past this response (pipelining)
+ * @return: 0 on success, -1 when the connection is closed or broken
+ */
+static int receive_response(int sockfd, char *buffer, size_t *pending) {
+
+	char *end, *length;
+
+	ssize_t n;
+	size_t received, expected;
+
+	received = *pending;
+	expected = 0;
+	end = NULL;
+
+	buffer[received] = '\0';
+
+	while (1) {
+
+		if (end == NULL && (end = strstr(buffer, "\r\n\r\n")) != NULL) {
+
+			expected = end - buffer + 4;
+
+			if ((length = strcasestr(buffer, "Content-Length:")) != NULL && length < end) {
+				expected += strtoul(length + strlen("Content-Length:"), NULL, 10);
+			}
+
+		}
+
+		if (end != NULL && received >= expected) {
+			break;
+		}
+
+		/* Bodies larger than the buffer are read and thrown away */
+		if (received == RESPONSE_MAX_SIZE - 1 && end != NULL) {
+			expected -= received;
+			received = 0;
+			end = buffer;
+		}
+
+		if ((n = recv(sockfd, buffer + received, RESPONSE_MAX_SIZE - received - 1, 0)) <= 0) {
+
+			if (n < 0 && errno == EINTR) continue;
+
+			return -1;
+
+		}
+
+		received += n;
+		buffer[received] = '\0';
+
+	}
+
+	*pending = received - expected;
+
+	memmove(buffer, buffer + expected, *pending);
+
+	return 0;
+
+}
+
+static void *client_run(void *arg) {
+
+	int i, j, count, sockfd, length;
+
+	char request[1024];
+	char *buffer, *requests;
+
+	size_t pending;
+
+	uint64_t start;
+
+	client_t *client;
+
+	client = (client_t *) arg;
+
+	buffer = malloc(RESPONSE_MAX_SIZE);
+
+	length = snprintf(request, sizeof(request),
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n",
+		path, strncmp(address, "unix:", strlen("unix:")) == 0 ? "localhost" : address);
+
+	requests = malloc(length * depth);
+
+	for (j = 0; j < depth; j++) {
+		memcpy(requests + j * length, request, length);
+	}
+
+	sockfd = connect_server();
+	pending = 0;
+
+	for (i = -client->warmup; i < client->requests; i += count) {
+
+		count = client->requests - i < depth ? client->requests - i : depth;
+
+		start = now_ns();
+
+		if (send(sockfd, requests, length * count, MSG_NOSIGNAL) != length * count) {
+			j = 0;
+		} else {
+			for (j = 0; j < count && receive_response(sockfd, buffer, &pending) == 0; j++) {
+				if (i + j >= 0) {
+					client->samples[i + j] = now_ns() - start;
+				}
+			}
+		}
+
+		if (j < count) {
+			/* e.g. MaxKeepAliveRequests reached, the rest is sent again */
+			close(sockfd);
+			sockfd = connect_server();
+			pending = 0;
+			count = j;
+		}
+
+	}
+
+	close(sockfd);
+	free(requests);
+	free(buffer);
+
+	return NULL;
+
+}
+
+/*
+ * Runs the benchmark against the current address and prints the results
+ *
+ * @param connections: number of connections
+ * @param requests: requests per connection
+ * @param warmup: requests per connection not timed
+ * @param result: where the results are stored
+ */
+static void run(int connections, int requests, int warmup, result_t *result) {
+
+	int i, j, total;
+
+	uint64_t start, elapsed, sum, *samples;
+
+	client_t *clients;
+
+	total = requests * connections;
+
+	clients = malloc(connections * sizeof(client_t));
+	samples = malloc(total * sizeof(uint64_t));
+
+	start = now_ns();
+
+	for (i = 0; i < connections; i++) {
+
+		clients[i].id = i;
+		clients[i].requests = requests;
+		clients[i].warmup = warmup;
+		clients[i].samples = &samples[i * requests];
+
+		if (pthread_create(&(clients[i].thread), NULL, client_run, &clients[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+
+	}
+
+	for (i = 0; i < connections; i++) {
+		pthread_join(clients[i].thread, NULL);
+	}
+
+	elapsed = now_ns() - start;
+
+	qsort(samples, total, sizeof(uint64_t), compare);
+
+	sum = 0;
+
+	for (j = 0; j < total; j++) {
+		sum += samples[j];
+	}
+
+	result->throughput = (double) (total + warmup * connections) * 1e9 / elapsed;
+	result->mean = sum / 1000.0 / total;
+	result->p50 = samples[total * 50 / 100] / 1000.0;
+	result->p90 = samples[total * 90 / 100] / 1000.0;
+	result->p99 = samples[total * 99 / 100] / 1000.0;
+	result->p999 = samples[total * 999 / 1000] / 1000.0;
+	result->max = samples[total - 1] / 1000.0;
+
+	printf("Requests: %d (%d connections, %d warmup each, %d pipelined)\n", total, connections, warmup, depth);
+	printf("Throughput: %.0f req/s\n", result->throughput);
+	printf("Latency (us): mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+		result->mean, result->p50, result->p90, result->p99, result->p999, result->max);
+
+	free(samples);
+	free(clients);
+
+}
+
+int main(int argc, char *argv[]) {
+
+	int c, connections, requests, warmup;
+
+	char *other;
+
+	result_t first, second;
+
+	connections = 1;
+	requests = 10000;
+	warmup = 1000;
+	other = NULL;
+
+	while ((c = getopt(argc, argv, "a:p:c:n:w:u:x:d:")) != -1) {
+
+		switch (c) {
+
+			case 'a': address = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': connections = atoi(optarg); break;
+			case 'n': requests = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'u': path = optarg; break;
+			case 'x': other = optarg; break;
+			case 'd': depth = atoi(optarg); break;
+
+			default:
+				printf("Usage: %s [-a address] [-p port] [-c connections] "
+					"[-n requests] [-w warmup] [-u path] [-x address] [-d depth]\n", argv[0]);
+				exit(EXIT_FAILURE);
+
+		}
+
+	}
+
+	if (connections < 1) connections = 1;
+	if (depth < 1) depth = 1;
+
+	/* Requests per connection */
+	requests = requests / connections > 0 ? requests / connections : 1;
+
+	if (other == NULL) {
+		run(connections, requests, warmup, &first);
+		return 0;
+	}
+
+	printf("%s:\n", address);
+	run(connections, requests, warmup, &first);
+
+	address = other;
+
+	printf("%s:\n", address);
+	run(connections, requests, warmup, &second);
+
+	printf("Gain: throughput %+.1f%%, latency mean %+.1f%%, p50 %+.1f%%, p99 %+.1f%%\n",
+		(second.throughput / first.throughput - 1) * 100,
+		(second.mean / first.mean - 1) * 100,
+		(second.p50 / first.p50 - 1) * 100,
+		(second.p99 / first.p99 - 1) * 100);
+
+	return 0;
+
+}
\ No newline at end of file
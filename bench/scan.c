@@ -0,0 +1,365 @@
+/*
+ * Request tokenizer benchmark. Tokenizes request header blocks captured
+ * from browsers (page, asset and XHR requests) the way parse_request()
+ * does, with every scanner implementation the CPU supports, and prints
+ * the time per request and the gain over the scalar one.
+ *
+ * Before timing, the implementations are checked against the scalar one
+ * on the captures and on random buffers.
+ *
+ * Compile: gcc -O2 -o bin/scan ./bench/scan.c ./src/scan.c
+ * Usage: bin/scan [-n iterations]
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../src/scan.h"
+
+#define CHECK_ROUNDS		100000
+#define CHECK_MAX_SIZE		300
+
+typedef struct capture {
+	char *name;
+	char *request;
+	size_t length;
+} capture_t;
+
+static capture_t captures[] = {
+	{ "chrome page",
+		"GET /blog/2024/03/building-a-tiny-web-server.html HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"Cache-Control: max-age=0\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Referer: https://www.example.com/blog/\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9,es;q=0.8\r\n"
+		"Cookie: _ga=GA1.1.1843309165.1709742093; _ga_X1Y2Z3W4V5=GS1.1.1711454106.7.1.1711454200.0.0.0; session=eyJ1c2VyIjoiZGFuaSIsImV4cCI6MTcxMTQ1NzgwMH0.c2lnbmF0dXJl; theme=dark\r\n"
+		"If-None-Match: \"65f2a1b3-2c1e\"\r\n"
+		"If-Modified-Since: Thu, 14 Mar 2024 07:21:55 GMT\r\n"
+		"\r\n" },
+	{ "chrome asset",
+		"GET /static/img/header.webp HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: image\r\n"
+		"Referer: https://www.example.com/blog/2024/03/building-a-tiny-web-server.html\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9,es;q=0.8\r\n"
+		"Cookie: _ga=GA1.1.1843309165.1709742093; _ga_X1Y2Z3W4V5=GS1.1.1711454106.7.1.1711454200.0.0.0; session=eyJ1c2VyIjoiZGFuaSIsImV4cCI6MTcxMTQ1NzgwMH0.c2lnbmF0dXJl; theme=dark\r\n"
+		"\r\n" },
+	{ "firefox page",
+		"GET /docs/?page=2&sort=date HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Referer: https://www.example.com/docs/\r\n"
+		"Connection: keep-alive\r\n"
+		"Cookie: session=eyJ1c2VyIjoiZGFuaSIsImV4cCI6MTcxMTQ1NzgwMH0.c2lnbmF0dXJl; theme=dark\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Priority: u=1\r\n"
+		"\r\n" },
+	{ "safari page",
+		"GET / HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+		"Sec-Fetch-Site: none\r\n"
+		"Cookie: session=eyJ1c2VyIjoiZGFuaSIsImV4cCI6MTcxMTQ1NzgwMH0.c2lnbmF0dXJl\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Accept-Language: en-GB,en;q=0.9\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4.1 Safari/605.1.15\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n" },
+	{ "chrome xhr",
+		"POST /api/v1/comments HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"Content-Length: 87\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"Content-Type: application/json\r\n"
+		"X-Requested-With: XMLHttpRequest\r\n"
+		"X-CSRF-Token: 7f3c2a91e0b84d5f9a6e1c2b3d4e5f60\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Accept: application/json, text/plain, */*\r\n"
+		"Origin: https://www.example.com\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: cors\r\n"
+		"Sec-Fetch-Dest: empty\r\n"
+		"Referer: https://www.example.com/blog/2024/03/building-a-tiny-web-server.html\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: en-US,en;q=0.9,es;q=0.8\r\n"
+		"Cookie: _ga=GA1.1.1843309165.1709742093; _ga_X1Y2Z3W4V5=GS1.1.1711454106.7.1.1711454200.0.0.0; session=eyJ1c2VyIjoiZGFuaSIsImV4cCI6MTcxMTQ1NzgwMH0.c2lnbmF0dXJl; theme=dark\r\n"
+		"\r\n" },
+	{ "curl",
+		"GET /index.html HTTP/1.1\r\n"
+		"Host: localhost:8080\r\n"
+		"User-Agent: curl/8.5.0\r\n"
+		"Accept: */*\r\n"
+		"\r\n" },
+};
+
+#define NUM_CAPTURES		(sizeof(captures) / sizeof(capture_t))
+
+static uint64_t get_time_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/*
+ * Tokenizes a request the way parse_request() does, without writing to it
+ *
+ * @param buffer: the received bytes
+ * @param length: number of received bytes
+ * @return: a checksum of the token boundaries, 0 when the request is
+ * incomplete or malformed
+ */
+static uint64_t tokenize(char *buffer, size_t length) {
+
+	char *end, *line, *value;
+
+	size_t n;
+
+	uint64_t sum;
+
+	if ((end = scan_header_end(buffer, length)) == NULL) {
+		return 0;
+	}
+
+	end += 4;
+
+	if ((n = scan_span(buffer, end - buffer, SCAN_TOKEN)) == 0 || buffer[n] != ' ') {
+		return 0;
+	}
+
+	sum = n;
+	line = buffer + n + 1;
+
+	if ((n = scan_span(line, end - line, SCAN_TARGET)) == 0 || line[n] != ' ') {
+		return 0;
+	}
+
+	sum = sum * 31 + n;
+	line += n + 1;
+
+	if ((n = scan_span(line, end - line, SCAN_TARGET)) == 0 || strncmp(line + n, "\r\n", 2) != 0) {
+		return 0;
+	}
+
+	sum = sum * 31 + n;
+
+	for (line += n + 2; strncmp(line, "\r\n", 2) != 0; line = value + n + 2) {
+
+		if ((n = scan_span(line, end - line, SCAN_TOKEN)) == 0 || line[n] != ':') {
+			return 0;
+		}
+
+		sum = sum * 31 + n;
+
+		for (value = line + n + 1; *value == ' ' || *value == '\t'; value++);
+
+		n = scan_span(value, end - value, SCAN_VALUE);
+
+		if (strncmp(value + n, "\r\n", 2) != 0) {
+			return 0;
+		}
+
+		sum = sum * 31 + n;
+
+	}
+
+	return sum;
+
+}
+
+/*
+ * Compares an implementation with the scalar one
+ *
+ * @param level: the implementation
+ * @return: 0 when they agree, -1 otherwise
+ */
+static int check(int level) {
+
+	int i, class;
+
+	size_t j, length, expected[SCAN_CLASSES + 1];
+
+	uint64_t sums[NUM_CAPTURES];
+
+	char buffer[CHECK_MAX_SIZE];
+
+	char *end;
+
+	scan_init(SCAN_SCALAR);
+
+	for (j = 0; j < NUM_CAPTURES; j++) {
+		sums[j] = tokenize(captures[j].request, captures[j].length);
+	}
+
+	scan_init(level);
+
+	for (j = 0; j < NUM_CAPTURES; j++) {
+
+		if (sums[j] == 0 || tokenize(captures[j].request, captures[j].length) != sums[j]) {
+			printf("%s: %s tokenized differently\n", scan_name(level), captures[j].name);
+			return -1;
+		}
+
+	}
+
+	srand(1);
+
+	for (i = 0; i < CHECK_ROUNDS; i++) {
+
+		length = rand() % CHECK_MAX_SIZE;
+
+		/* Mostly valid characters, some delimiters and a few of any kind */
+		for (j = 0; j < length; j++) {
+			switch (rand() % 16) {
+				case 0: buffer[j] = "\r\n :\t?"[rand() % 6]; break;
+				case 1: buffer[j] = rand() % 256; break;
+				default: buffer[j] = 'a' + rand() % 26; break;
+			}
+		}
+
+		scan_init(SCAN_SCALAR);
+
+		for (class = 0; class < SCAN_CLASSES; class++) {
+			expected[class] = scan_span(buffer, length, class);
+		}
+
+		end = scan_header_end(buffer, length);
+		expected[SCAN_CLASSES] = end == NULL ? length : (size_t) (end - buffer);
+
+		scan_init(level);
+
+		for (class = 0; class < SCAN_CLASSES; class++) {
+
+			if (scan_span(buffer, length, class) != expected[class]) {
+				printf("%s: span of class %d differs\n", scan_name(level), class);
+				return -1;
+			}
+
+		}
+
+		end = scan_header_end(buffer, length);
+
+		if ((end == NULL ? length : (size_t) (end - buffer)) != expected[SCAN_CLASSES]) {
+			printf("%s: header end differs\n", scan_name(level));
+			return -1;
+		}
+
+	}
+
+	return 0;
+
+}
+
+int main(int argc, char *argv[]) {
+
+	int c, level, iterations;
+
+	size_t j, bytes;
+
+	uint64_t start, elapsed, sum, scalar;
+
+	iterations = 1000000;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+
+		switch (c) {
+			case 'n': iterations = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+
+	}
+
+	bytes = 0;
+
+	for (j = 0; j < NUM_CAPTURES; j++) {
+		captures[j].length = strlen(captures[j].request);
+		bytes += captures[j].length;
+	}
+
+	printf("%d captures, %zu bytes on average\n", (int) NUM_CAPTURES, bytes / NUM_CAPTURES);
+
+	scalar = 0;
+
+	for (level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+
+		if (scan_init(level) < 0) {
+			printf("%-8s not supported by this CPU\n", scan_name(level));
+			continue;
+		}
+
+		if (level != SCAN_SCALAR && check(level) < 0) {
+			exit(EXIT_FAILURE);
+		}
+
+		sum = 0;
+
+		start = get_time_ns();
+
+		for (c = 0; c < iterations; c++) {
+			for (j = 0; j < NUM_CAPTURES; j++) {
+				sum += tokenize(captures[j].request, captures[j].length);
+			}
+		}
+
+		elapsed = get_time_ns() - start;
+
+		if (level == SCAN_SCALAR) {
+			scalar = elapsed;
+		}
+
+		printf("%-8s %6.1f ns/request, %5.2f GB/s, %.2fx (checksum %llx)\n",
+			scan_name(level),
+			(double) elapsed / ((double) iterations * NUM_CAPTURES),
+			(double) bytes * iterations / elapsed,
+			(double) scalar / elapsed,
+			(unsigned long long) sum);
+
+	}
+
+	return 0;
+
+}
\ No newline at end of file
@@ -0,0 +1,162 @@
+/*
+ * Admission control of the threads server mode. Every connection is
+ * timestamped when it is handed over to the workers and the wait until a
+ * worker picks it up is recorded. While connections are waiting and the
+ * current wait is over AdmissionBudget, the acceptor answers new
+ * connections right away with a prebuilt "503 Service Unavailable" and a
+ * Retry-After header, instead of queueing them (or blocking on a full
+ * queue and letting the kernel backlog overflow).
+ *
+ * The current wait is the one of the last connection picked up, or, when
+ * that is longer, the time the workers have gone without picking any while
+ * there were connections waiting (workers all stuck).
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "sched.h"
+#include "admission.h"
+#include "stats.h"
+#include "util.h"
+
+extern config_t conf;
+
+static uint64_t last_wait;				// ns
+static uint64_t last_pick;				// ns
+static uint64_t last_empty;				// ns, last time the acceptor saw no backlog
+
+/* the 503 response, rebuilt by each thread once per second (Date) */
+static __thread char response[RESPONSE_503_SIZE];
+static __thread int response_length;
+static __thread time_t response_second;
+
+/*
+ * Starts counting the waits from now
+ */
+void admission_init(void) {
+
+	__atomic_store_n(&last_pick, get_time_ns(), __ATOMIC_RELAXED);
+
+	last_empty = last_pick;
+
+}
+
+/*
+ * Records how long a connection waited until a worker picked it up
+ *
+ * @param waited: the wait (ns)
+ */
+void admission_picked(uint64_t waited) {
+
+	__atomic_store_n(&last_wait, waited, __ATOMIC_RELAXED);
+	__atomic_store_n(&last_pick, get_time_ns(), __ATOMIC_RELAXED);
+
+	stats_hist_add(stats.wait_hist, waited / 1000);
+
+}
+
+/*
+ * Tells whether a new connection may be queued. Only called by the
+ * acceptor.
+ *
+ * @return: TRUE when it may, FALSE when it has to be shed
+ */
+int admission_admit(void) {
+
+	uint64_t now, waited, since;
+
+	if (conf.admission_budget == 0) {
+		return TRUE;
+	}
+
+	now = get_time_ns();
+
+	if (sched_waiting() == 0) {
+		last_empty = now;
+		return TRUE;
+	}
+
+	waited = __atomic_load_n(&last_wait, __ATOMIC_RELAXED);
+	since = __atomic_load_n(&last_pick, __ATOMIC_RELAXED);
+
+	if (last_empty > since) {
+		since = last_empty;
+	}
+
+	/* Nothing picked up for a while, new connections would wait that long */
+	if (now - since > waited) {
+		waited = now - since;
+	}
+
+	return waited <= conf.admission_budget * 1000000ULL;
+
+}
+
+/*
+ * Answers the connection with the prebuilt 503 response and closes it.
+ * Nothing blocks: a client that is not reading just misses the answer.
+ *
+ * @param sockfd: the client socket
+ */
+void admission_reject(int sockfd) {
+
+	char date_buffer[MAX_DATE_SIZE];
+	char request[ADMISSION_DRAIN_SIZE];
+
+	config_t *config;
+
+	time_t now;
+
+	now = time(NULL);
+
+	if (response_length == 0 || now != response_second) {
+
+		config = config_acquire();
+
+		get_date(date_buffer, "%a, %d %b %Y %H:%M:%S %Z");
+
+		response_length = snprintf(response, RESPONSE_503_SIZE,
+			"%s 503 Service Unavailable\r\n"
+			"Date: %s\r\n"
+			"Server: %s\r\n"
+			"Retry-After: %d\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			config->http_version, date_buffer, config->server_name, config->retry_after);
+
+		config_release(config);
+
+		response_second = now;
+
+	}
+
+	/* Unread request bytes would make close() reset the connection */
+	recv(sockfd, request, ADMISSION_DRAIN_SIZE, MSG_DONTWAIT);
+
+	send(sockfd, response, response_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	close(sockfd);
+
+	stats_add(&(stats.shed), 1);
+
+}
\ No newline at end of file
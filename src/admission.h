@@ -0,0 +1,16 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __ADMISSION_H
+#define __ADMISSION_H
+
+#define RESPONSE_503_SIZE	512			// room for the prebuilt 503 response
+#define ADMISSION_DRAIN_SIZE	4096		// request bytes read before answering 503
+
+void admission_init(void);
+void admission_picked(uint64_t waited);
+int admission_admit(void);
+void admission_reject(int sockfd);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,192 @@
+/*
+ * Open file cache. A thread may own one (see cache_init()) to serve static
+ * files without opening them for every request. Entries live in a direct
+ * mapped table indexed by a hash of the path. A hit checks the open file
+ * (fstat) for changes made in place, and once per CACHE_TTL the path too,
+ * in case it has been replaced by another file.
+ *
+ * The cache is only ever touched by its owner thread, so nothing is locked.
+ * An entry replaced while connections still send its file is closed when
+ * the last of them releases it.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* local header files */
+#include "constants.h"
+#include "cache.h"
+#include "util.h"
+
+static __thread cache_t *file_cache;
+
+/*
+ * Gives the calling thread its own open file cache, allocated from the
+ * memory of a NUMA node
+ *
+ * @param node: the NUMA node, or -1
+ */
+void cache_init(int node) {
+
+	file_cache = node_alloc(sizeof(cache_t), node);
+
+}
+
+/*
+ * Hashes a path (FNV-1a)
+ *
+ * @param path: the file path
+ * @return: the hash value
+ */
+static uint32_t cache_hash(char *path) {
+
+	uint32_t hash;
+
+	hash = 2166136261u;
+
+	while (*path != '\0') {
+		hash = (hash ^ (uint8_t) *path++) * 16777619u;
+	}
+
+	return hash;
+
+}
+
+/*
+ * Frees an entry that is not in the table anymore
+ *
+ * @param entry: the cache entry
+ */
+static void cache_free(cache_entry_t *entry) {
+
+	close(entry->fd);
+	free(entry->path);
+	free(entry);
+
+}
+
+/*
+ * Takes an entry out of the table. It is freed right away unless some
+ * connection still sends its file.
+ *
+ * @param slot: the table slot holding the entry
+ */
+static void cache_evict(cache_entry_t **slot) {
+
+	cache_entry_t *entry;
+
+	entry = *slot;
+	*slot = NULL;
+
+	entry->evicted = TRUE;
+
+	if (entry->refs == 0) {
+		cache_free(entry);
+	}
+
+}
+
+/*
+ * Gets an open descriptor and the size of a file. The entry must be given
+ * back with cache_release() once the file has been sent.
+ *
+ * @param path: the file path
+ * @return: the cache entry, or NULL when the calling thread has no cache
+ * or the file can not be opened
+ */
+cache_entry_t *cache_open(char *path) {
+
+	int fd;
+
+	uint64_t now;
+
+	cache_entry_t *entry, **slot;
+
+	struct stat file_info;
+
+	if (file_cache == NULL) {
+		return NULL;
+	}
+
+	now = get_time_ns() / 1000000;
+
+	slot = &(file_cache->slots[cache_hash(path) & (CACHE_SLOTS - 1)]);
+
+	if ((entry = *slot) != NULL && strcmp(entry->path, path) == 0
+		&& fstat(entry->fd, &file_info) == 0
+		&& file_info.st_mtime == entry->mtime
+		&& file_info.st_size == entry->size) {
+
+		if (now - entry->checked < CACHE_TTL) {
+			entry->refs++;
+			return entry;
+		}
+
+		/* Still the same file behind the path? */
+		if (stat(path, &file_info) == 0 && file_info.st_ino == entry->ino) {
+			entry->checked = now;
+			entry->refs++;
+			return entry;
+		}
+
+	}
+
+	if (*slot != NULL) {
+		cache_evict(slot);
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &file_info) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if ((entry = malloc(sizeof(cache_entry_t))) == NULL) {
+		handle_error("malloc");
+	}
+
+	if ((entry->path = strdup(path)) == NULL) {
+		handle_error("strdup");
+	}
+
+	entry->fd = fd;
+	entry->size = file_info.st_size;
+	entry->ino = file_info.st_ino;
+	entry->mtime = file_info.st_mtime;
+	entry->checked = now;
+	entry->refs = 1;
+	entry->evicted = FALSE;
+
+	*slot = entry;
+
+	return entry;
+
+}
+
+/*
+ * Gives back an entry obtained with cache_open()
+ *
+ * @param entry: the cache entry
+ */
+void cache_release(cache_entry_t *entry) {
+
+	entry->refs--;
+
+	if (entry->evicted && entry->refs == 0) {
+		cache_free(entry);
+	}
+
+}
\ No newline at end of file
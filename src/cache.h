@@ -0,0 +1,30 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#define CACHE_SLOTS			256			// open files kept per thread (power of two)
+#define CACHE_TTL			1000		// check an entry against the file system every second (ms)
+
+typedef struct cache_entry {
+	char *path;
+	int fd;
+	off_t size;
+	ino_t ino;
+	time_t mtime;
+	uint64_t checked;					// ms
+	uint32_t refs;						// connections sending the file
+	uint8_t evicted;
+} cache_entry_t;
+
+typedef struct cache {
+	cache_entry_t *slots[CACHE_SLOTS];
+} cache_t;
+
+void cache_init(int node);
+cache_entry_t *cache_open(char *path);
+void cache_release(cache_entry_t *entry);
+
+#endif
\ No newline at end of file
@@ -1,33 +1,216 @@
 /*
+ * Configuration file parsing and configuration snapshots.
+ *
+ * The configuration read at startup (conf) is the first snapshot. On SIGHUP
+ * the configuration thread reads the file again into a new snapshot and
+ * publishes it with an atomic exchange; the previous one is retired. A
+ * connection pins the snapshot that is current when it starts waiting for
+ * a request and serves the whole request with it, so a reload never
+ * changes the settings of a request halfway. Listener, process, thread and
+ * scheduler settings keep their startup values until a restart or an
+ * upgrade.
+ *
+ * Pinning a snapshot takes no lock: the thread announces the snapshot in
+ * its hazard slot, checks that it is still the current one and increments
+ * its reference count. The configuration thread frees a retired snapshot
+ * once no hazard slot points to it and no connection references it.
+ *
  * @author dhuertas
  * @email huertas.dani@gmail.com
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <stdint.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 /* local header files */
 #include "constants.h"
 #include "config.h"
+#include "queue.h"
 #include "util.h"
 
 extern config_t conf;
+
+/* configuration snapshot and virtual host of the request being served by
+ * the thread */
+__thread config_t *request_conf;
+__thread vhost_t *request_vhost;
+
+/* the snapshot new requests pin */
+static config_t *config_current = &conf;
+
+/* snapshots replaced by a reload, only touched by the configuration thread */
+static config_t *config_retired;
+
+static char *config_path;
+
+/* hazard slots, one per thread that has pinned a snapshot */
+static config_hazard_t *config_hazards;
+static __thread config_hazard_t *hazard;
+
+static pthread_key_t config_key;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Hashes a host name (FNV-1a), case insensitive
+ *
+ * @param name: the host name
+ * @param length: the length of the name
+ * @return: the hash value
+ */
+static uint32_t vhost_hash(char *name, size_t length) {
+
+	uint32_t hash;
+
+	size_t i;
+
+	hash = 2166136261u;
+
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t) tolower((uint8_t) name[i])) * 16777619u;
+	}
+
+	return hash;
+
+}
+
+/*
+ * Completes a virtual host with the top level settings it does not set.
+ * Error documents are inherited per status code.
+ *
+ * @param vhost: the virtual host
+ * @param parent: the default virtual host
+ */
+static void vhost_inherit(vhost_t *vhost, vhost_t *parent) {
+
+	int i, j;
+
+	error_document_t *document;
+
+	if (vhost->document_root == NULL && parent->document_root != NULL) {
+		vhost->document_root = strdup(parent->document_root);
+	}
+
+	if (vhost->directory_index_count == 0 && parent->directory_index_count > 0) {
+
+		vhost->directory_index = malloc(parent->directory_index_count * sizeof(char *));
+
+		for (i = 0; i < parent->directory_index_count; i++) {
+			vhost->directory_index[i] = strdup(parent->directory_index[i]);
+		}
+
+		vhost->directory_index_count = parent->directory_index_count;
+
+	}
+
+	for (i = 0; i < parent->error_documents_count; i++) {
+
+		for (j = 0; j < vhost->error_documents_count; j++) {
+			if (vhost->error_documents[j]->status_code == parent->error_documents[i]->status_code) break;
+		}
+
+		if (j < vhost->error_documents_count) {
+			continue;
+		}
+
+		document = malloc(sizeof(error_document_t));
+		document->status_code = parent->error_documents[i]->status_code;
+		document->file_path = strdup(parent->error_documents[i]->file_path);
+
+		vhost->error_documents = realloc(vhost->error_documents,
+			(vhost->error_documents_count + 1) * sizeof(error_document_t *));
+		vhost->error_documents[vhost->error_documents_count++] = document;
+
+	}
+
+	if (vhost->file_cache < 0) {
+		vhost->file_cache = parent->file_cache;
+	}
+
+}
+
+/*
+ * Builds the host name table of the virtual hosts: open addressing with
+ * linear probing, at most half full, so that a lookup hashes the Host
+ * header once and usually compares a single name. The first virtual host
+ * declaring a name gets it.
+ *
+ * @param config: the configuration
+ */
+static void vhost_index(config_t *config) {
+
+	int i, j;
+
+	uint32_t count, size, hash, slot;
+
+	vhost_t *vhost;
+
+	count = 0;
+
+	for (i = 0; i < config->vhosts_count; i++) {
+		count += config->vhosts[i]->names_count;
+	}
+
+	if (count == 0) {
+		return;
+	}
+
+	for (size = 2; size < 2 * count; size <<= 1);
+
+	config->vhost_table = malloc(size * sizeof(vhost_slot_t));
+	memset(config->vhost_table, 0, size * sizeof(vhost_slot_t));
+	config->vhost_table_size = size;
+
+	for (i = 0; i < config->vhosts_count; i++) {
+
+		vhost = config->vhosts[i];
+
+		for (j = 0; j < vhost->names_count; j++) {
+
+			hash = vhost_hash(vhost->names[j], strlen(vhost->names[j]));
+
+			for (slot = hash & (size - 1); config->vhost_table[slot].name != NULL; slot = (slot + 1) & (size - 1)) {
+				if (strcasecmp(config->vhost_table[slot].name, vhost->names[j]) == 0) break;
+			}
+
+			if (config->vhost_table[slot].name != NULL) {
+				continue;
+			}
+
+			config->vhost_table[slot].hash = hash;
+			config->vhost_table[slot].name = vhost->names[j];
+			config->vhost_table[slot].vhost = vhost;
+
+		}
+
+	}
+
+}
+
 /*
  * Reads the httpd.conf file for configuration options.
  *
- * @param conf_file_name: path to the config file
+ * @param config: where the options are stored
+ * @param file_path: path to the config file
+ * @return: 0 on success, -1 when the file can not be opened
  */
-void read_config(char *file_path) {
+static int parse_config(config_t *config, char *file_path) {
 
 	char buf[1], *line, *tmp;
 	char *value;
 
+	vhost_t *site;
+
 	int fd;
 	int length, line_length, readed;
 	int n, i, size, count, file_size;
@@ -43,16 +226,43 @@ void read_config(char *file_path) {
 	count = 0;
 	file_size = 0;
 
-	conf.http_version = malloc(strlen("HTTP/1.1") + 1);
-
-	memset(conf.http_version, 0, strlen("HTTP/1.1") + 1);
-	strncat(conf.http_version, "HTTP/1.1", strlen("HTTP/1.1"));
-
-	conf.directory_index_count = 0;
-	conf.error_documents_count = 0;
+	config->http_version = malloc(strlen("HTTP/1.1") + 1);
+
+	memset(config->http_version, 0, strlen("HTTP/1.1") + 1);
+	strncat(config->http_version, "HTTP/1.1", strlen("HTTP/1.1"));
+
+	site = &(config->vhost);
+	site->file_cache = -1;
+
+	config->server_mode = MODE_THREADS;
+	config->listen_mode = LISTEN_SHARED;
+	config->workers = 0;
+	config->reuseport_steering = FALSE;
+	config->thread_pool_size = 0;
+	config->thread_pool_min = 0;
+	config->thread_pool_max = 0;
+	config->thread_pool_idle = POOL_IDLE;
+	config->header_timeout = HEADER_TIMEOUT;
+	config->body_timeout = BODY_TIMEOUT;
+	config->send_timeout = SEND_TIMEOUT;
+	config->queue_capacity = QUEUE_CAPACITY;
+	config->listen_backlog = MAX_LISTEN;
+	config->listen_unix = NULL;
+	config->listen_unix_mode = LISTEN_UNIX_MODE;
+	config->listen_unix_group = NULL;
+	config->accept_batch = ACCEPT_BATCH;
+	config->defer_accept = 0;
+	config->fast_open = 0;
+	config->busy_poll = 0;
+	config->admission_budget = 0;
+	config->retry_after = RETRY_AFTER;
+	config->bulk_size = BULK_SIZE;
+	config->status_location = NULL;
+	config->cpu_affinity = NULL;
+	config->cpu_affinity_count = 0;
 
 	if ((fd = open(file_path, O_RDONLY, 0644)) < 0) {
-		handle_error("server_config: open");
+		return ERROR;
 	}
 	
 	file_size = lseek(fd, 0, SEEK_END);
@@ -78,7 +288,11 @@ void read_config(char *file_path) {
 			strncat(line, buf, 1);
 		}
 
-		if (line_length == 0 && strncmp(buf, "\n", 1) != 0) {
+		if (line_length == 0 && (buf[0] == ' ' || buf[0] == '\t')) {
+
+			/* indentation */
+
+		} else if (line_length == 0 && strncmp(buf, "\n", 1) != 0) {
 
 			line = malloc(2);
 			memset(line, 0, 2);
@@ -98,13 +312,52 @@ void read_config(char *file_path) {
 
 				/* ignore line */
 				
-			} else if (strncmp(line, "ServerName ", strlen("ServerName ")) == 0) {
+			} else if (strncmp(line, "ServerName ", strlen("ServerName ")) == 0
+				&& site == &(config->vhost)) {
 
 				length = line_length - strlen("ServerName ");
 
-				conf.server_name = malloc(length + 1);
-				memset(conf.server_name, 0, length + 1);
-				strncat(conf.server_name, value, strlen(value));
+				config->server_name = malloc(length + 1);
+				memset(config->server_name, 0, length + 1);
+				strncat(config->server_name, value, strlen(value));
+
+			} else if (strncmp(line, "ServerName ", strlen("ServerName ")) == 0
+				|| strncmp(line, "ServerAlias ", strlen("ServerAlias ")) == 0) {
+
+				/* Names of a virtual host, separated by spaces */
+				while (*value != '\0') {
+
+					length = strcspn(value, " \t");
+
+					if (length > 0) {
+						site->names = realloc(site->names, (site->names_count + 1) * sizeof(char *));
+						site->names[site->names_count++] = strndup(value, length);
+					}
+
+					value += length;
+					value += strspn(value, " \t");
+
+				}
+
+			} else if (strncmp(line, "<VirtualHost", strlen("<VirtualHost")) == 0) {
+
+				if ((site = malloc(sizeof(vhost_t))) == NULL) {
+					handle_error("malloc");
+				}
+
+				memset(site, 0, sizeof(vhost_t));
+				site->file_cache = -1;
+
+				config->vhosts = realloc(config->vhosts, (config->vhosts_count + 1) * sizeof(vhost_t *));
+				config->vhosts[config->vhosts_count++] = site;
+
+			} else if (strncmp(line, "</VirtualHost>", strlen("</VirtualHost>")) == 0) {
+
+				site = &(config->vhost);
+
+			} else if (strncmp(line, "FileCache ", strlen("FileCache ")) == 0) {
+
+				site->file_cache = (strncmp(value, "on", strlen("on")) == 0);
 
 			} else if (strncmp(line, "ServerRoot ", strlen("ServerRoot ")) == 0) {
 
@@ -112,15 +365,15 @@ void read_config(char *file_path) {
 
 				if (strncmp(&line[line_length - 1], "/", 1) == 0) {
 
-					conf.server_root = malloc(length);
-					memset(conf.server_root, 0, length);
-					strncat(conf.server_root, value, length - 1);
+					config->server_root = malloc(length);
+					memset(config->server_root, 0, length);
+					strncat(config->server_root, value, length - 1);
 
 				} else {
 
-					conf.server_root = malloc(length + 1);
-					memset(conf.server_root, 0, length + 1);
-					strncat(conf.server_root, value, length);
+					config->server_root = malloc(length + 1);
+					memset(config->server_root, 0, length + 1);
+					strncat(config->server_root, value, length);
 
 				}
 
@@ -130,63 +383,186 @@ void read_config(char *file_path) {
 
 				if (strncmp(&line[line_length - 1], "/", 1) == 0) {
 
-					conf.document_root = malloc(length);
-					memset(conf.document_root, 0, length);
-					strncat(conf.document_root, value, length - 1);
+					site->document_root = malloc(length);
+					memset(site->document_root, 0, length);
+					strncat(site->document_root, value, length - 1);
 
 				} else {
 
-					conf.document_root = malloc(length + 1);
-					memset(conf.document_root, 0, length + 1);
-					strncat(conf.document_root, value, length);
+					site->document_root = malloc(length + 1);
+					memset(site->document_root, 0, length + 1);
+					strncat(site->document_root, value, length);
 
 				}
 
 			} else if (strncmp(line, "ListenPort ", strlen("ListenPort ")) == 0) {
 
-				conf.listen_port = atoi(strchr(line, ' ') + sizeof(char));
+				config->listen_port = atoi(strchr(line, ' ') + sizeof(char));
+
+			} else if (strncmp(line, "Listen unix:", strlen("Listen unix:")) == 0) {
+
+				length = line_length - strlen("Listen unix:");
+
+				config->listen_unix = malloc(length + 1);
+				memset(config->listen_unix, 0, length + 1);
+				strncat(config->listen_unix, line + strlen("Listen unix:"), length);
+
+			} else if (strncmp(line, "ListenUnixMode ", strlen("ListenUnixMode ")) == 0) {
+
+				config->listen_unix_mode = strtol(value, NULL, 8);
+
+			} else if (strncmp(line, "ListenUnixGroup ", strlen("ListenUnixGroup ")) == 0) {
+
+				length = line_length - strlen("ListenUnixGroup ");
+
+				config->listen_unix_group = malloc(length + 1);
+				memset(config->listen_unix_group, 0, length + 1);
+				strncat(config->listen_unix_group, value, length);
 
 			} else if (strncmp(line, "DefaultCharset ", strlen("DefaultCharset ")) == 0) {
 
 				length = line_length - strlen("DefaultCharset ");
 
-				conf.charset = malloc(length + 1);
-				memset(conf.charset, 0, length + 1);
-				strncat(conf.charset, value, length);
+				config->charset = malloc(length + 1);
+				memset(config->charset, 0, length + 1);
+				strncat(config->charset, value, length);
 
 			} else if (strncmp(line, "DefaultType ", strlen("DefaultType ")) == 0) {
 
 				length = line_length - strlen("DefaultType ");
 
-				conf.default_type = malloc(length + 1);
-				memset(conf.default_type, 0, length + 1);
-				strncat(conf.default_type, value, length);
+				config->default_type = malloc(length + 1);
+				memset(config->default_type, 0, length + 1);
+				strncat(config->default_type, value, length);
 
 			} else if (strncmp(line, "ThreadPoolSize ", strlen("ThreadPoolSize ")) == 0) {
 
-				conf.thread_pool_size = atoi((strchr(line, ' ') + sizeof(char)));
-			
+				/* "auto" (or 0) sizes the pool after the CPU quota */
+				config->thread_pool_size = atoi((strchr(line, ' ') + sizeof(char)));
+
+			} else if (strncmp(line, "ThreadPoolMin ", strlen("ThreadPoolMin ")) == 0) {
+
+				config->thread_pool_min = atoi(value);
+
+			} else if (strncmp(line, "ThreadPoolMax ", strlen("ThreadPoolMax ")) == 0) {
+
+				config->thread_pool_max = atoi(value);
+
+			} else if (strncmp(line, "ThreadPoolIdle ", strlen("ThreadPoolIdle ")) == 0) {
+
+				config->thread_pool_idle = atoi(value);
+
+			} else if (strncmp(line, "QueueCapacity ", strlen("QueueCapacity ")) == 0) {
+
+				config->queue_capacity = atoi(value);
+
+			} else if (strncmp(line, "ListenBacklog ", strlen("ListenBacklog ")) == 0) {
+
+				config->listen_backlog = atoi(value);
+
+			} else if (strncmp(line, "AcceptBatch ", strlen("AcceptBatch ")) == 0) {
+
+				config->accept_batch = atoi(value);
+
+				if (config->accept_batch == 0) config->accept_batch = 1;
+
+			} else if (strncmp(line, "DeferAccept ", strlen("DeferAccept ")) == 0) {
+
+				config->defer_accept = atoi(value);
+
+			} else if (strncmp(line, "FastOpen ", strlen("FastOpen ")) == 0) {
+
+				config->fast_open = atoi(value);
+
+			} else if (strncmp(line, "AdmissionBudget ", strlen("AdmissionBudget ")) == 0) {
+
+				config->admission_budget = atoi(value);
+
+			} else if (strncmp(line, "RetryAfter ", strlen("RetryAfter ")) == 0) {
+
+				config->retry_after = atoi(value);
+
+			} else if (strncmp(line, "BulkSize ", strlen("BulkSize ")) == 0) {
+
+				config->bulk_size = atoi(value);
+
+			} else if (strncmp(line, "BusyPoll ", strlen("BusyPoll ")) == 0) {
+
+				config->busy_poll = atoi(value);
+
+			} else if (strncmp(line, "StatusLocation ", strlen("StatusLocation ")) == 0) {
+
+				length = line_length - strlen("StatusLocation ");
+
+				config->status_location = malloc(length + 1);
+				memset(config->status_location, 0, length + 1);
+				strncat(config->status_location, value, length);
+
+			} else if (strncmp(line, "ServerMode ", strlen("ServerMode ")) == 0) {
+
+				if (strncmp(value, "event", strlen("event")) == 0) {
+					config->server_mode = MODE_EVENT;
+				} else if (strncmp(value, "uring", strlen("uring")) == 0) {
+					config->server_mode = MODE_URING;
+				} else if (strncmp(value, "coroutine", strlen("coroutine")) == 0) {
+					config->server_mode = MODE_CORO;
+				} else if (strncmp(value, "percore", strlen("percore")) == 0) {
+					config->server_mode = MODE_PERCORE;
+				} else {
+					config->server_mode = MODE_THREADS;
+				}
+
+			} else if (strncmp(line, "Workers ", strlen("Workers ")) == 0) {
+
+				config->workers = atoi(value);
+
+			} else if (strncmp(line, "ListenMode ", strlen("ListenMode ")) == 0) {
+
+				if (strncmp(value, "reuseport", strlen("reuseport")) == 0) {
+					config->listen_mode = LISTEN_REUSEPORT;
+				} else {
+					config->listen_mode = LISTEN_SHARED;
+				}
+
+			} else if (strncmp(line, "ReusePortSteering ", strlen("ReusePortSteering ")) == 0) {
+
+				config->reuseport_steering = (strncmp(value, "on", strlen("on")) == 0);
+
+			} else if (strncmp(line, "CpuAffinity ", strlen("CpuAffinity ")) == 0) {
+
+				free(config->cpu_affinity);
+				config->cpu_affinity = NULL;
+
+				if (strncmp(value, "auto", strlen("auto")) == 0) {
+					config->cpu_affinity_count = allowed_cpus(&config->cpu_affinity);
+				} else if (strncmp(value, "off", strlen("off")) == 0) {
+					config->cpu_affinity_count = 0;
+				} else {
+					config->cpu_affinity_count = parse_cpu_list(value, &config->cpu_affinity);
+				}
+
 			} else if (strncmp(line, "OutputLevel ", strlen("OutputLevel ")) == 0) {
 
-				conf.output_level = atoi((strchr(line, ' ') + sizeof(char)));
+				config->output_level = atoi((strchr(line, ' ') + sizeof(char)));
 
 			} else if (strncmp(line, "DirectoryIndex ", strlen("DirectoryIndex ")) == 0) {
 
+				i = 0;
 				length = 0;
 				count = 0;
-				conf.directory_index_count = 0;
+				site->directory_index_count = 0;
 
 				while (value[i] != '\0') {
 					if (strncmp(&value[i], ",", 1) == 0) {
 						/* comma found */
-						conf.directory_index = realloc(conf.directory_index, (count + 1)*sizeof(char *));
-						conf.directory_index[count] = malloc(length + 1);
+						site->directory_index = realloc(site->directory_index, (count + 1)*sizeof(char *));
+						site->directory_index[count] = malloc(length + 1);
 						
-						memset(conf.directory_index[count], 0, length + 1);
-						strncat(conf.directory_index[count], &value[i-length], length);
+						memset(site->directory_index[count], 0, length + 1);
+						strncat(site->directory_index[count], &value[i-length], length);
 
 						length = 0;
-						conf.directory_index_count++;
+						site->directory_index_count++;
 						count++;
 
 					} else if (strncmp(&value[i], " ", 1) == 0) {
@@ -201,49 +577,61 @@ void read_config(char *file_path) {
 				/* reached end of line */
 				if (value[i-1] != ',') {
 
-					conf.directory_index = realloc(conf.directory_index, (count + 1)*sizeof(char *));
-					conf.directory_index[count] = malloc(length + 1);
-					memset(conf.directory_index[count], 0, length + 1);
-					strncat(conf.directory_index[count], &value[i-length], length);
-					conf.directory_index_count++;
+					site->directory_index = realloc(site->directory_index, (count + 1)*sizeof(char *));
+					site->directory_index[count] = malloc(length + 1);
+					memset(site->directory_index[count], 0, length + 1);
+					strncat(site->directory_index[count], &value[i-length], length);
+					site->directory_index_count++;
 
 				}
 
 			} else if (strncmp(line, "KeepAliveTimeout ", strlen("KeepAliveTimeout ")) == 0) {
 
-				conf.keep_alive_timeout = atoi((strchr(line, ' ') + sizeof(char)));
+				config->keep_alive_timeout = atoi((strchr(line, ' ') + sizeof(char)));
 
 			} else if (strncmp(line, "MaxKeepAliveRequests ", strlen("MaxKeepAliveRequests ")) == 0) {
 
-					conf.max_keep_alive_requests = atoi((strchr(line, ' ') + sizeof(char)));
+					config->max_keep_alive_requests = atoi((strchr(line, ' ') + sizeof(char)));
 
 			} else if (strncmp(line, "RequestTimeout ", strlen("RequestTimeout ")) == 0) {
 
-				conf.request_timeout = atoi((strchr(line, ' ') + sizeof(char)));
+				config->request_timeout = atoi((strchr(line, ' ') + sizeof(char)));
+
+			} else if (strncmp(line, "HeaderTimeout ", strlen("HeaderTimeout ")) == 0) {
+
+				config->header_timeout = atoi(value);
+
+			} else if (strncmp(line, "BodyTimeout ", strlen("BodyTimeout ")) == 0) {
+
+				config->body_timeout = atoi(value);
+
+			} else if (strncmp(line, "SendTimeout ", strlen("SendTimeout ")) == 0) {
+
+				config->send_timeout = atoi(value);
 
 			} else if (strncmp(line, "ErrorDocument ", strlen("ErrorDocument ")) == 0) {
 				
-				if (conf.error_documents_count == 0) {
+				if (site->error_documents_count == 0) {
 
-					conf.error_documents = malloc(sizeof(error_document_t *));
+					site->error_documents = malloc(sizeof(error_document_t *));
 
 				} else {
 
-					conf.error_documents = realloc(
-						conf.error_documents, 
-						(conf.error_documents_count + 1) * sizeof(error_document_t *));
+					site->error_documents = realloc(
+						site->error_documents, 
+						(site->error_documents_count + 1) * sizeof(error_document_t *));
 
 				}
 
-				conf.error_documents[conf.error_documents_count] = malloc(sizeof(error_document_t));
-				conf.error_documents[conf.error_documents_count]->file_path = malloc(strlen(strrchr(value, ' ') + sizeof(char)) + 1);
-				memset(conf.error_documents[conf.error_documents_count]->file_path, 0, strlen(strrchr(value, ' ') + sizeof(char)) + 1);
+				site->error_documents[site->error_documents_count] = malloc(sizeof(error_document_t));
+				site->error_documents[site->error_documents_count]->file_path = malloc(strlen(strrchr(value, ' ') + sizeof(char)) + 1);
+				memset(site->error_documents[site->error_documents_count]->file_path, 0, strlen(strrchr(value, ' ') + sizeof(char)) + 1);
 
 				sscanf(value, "%d %s", 
-					&(conf.error_documents[conf.error_documents_count]->status_code), 
-					conf.error_documents[conf.error_documents_count]->file_path);
+					&(site->error_documents[site->error_documents_count]->status_code), 
+					site->error_documents[site->error_documents_count]->file_path);
 
-				conf.error_documents_count++;
+				site->error_documents_count++;
 				
 			} else {
 
@@ -268,40 +656,521 @@ void read_config(char *file_path) {
 
 	}
 
-	n = sizeof(conf.directory_index) / sizeof(conf.directory_index[0]);
+	if (config->thread_pool_size == 0) {
+		config->thread_pool_size = cpu_count();
+	}
+
+	if (config->thread_pool_min == 0 || config->thread_pool_min > config->thread_pool_size) {
+		config->thread_pool_min = config->thread_pool_size;
+	}
 
-	if (conf.output_level >= DEBUG) {
+	if (config->thread_pool_max < config->thread_pool_size) {
+		config->thread_pool_max = config->thread_pool_size;
+	}
+
+	/* Shared nothing: every core accepts from its own listener */
+	if (config->server_mode == MODE_PERCORE) {
+		config->listen_mode = LISTEN_REUSEPORT;
+		config->reuseport_steering = TRUE;
+	}
+
+	/* Steering needs each worker on a known CPU */
+	if (config->listen_mode == LISTEN_REUSEPORT && config->reuseport_steering
+		&& config->cpu_affinity_count == 0) {
+		config->cpu_affinity_count = allowed_cpus(&config->cpu_affinity);
+	}
+
+	if (config->vhost.file_cache < 0) {
+		config->vhost.file_cache = TRUE;
+	}
+
+	for (i = 0; i < config->vhosts_count; i++) {
+		vhost_inherit(config->vhosts[i], &(config->vhost));
+	}
+
+	vhost_index(config);
+
+	if (config->output_level >= DEBUG) {
 
 		printf("Server configuration:\n");
-		printf("  Server root folder: %s\n", conf.server_root);
-		printf("  Document root folder: %s\n", conf.document_root);
-		printf("  Listen port: %d\n", conf.listen_port);
-		printf("  Default charset: %s\n", conf.charset);
-		printf("  Default type: %s\n", conf.default_type);
-		printf("  Thread pool size: %d\n", conf.thread_pool_size);
-		printf("  Output level: %d\n", conf.output_level);
+		printf("  Server root folder: %s\n", config->server_root);
+		printf("  Document root folder: %s\n", config->vhost.document_root);
+		printf("  Listen port: %d\n", config->listen_port);
+		printf("  Listen unix: %s (mode %04o, group %s)\n",
+			config->listen_unix != NULL ? config->listen_unix : "none", config->listen_unix_mode,
+			config->listen_unix_group != NULL ? config->listen_unix_group : "default");
+		printf("  Default charset: %s\n", config->charset);
+		printf("  Default type: %s\n", config->default_type);
+		printf("  Thread pool size: %d (min %d, max %d, idle %d s)\n",
+			config->thread_pool_size, config->thread_pool_min,
+			config->thread_pool_max, config->thread_pool_idle);
+		printf("  Queue capacity: %d\n", config->queue_capacity);
+		printf("  Listen backlog: %d\n", config->listen_backlog);
+		printf("  Accept batch: %d\n", config->accept_batch);
+		printf("  Defer accept: %d\n", config->defer_accept);
+		printf("  Fast open: %d\n", config->fast_open);
+		printf("  Busy poll: %d us\n", config->busy_poll);
+		printf("  Admission budget: %d ms (retry after %d s)\n", config->admission_budget, config->retry_after);
+		printf("  Bulk size: %d bytes\n", config->bulk_size);
+		printf("  Status location: %s\n", config->status_location != NULL ? config->status_location : "none");
+		printf("  Server mode: %s\n", config->server_mode == MODE_URING ? "uring" :
+			config->server_mode == MODE_CORO ? "coroutine" :
+			config->server_mode == MODE_PERCORE ? "percore" :
+			config->server_mode == MODE_EVENT ? "event" : "threads");
+		printf("  Workers: %d\n", config->workers);
+		printf("  Listen mode: %s\n", config->listen_mode == LISTEN_REUSEPORT ? "reuseport" : "shared");
+		printf("  Reuseport steering: %s\n", config->reuseport_steering ? "on" : "off");
+		printf("  CPU affinity: ");
+
+		for (i = 0; i < config->cpu_affinity_count; i++) {
+			printf("%d ", config->cpu_affinity[i]);
+		}
+
+		printf("%s\n", config->cpu_affinity_count == 0 ? "off" : "");
+		printf("  Output level: %d\n", config->output_level);
 		printf("  Directory index: ");
 
-		for (i = 0; i < conf.directory_index_count; i++) {
-			printf("%s ", conf.directory_index[i]);
+		for (i = 0; i < config->vhost.directory_index_count; i++) {
+			printf("%s ", config->vhost.directory_index[i]);
 		}
 
 		printf("\n");
 
-		printf("  Keep alive timeout: %d\n", conf.keep_alive_timeout);
-		printf("  Max keep alive requests: %d\n", conf.max_keep_alive_requests);
-		printf("  Request timeout: %d\n", conf.request_timeout);
+		printf("  Keep alive timeout: %d\n", config->keep_alive_timeout);
+		printf("  Max keep alive requests: %d\n", config->max_keep_alive_requests);
+		printf("  Request timeout: %d\n", config->request_timeout);
+		printf("  Header timeout: %d\n", config->header_timeout);
+		printf("  Body timeout: %d\n", config->body_timeout);
+		printf("  Send timeout: %d\n", config->send_timeout);
 
 		printf("  Error documents:\n");
 
-		for (i = 0; i < conf.error_documents_count; i++) {
+		for (i = 0; i < config->vhost.error_documents_count; i++) {
 			printf("    %d %s\n", 
-				conf.error_documents[i]->status_code, 
-				conf.error_documents[i]->file_path);
+				config->vhost.error_documents[i]->status_code, 
+				config->vhost.error_documents[i]->file_path);
+		}
+
+		printf("  File cache: %s\n", config->vhost.file_cache ? "on" : "off");
+
+		for (i = 0; i < config->vhosts_count; i++) {
+
+			printf("  Virtual host:");
+
+			for (n = 0; n < config->vhosts[i]->names_count; n++) {
+				printf(" %s", config->vhosts[i]->names[n]);
+			}
+
+			printf("\n    Document root folder: %s\n", config->vhosts[i]->document_root);
+			printf("    Directory index: ");
+
+			for (n = 0; n < config->vhosts[i]->directory_index_count; n++) {
+				printf("%s ", config->vhosts[i]->directory_index[n]);
+			}
+
+			printf("\n    Error documents: %d\n", config->vhosts[i]->error_documents_count);
+			printf("    File cache: %s\n", config->vhosts[i]->file_cache ? "on" : "off");
+
 		}
 
 	}
 
 	close(fd);
 
+	return 0;
+
+}
+
+/*
+ * Reads the httpd.conf file into the startup configuration. Exits when the
+ * file can not be read.
+ *
+ * @param file_path: path to the config file
+ */
+void read_config(char *file_path) {
+
+	if (parse_config(&conf, file_path) < 0) {
+		handle_error("server_config: open");
+	}
+
+}
+
+/*
+ * Finds the virtual host serving a Host header
+ *
+ * @param config: the configuration snapshot
+ * @param host: the Host header value, or NULL
+ * @return: the virtual host, the default one when no name matches
+ */
+vhost_t *vhost_lookup(config_t *config, char *host) {
+
+	size_t length;
+
+	uint32_t hash, slot, mask;
+
+	vhost_slot_t *entry;
+
+	if (host == NULL || config->vhost_table_size == 0) {
+		return &(config->vhost);
+	}
+
+	/* Without the port, nor the dot of a fully qualified name */
+	if (host[0] == '[') {
+		length = strcspn(host, "]") + 1;
+	} else {
+		length = strcspn(host, ": \t");
+	}
+
+	if (length > 1 && host[length - 1] == '.') {
+		length--;
+	}
+
+	hash = vhost_hash(host, length);
+	mask = config->vhost_table_size - 1;
+
+	for (slot = hash & mask; (entry = &(config->vhost_table[slot]))->name != NULL; slot = (slot + 1) & mask) {
+
+		if (entry->hash == hash && strncasecmp(entry->name, host, length) == 0
+			&& entry->name[length] == '\0') {
+			return entry->vhost;
+		}
+
+	}
+
+	return &(config->vhost);
+
+}
+
+/*
+ * Frees the settings of a virtual host
+ *
+ * @param vhost: the virtual host
+ */
+static void vhost_free(vhost_t *vhost) {
+
+	int i;
+
+	for (i = 0; i < vhost->names_count; i++) {
+		free(vhost->names[i]);
+	}
+
+	free(vhost->names);
+	free(vhost->document_root);
+
+	for (i = 0; i < vhost->directory_index_count; i++) {
+		free(vhost->directory_index[i]);
+	}
+
+	free(vhost->directory_index);
+
+	for (i = 0; i < vhost->error_documents_count; i++) {
+		free(vhost->error_documents[i]->file_path);
+		free(vhost->error_documents[i]);
+	}
+
+	free(vhost->error_documents);
+
+}
+
+/*
+ * Frees a snapshot read by config_reload()
+ *
+ * @param config: the snapshot
+ */
+static void config_free(config_t *config) {
+
+	int i;
+
+	free(config->server_name);
+	free(config->server_root);
+	free(config->http_version);
+	free(config->charset);
+	free(config->default_type);
+	free(config->status_location);
+	free(config->listen_unix);
+	free(config->listen_unix_group);
+	free(config->cpu_affinity);
+
+	vhost_free(&(config->vhost));
+
+	for (i = 0; i < config->vhosts_count; i++) {
+		vhost_free(config->vhosts[i]);
+		free(config->vhosts[i]);
+	}
+
+	free(config->vhosts);
+	free(config->vhost_table);
+
+	free(config);
+
+}
+
+/*
+ * Gives the hazard slot of an exiting thread back
+ *
+ * @param arg: the hazard slot
+ */
+static void config_hazard_release(void *arg) {
+
+	config_hazard_t *slot;
+
+	slot = arg;
+
+	__atomic_store_n(&(slot->config), NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&(slot->used), FALSE, __ATOMIC_RELEASE);
+
+}
+
+static void config_key_create(void) {
+
+	pthread_key_create(&config_key, config_hazard_release);
+
+}
+
+/*
+ * Takes a free hazard slot for the calling thread, or adds a new one. Slots
+ * are never removed from the list, so it can be walked without a lock.
+ *
+ * @return: the hazard slot
+ */
+static config_hazard_t *config_hazard_claim(void) {
+
+	uint8_t expected;
+
+	config_hazard_t *slot;
+
+	pthread_once(&config_once, config_key_create);
+
+	for (slot = __atomic_load_n(&config_hazards, __ATOMIC_ACQUIRE); slot != NULL; slot = slot->next) {
+
+		expected = FALSE;
+
+		if (__atomic_compare_exchange_n(&(slot->used), &expected, TRUE,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+
+	}
+
+	if (slot == NULL) {
+
+		if ((slot = malloc(sizeof(config_hazard_t))) == NULL) {
+			handle_error("malloc");
+		}
+
+		memset(slot, 0, sizeof(config_hazard_t));
+
+		slot->used = TRUE;
+		slot->next = __atomic_load_n(&config_hazards, __ATOMIC_RELAXED);
+
+		while ( ! __atomic_compare_exchange_n(&config_hazards, &(slot->next), slot,
+			FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	}
+
+	pthread_setspecific(config_key, slot);
+
+	return slot;
+
+}
+
+/*
+ * Pins the current configuration snapshot: it is not freed until
+ * config_release() is called. Lock free.
+ *
+ * @return: the snapshot
+ */
+config_t *config_acquire(void) {
+
+	config_t *config;
+
+	if (hazard == NULL) {
+		hazard = config_hazard_claim();
+	}
+
+	/* Once announced, the snapshot can only be freed if it is not the
+	 * current one anymore, which the second load tells */
+	do {
+
+		config = __atomic_load_n(&config_current, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&(hazard->config), config, __ATOMIC_SEQ_CST);
+
+	} while (config != __atomic_load_n(&config_current, __ATOMIC_SEQ_CST));
+
+	__atomic_add_fetch(&(config->refs), 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&(hazard->config), NULL, __ATOMIC_RELEASE);
+
+	return config;
+
+}
+
+/*
+ * Unpins a snapshot pinned with config_acquire()
+ *
+ * @param config: the snapshot
+ */
+void config_release(config_t *config) {
+
+	__atomic_sub_fetch(&(config->refs), 1, __ATOMIC_RELEASE);
+
+}
+
+/*
+ * Frees the retired snapshots nobody references anymore. The hazard slots
+ * are checked before the reference count: a thread that has not
+ * incremented the count yet still has the snapshot announced.
+ */
+static void config_reclaim(void) {
+
+	config_t *config, **link;
+	config_hazard_t *slot;
+
+	link = &config_retired;
+
+	while ((config = *link) != NULL) {
+
+		for (slot = __atomic_load_n(&config_hazards, __ATOMIC_ACQUIRE); slot != NULL; slot = slot->next) {
+			if (__atomic_load_n(&(slot->config), __ATOMIC_SEQ_CST) == config) break;
+		}
+
+		if (slot == NULL && __atomic_load_n(&(config->refs), __ATOMIC_SEQ_CST) == 0) {
+
+			*link = config->next;
+			config_free(config);
+
+		} else {
+
+			link = &(config->next);
+
+		}
+
+	}
+
+}
+
+/*
+ * Reads the configuration file again and publishes it as the current
+ * snapshot. Requests already started keep the snapshot they pinned.
+ *
+ * @return: 0 on success, -1 when the file can not be read or lacks a
+ * setting every request needs (the current snapshot is kept)
+ */
+int config_reload(void) {
+
+	config_t *config, *old;
+
+	if ((config = malloc(sizeof(config_t))) == NULL) {
+		handle_error("malloc");
+	}
+
+	memset(config, 0, sizeof(config_t));
+
+	if (parse_config(config, config_path) < 0) {
+		config_free(config);
+		return ERROR;
+	}
+
+	if (config->server_name == NULL || config->server_root == NULL
+		|| config->vhost.document_root == NULL || config->charset == NULL
+		|| config->default_type == NULL) {
+
+		config_free(config);
+		errno = EINVAL;
+
+		return ERROR;
+
+	}
+
+	old = __atomic_exchange_n(&config_current, config, __ATOMIC_SEQ_CST);
+
+	/* The startup snapshot is not allocated, it is never freed */
+	if (old != &conf) {
+		old->next = config_retired;
+		config_retired = old;
+	}
+
+	config_reclaim();
+
+	return 0;
+
+}
+
+/*
+ * Waits for SIGHUP and reloads the configuration, frees the retired
+ * snapshots in between
+ */
+static void *config_run(void *arg) {
+
+	sigset_t set;
+
+	struct timespec timeout;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+
+	while (1) {
+
+		timeout.tv_sec = CONFIG_RECLAIM_INTERVAL;
+		timeout.tv_nsec = 0;
+
+		if (sigtimedwait(&set, NULL, &timeout) != SIGHUP) {
+
+			config_reclaim();
+
+		} else if (config_reload() < 0) {
+
+			printf("Unable to reload the configuration from %s (%s)\n", config_path, strerror(errno));
+			fflush(stdout);
+
+		} else {
+
+			printf("Configuration reloaded\n");
+			fflush(stdout);
+
+		}
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Starts the thread reloading the configuration on SIGHUP. Must be called
+ * before any other thread is started: they inherit the blocked signal, so
+ * that only this thread gets it.
+ *
+ * @param file_path: path to the config file
+ */
+void config_watch(char *file_path) {
+
+	sigset_t set, all;
+
+	pthread_t thread;
+
+	/* A relative path would not survive a change of directory */
+	if ((config_path = realpath(file_path, NULL)) == NULL) {
+		config_path = file_path;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	/* Ignored until now in a worker process, see prefork_spawn() */
+	signal(SIGHUP, SIG_DFL);
+
+	/* The thread takes no signal but the one it waits for */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &set);
+
+	if (pthread_create(&thread, NULL, config_run, NULL) != 0) {
+		handle_error("pthread_create");
+	}
+
+	pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+	pthread_detach(thread);
+
 }
\ No newline at end of file
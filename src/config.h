@@ -5,30 +5,88 @@
 #ifndef __CONFIG_H
 #define __CONFIG_H
 
+#define CONFIG_RECLAIM_INTERVAL	1		// period of the checks for retired snapshots to be freed (s)
+
 typedef struct error_document {
 	int status_code;
 	char *file_path;
 } error_document_t;
 
+typedef struct vhost {
+	char **names;						// ServerName and ServerAlias
+	uint16_t names_count;
+	char *document_root;
+	char **directory_index;
+	uint16_t directory_index_count;
+	error_document_t **error_documents;
+	uint16_t error_documents_count;
+	int8_t file_cache;					// -1 until set, then inherited
+} vhost_t;
+
+/* host name table slot, see vhost_lookup() */
+typedef struct vhost_slot {
+	uint32_t hash;
+	char *name;
+	vhost_t *vhost;
+} vhost_slot_t;
+
 typedef struct config {
 	uint8_t output_level;
+	uint8_t server_mode;
+	uint8_t listen_mode;
+	uint16_t workers;
+	uint8_t reuseport_steering;
 	uint16_t listen_port;
+	char *listen_unix;					// path of the Unix listener, or NULL
+	uint16_t listen_unix_mode;
+	char *listen_unix_group;
 	uint16_t keep_alive_timeout;
 	uint16_t request_timeout;
+	uint16_t header_timeout;
+	uint16_t body_timeout;
+	uint16_t send_timeout;
 	uint32_t max_keep_alive_requests;
 	uint32_t thread_pool_size;
+	uint32_t thread_pool_min;
+	uint32_t thread_pool_max;
+	uint16_t thread_pool_idle;
+	uint32_t queue_capacity;
+	uint32_t listen_backlog;
+	uint32_t accept_batch;
+	uint32_t fast_open;
+	uint16_t defer_accept;
+	uint32_t busy_poll;
+	uint32_t admission_budget;
+	uint16_t retry_after;
+	uint32_t bulk_size;
+	int *cpu_affinity;
+	uint16_t cpu_affinity_count;
 	char *server_name;
 	char *server_root;
-	char *document_root;
 	char *http_version;
 	char *charset;
 	char *default_type;
-	char **directory_index;
-	uint16_t directory_index_count;
-	error_document_t **error_documents;
-	uint16_t error_documents_count;
+	char *status_location;
+	vhost_t vhost;						// the default virtual host: the top level settings
+	vhost_t **vhosts;
+	uint16_t vhosts_count;
+	vhost_slot_t *vhost_table;
+	uint32_t vhost_table_size;			// power of two
+	uint32_t refs;
+	struct config *next;
 } config_t;
 
+typedef struct config_hazard {
+	config_t *config;
+	uint8_t used;
+	struct config_hazard *next;
+} config_hazard_t;
+
 void read_config(char *conf_file_name);
+config_t *config_acquire(void);
+void config_release(config_t *config);
+int config_reload(void);
+void config_watch(char *file_path);
+vhost_t *vhost_lookup(config_t *config, char *host);
 
 #endif
\ No newline at end of file
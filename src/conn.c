@@ -0,0 +1,898 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "cache.h"
+#include "scan.h"
+#include "upgrade.h"
+#include "stats.h"
+#include "util.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL			46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL		69
+#endif
+
+extern config_t conf;
+extern __thread config_t *request_conf;
+extern __thread vhost_t *request_vhost;
+
+/* responses of pipelined requests waiting to be sent with the next one */
+typedef struct conn_batch {
+	int count;
+	size_t length;						// bytes of the batched responses
+	size_t sent;
+	char *buffers[CONN_BATCH_MAX];
+	size_t lengths[CONN_BATCH_MAX];
+	struct iovec iov[CONN_BATCH_MAX + 1];
+	struct msghdr msg;
+} conn_batch_t;
+
+/* connections open in the process */
+static uint32_t conn_open;
+
+/*
+ * Allocates the state of a new client connection
+ *
+ * @param sockfd: the client socket
+ * @return: the connection state
+ */
+conn_t *conn_new(int sockfd) {
+
+	int domain;
+
+	socklen_t length;
+
+	conn_t *conn;
+
+	if ((conn = malloc(sizeof(conn_t))) == NULL) {
+		handle_error("malloc");
+	}
+
+	memset(conn, 0, sizeof(conn_t));
+
+	conn->sockfd = sockfd;
+	conn->state = CONN_READING;
+	conn->file_fd = -1;
+
+	length = sizeof(domain);
+
+	if (getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX) {
+		conn->local = TRUE;
+	}
+
+	conn->response.file_exists = FALSE;
+
+	conn->config = config_acquire();
+
+	__atomic_add_fetch(&conn_open, 1, __ATOMIC_RELAXED);
+
+	return conn;
+
+}
+
+/*
+ * Releases everything related to the last request so the connection is
+ * ready to receive the next one, which is served with the configuration
+ * snapshot current by now.
+ *
+ * @param conn: the connection state
+ */
+void conn_reset(conn_t *conn) {
+
+	free_request(&(conn->request));
+	free_response(&(conn->response));
+
+	conn->response.file_exists = FALSE;
+
+	if (conn->out != NULL) {
+		free(conn->out);
+		conn->out = NULL;
+	}
+
+	conn->out_length = 0;
+	conn->out_sent = 0;
+
+	if (conn->cached != NULL) {
+		/* The descriptor belongs to the open file cache */
+		cache_release(conn->cached);
+		conn->cached = NULL;
+		conn->file_fd = -1;
+	} else if (conn->file_fd >= 0) {
+		close(conn->file_fd);
+		conn->file_fd = -1;
+	}
+
+	conn->file_offset = 0;
+	conn->file_size = 0;
+
+	/* The request is over, whatever follows it is the next one */
+	conn_consume(conn, conn->in_needed);
+	conn->in_needed = 0;
+
+	conn->state = CONN_READING;
+
+	config_release(conn->config);
+	conn->config = config_acquire();
+
+}
+
+/*
+ * Closes the client socket and frees the connection state
+ *
+ * @param thread_id: the thread id owning the connection
+ * @param conn: the connection state
+ */
+void conn_free(int thread_id, conn_t *conn) {
+
+	if (close(conn->sockfd) < 0) {
+
+		debug(conf.output_level,
+			"[%d] DEBUG: error closing socket (%s)\n",
+			thread_id, strerror(errno));
+
+	}
+
+	conn_detach(conn);
+
+}
+
+/*
+ * Frees the connection state but leaves the client socket open, e.g. to
+ * queue the bare socket
+ *
+ * @param conn: the connection state
+ */
+void conn_detach(conn_t *conn) {
+
+	int i;
+
+	conn_reset(conn);
+
+	config_release(conn->config);
+
+	if (conn->in != NULL) {
+		free(conn->in);
+	}
+
+	if (conn->batch != NULL) {
+
+		for (i = 0; i < conn->batch->count; i++) {
+			free(conn->batch->buffers[i]);
+		}
+
+		free(conn->batch);
+
+	}
+
+	if (conn->file_buffer != NULL) {
+		free(conn->file_buffer);
+	}
+
+	free(conn);
+
+	__atomic_sub_fetch(&conn_open, 1, __ATOMIC_RELAXED);
+
+}
+
+/*
+ * Counts the connections open in the process
+ */
+uint32_t conn_count(void) {
+
+	return __atomic_load_n(&conn_open, __ATOMIC_RELAXED);
+
+}
+
+/*
+ * Arms the connection timer with the deadline of what the connection is
+ * waiting for, counted from now. The timer belongs to conn->wheel.
+ *
+ * @param conn: the connection state
+ * @param timeout: the deadline (CONN_TIMEOUT_*)
+ */
+void conn_set_timeout(conn_t *conn, int timeout) {
+
+	int seconds;
+
+	switch (timeout) {
+
+		case CONN_TIMEOUT_HEADER:
+			seconds = conn->config->header_timeout;
+			break;
+
+		case CONN_TIMEOUT_BODY:
+			seconds = conn->config->body_timeout;
+			break;
+
+		case CONN_TIMEOUT_SEND:
+			seconds = conn->config->send_timeout;
+			break;
+
+		default:
+			seconds = conn->req_count == 0
+				? conn->config->request_timeout : conn->config->keep_alive_timeout;
+			break;
+
+	}
+
+	conn->timeout = timeout;
+
+	wheel_add(conn->wheel, &(conn->timer), get_time_ns() / 1000000 + seconds * 1000);
+
+}
+
+/*
+ * Sets or clears the O_NONBLOCK flag of a file descriptor
+ *
+ * @param sockfd: the file descriptor
+ * @param nonblocking: TRUE to make it non-blocking
+ */
+void set_nonblocking(int sockfd, int nonblocking) {
+
+	int flags;
+
+	if ((flags = fcntl(sockfd, F_GETFL, 0)) < 0) {
+		return;
+	}
+
+	if (nonblocking) {
+		flags |= O_NONBLOCK;
+	} else {
+		flags &= ~O_NONBLOCK;
+	}
+
+	fcntl(sockfd, F_SETFL, flags);
+
+}
+
+/*
+ * Bounds every blocking receive and send of a socket: they fail when no
+ * byte has moved for BodyTimeout (receive) or SendTimeout (send) seconds.
+ *
+ * @param sockfd: the client socket
+ */
+void set_io_timeouts(int sockfd) {
+
+	config_t *config;
+
+	struct timeval timeout;
+
+	config = config_acquire();
+
+	timeout.tv_sec = config->body_timeout;
+	timeout.tv_usec = 0;
+
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	timeout.tv_sec = config->send_timeout;
+	timeout.tv_usec = 0;
+
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	config_release(config);
+
+}
+
+/*
+ * Sends small segments right away (no Nagle, responses are written whole or
+ * corked with MSG_MORE) and, with BusyPoll, makes the kernel busy poll the
+ * network device for the socket instead of waiting for an interrupt. Not
+ * fatal when unsupported or not allowed.
+ *
+ * @param sockfd: the client socket
+ */
+void set_low_latency(int sockfd) {
+
+	int value;
+
+	value = 1;
+
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+
+	if (conf.busy_poll == 0) {
+		return;
+	}
+
+	value = conf.busy_poll;
+
+	setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+
+	value = 1;
+
+	/* Keeps device interrupts off while epoll busy polls (Linux 5.11) */
+	setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value));
+
+}
+
+/*
+ * Appends received bytes to the connection receive buffer
+ *
+ * @param conn: the connection state
+ * @param data: the received bytes
+ * @param length: number of received bytes
+ * @return: 0 on success, -1 when there is no memory left for them
+ */
+int conn_append(conn_t *conn, char *data, size_t length) {
+
+	if (conn_reserve(conn, conn->in_length + length) < 0) {
+		return ERROR;
+	}
+
+	memcpy(conn->in + conn->in_length, data, length);
+	conn->in_length += length;
+
+	return 0;
+
+}
+
+/*
+ * Makes room in the connection receive buffer. The request being served
+ * points into it, so it follows the buffer when it moves.
+ *
+ * @param conn: the connection state
+ * @param size: number of bytes the buffer must be able to hold
+ * @return: 0 on success, -1 when there is no memory left for it (the
+ * buffer is kept as it was)
+ */
+int conn_reserve(conn_t *conn, size_t size) {
+
+	char *in;
+
+	size_t in_size;
+
+	if (size <= conn->in_size) {
+		return 0;
+	}
+
+	in_size = conn->in_size > 0 ? conn->in_size : CONN_ALLOC_SIZE;
+
+	while (size > in_size) {
+		in_size *= 2;
+	}
+
+	if ((in = realloc(conn->in, in_size)) == NULL) {
+		errno = ENOMEM;
+		return ERROR;
+	}
+
+	if (in != conn->in && conn->in != NULL) {
+		rebase_request(&(conn->request), (intptr_t) ((uintptr_t) in - (uintptr_t) conn->in));
+	}
+
+	conn->in = in;
+	conn->in_size = in_size;
+
+	return 0;
+
+}
+
+/*
+ * Reads whatever the socket has, up to the free space of the receive
+ * buffer, right after the bytes already received. The buffer grows when
+ * it is full.
+ *
+ * @param conn: the connection state
+ * @param flags: recv() flags, e.g. MSG_DONTWAIT on a blocking socket
+ * @return: number of bytes received, 0 when the client closed the
+ * connection, -1 on error (errno is kept, EAGAIN included, ENOMEM when
+ * the buffer can not grow)
+ */
+ssize_t conn_receive(conn_t *conn, int flags) {
+
+	ssize_t n;
+
+	if (conn->in_length == conn->in_size && conn_reserve(conn, conn->in_length + 1) < 0) {
+		return ERROR;
+	}
+
+	while ((n = recv(conn->sockfd, conn->in + conn->in_length,
+		conn->in_size - conn->in_length, flags)) < 0 && errno == EINTR);
+
+	if (n > 0) {
+		conn->in_length += n;
+	}
+
+	return n;
+
+}
+
+/*
+ * Drops the first bytes of the connection receive buffer once they have
+ * been parsed. Whatever follows (e.g. a pipelined request) is kept.
+ *
+ * @param conn: the connection state
+ * @param length: number of bytes to drop
+ */
+void conn_consume(conn_t *conn, size_t length) {
+
+	if (length >= conn->in_length) {
+		conn->in_length = 0;
+		return;
+	}
+
+	memmove(conn->in, conn->in + length, conn->in_length - length);
+	conn->in_length -= length;
+
+}
+
+/*
+ * Tells whether the connection must be kept open after the response
+ *
+ * @param req: the request being answered
+ * @return: TRUE when the client asked for a persistent connection (and the
+ * process is not draining after an upgrade)
+ */
+int is_keep_alive(request_t *req) {
+
+	char *connection;
+
+	connection = NULL;
+
+	if (upgrade_draining()) {
+		/* Asked before the headers are built, so both agree */
+		return FALSE;
+	}
+
+	get_request_slot(req, HEADER_CONNECTION, &connection);
+
+	if (connection == NULL) {
+		/* Some http clients (e.g. curl) may not send the Connection header ... */
+		return FALSE;
+	} else if (strncasecmp(connection, "close", strlen("close")) == 0) {
+		return FALSE;
+	}
+
+	return TRUE;
+
+}
+
+/*
+ * Reads the file to be sent into the connection output, right after the
+ * headers, when it is small enough
+ *
+ * @param conn: the connection state
+ */
+static void conn_inline_file(conn_t *conn) {
+
+	char *out;
+
+	if (conn->file_fd < 0 || conn->file_size > CONN_INLINE_SIZE) {
+		return;
+	}
+
+	/* Left to be sent from the file */
+	if ((out = realloc(conn->out, conn->out_length + conn->file_size)) == NULL) {
+		return;
+	}
+
+	conn->out = out;
+
+	if (pread(conn->file_fd, conn->out + conn->out_length, conn->file_size, 0) != conn->file_size) {
+		return;
+	}
+
+	conn->out_length += conn->file_size;
+
+	if (conn->cached != NULL) {
+		cache_release(conn->cached);
+		conn->cached = NULL;
+	} else {
+		close(conn->file_fd);
+	}
+
+	conn->file_fd = -1;
+	conn->file_size = 0;
+
+}
+
+/*
+ * Generates the response for the parsed request and stores it in the
+ * connection output: the serialized headers and the file to be sent.
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection state
+ */
+void conn_prepare_response(int thread_id, conn_t *conn) {
+
+	int flags;
+
+	char *host;
+
+	struct stat file_info;
+
+	host = NULL;
+
+	get_request_slot(&(conn->request), HEADER_HOST, &host);
+
+	/* Read by the response helpers, see config_acquire() */
+	request_conf = conn->config;
+	request_vhost = vhost_lookup(conn->config, host);
+
+	flags = prepare_response(thread_id, &(conn->request), &(conn->response));
+
+	if (flags & SEND_HEADERS) {
+
+		conn->out_length = build_response_headers(&(conn->response), &(conn->out));
+
+		debug(conf.output_level,
+			"[%d] Response:\n%s",
+			thread_id, conn->out);
+
+	}
+
+	if ((flags & SEND_CONTENT) && (conn->response._mask & _RESPONSE_CONTENT)) {
+
+		conn->out = realloc(conn->out, conn->out_length + conn->response.content_length);
+
+		memcpy(conn->out + conn->out_length, conn->response.content, conn->response.content_length);
+		conn->out_length += conn->response.content_length;
+
+	} else if ((flags & SEND_CONTENT) && (conn->response._mask & _RESPONSE_FILE_PATH)) {
+
+		if (request_vhost->file_cache && (conn->cached = cache_open(conn->response.file_path)) != NULL) {
+
+			conn->file_fd = conn->cached->fd;
+			conn->file_size = conn->cached->size;
+
+		} else if ((conn->file_fd = open(conn->response.file_path, O_RDONLY | O_CLOEXEC)) < 0
+			|| fstat(conn->file_fd, &file_info) < 0) {
+
+			debug(conf.output_level,
+				"[%d] DEBUG: unable to open %s (%s)\n",
+				thread_id, conn->response.file_path, strerror(errno));
+
+			/* The Content-Length can not be honored, close after the headers */
+			conn->keep_alive = FALSE;
+
+		} else {
+
+			conn->file_size = file_info.st_size;
+
+		}
+
+		/* MSG_MORE does not hold the headers back on a Unix socket and
+		 * sendfile() copies through a pipe there: a small file goes in
+		 * the same write as the headers */
+		if (conn->local) {
+			conn_inline_file(conn);
+		}
+
+	}
+
+	conn->out_sent = 0;
+	conn->file_offset = 0;
+	conn->state = CONN_WRITING;
+
+}
+
+/*
+ * Holds the response back when the client has already sent the next
+ * request (pipelining): the response waits in the connection batch and
+ * the connection is reset to serve the next request. The batched
+ * responses go out along with the first response that can not wait, in a
+ * single write.
+ *
+ * @param thread_id: the thread id handling the connection
+ * @param conn: the connection state, with a prepared response
+ * @return: TRUE when the response has been batched and the next request
+ * is to be served, FALSE when the response must be sent now
+ */
+int conn_batch(int thread_id, conn_t *conn) {
+
+	conn_batch_t *batch;
+
+	if ( ! conn->keep_alive || conn->req_count + 1 > conn->config->max_keep_alive_requests) {
+		return FALSE;
+	}
+
+	/* Only worth it when the whole next request is in already */
+	if (scan_header_end(conn->in + conn->in_needed, conn->in_length - conn->in_needed) == NULL) {
+		return FALSE;
+	}
+
+	if ((batch = conn->batch) == NULL) {
+
+		if ((batch = malloc(sizeof(conn_batch_t))) == NULL) {
+			handle_error("malloc");
+		}
+
+		memset(batch, 0, sizeof(conn_batch_t));
+
+		conn->batch = batch;
+
+	}
+
+	/* A file is only batched when it can be sent from memory, and then
+	 * it counts against the batch size */
+	conn_inline_file(conn);
+
+	if (conn->file_fd >= 0) {
+		return FALSE;
+	}
+
+	if (batch->count == CONN_BATCH_MAX || batch->length + conn->out_length > CONN_BATCH_SIZE) {
+		return FALSE;
+	}
+
+	batch->buffers[batch->count] = conn->out;
+	batch->lengths[batch->count] = conn->out_length;
+	batch->length += conn->out_length;
+	batch->count++;
+
+	conn->out = NULL;
+	conn->out_length = 0;
+
+	conn->req_count++;
+
+	debug(conf.output_level,
+		"[%d] DEBUG: pipelined request, %d responses batched\n",
+		thread_id, batch->count);
+
+	conn_reset(conn);
+
+	return TRUE;
+
+}
+
+/*
+ * Tells whether batched responses are waiting to be sent
+ *
+ * @param conn: the connection state
+ * @return: number of batched responses
+ */
+int conn_batched(conn_t *conn) {
+
+	return conn->batch != NULL ? conn->batch->count : 0;
+
+}
+
+/*
+ * Describes the unsent bytes of the batched responses and of the current
+ * one, for a single sendmsg(). It is valid until the next call.
+ *
+ * @param conn: the connection state, with batched responses
+ * @return: the message to send
+ */
+struct msghdr *conn_batch_message(conn_t *conn) {
+
+	int i, n;
+
+	size_t offset;
+
+	conn_batch_t *batch;
+
+	batch = conn->batch;
+
+	offset = batch->sent;
+
+	for (i = 0, n = 0; i < batch->count; i++) {
+
+		if (offset >= batch->lengths[i]) {
+			offset -= batch->lengths[i];
+			continue;
+		}
+
+		batch->iov[n].iov_base = batch->buffers[i] + offset;
+		batch->iov[n].iov_len = batch->lengths[i] - offset;
+		n++;
+
+		offset = 0;
+
+	}
+
+	if (conn->out_sent < conn->out_length) {
+		batch->iov[n].iov_base = conn->out + conn->out_sent;
+		batch->iov[n].iov_len = conn->out_length - conn->out_sent;
+		n++;
+	}
+
+	memset(&(batch->msg), 0, sizeof(struct msghdr));
+
+	batch->msg.msg_iov = batch->iov;
+	batch->msg.msg_iovlen = n;
+
+	return &(batch->msg);
+
+}
+
+/*
+ * Accounts the bytes sent, batched responses first. Once they are all
+ * sent the batch is emptied.
+ *
+ * @param conn: the connection state
+ * @param length: number of bytes sent
+ */
+void conn_sent(conn_t *conn, size_t length) {
+
+	int i;
+
+	conn_batch_t *batch;
+
+	if ((batch = conn->batch) != NULL && batch->count > 0) {
+
+		if (length < batch->length - batch->sent) {
+			batch->sent += length;
+			return;
+		}
+
+		length -= batch->length - batch->sent;
+
+		for (i = 0; i < batch->count; i++) {
+			free(batch->buffers[i]);
+		}
+
+		batch->count = 0;
+		batch->length = 0;
+		batch->sent = 0;
+
+	}
+
+	conn->out_sent += length;
+
+}
+
+/*
+ * Writes as much of the pending response as the socket accepts without
+ * blocking. Batched responses and headers are sent first and the file
+ * content follows with sendfile().
+ *
+ * @param thread_id: the thread id handling the connection
+ * @param conn: the connection state
+ * @return: 1 when the whole response has been sent, 0 when the socket is
+ * not writable anymore, -1 on error
+ */
+int conn_flush(int thread_id, conn_t *conn) {
+
+	return conn_flush_limit(thread_id, conn, -1);
+
+}
+
+/*
+ * Same as conn_flush() but sends at most limit bytes of the file, so that
+ * a large transfer can be interrupted between chunks.
+ *
+ * @param thread_id: the thread id handling the connection
+ * @param conn: the connection state
+ * @param limit: maximum number of file bytes to send (-1 = no limit)
+ * @return: 1 when the whole response has been sent, CONN_FLUSH_MORE when
+ * the limit has been reached, 0 when the socket is not writable anymore,
+ * -1 on error
+ */
+int conn_flush_limit(int thread_id, conn_t *conn, off_t limit) {
+
+	ssize_t w;
+
+	size_t count;
+
+	while (conn_batched(conn) > 0) {
+
+		w = sendmsg(conn->sockfd, conn_batch_message(conn),
+			MSG_NOSIGNAL | (conn->file_fd >= 0 ? MSG_MORE : 0));
+
+		if (w < 0) {
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			}
+
+			debug(conf.output_level,
+				"[%d] DEBUG: unable to send pipelined responses (%s)\n",
+				thread_id, strerror(errno));
+
+			return ERROR;
+
+		}
+
+		conn_sent(conn, w);
+
+		stats_add(&(stats.bytes_sent), w);
+
+	}
+
+	while (conn->out_sent < conn->out_length) {
+
+		w = send(conn->sockfd,
+			conn->out + conn->out_sent,
+			conn->out_length - conn->out_sent,
+			MSG_NOSIGNAL | (conn->file_fd >= 0 ? MSG_MORE : 0));
+
+		if (w < 0) {
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			}
+
+			debug(conf.output_level,
+				"[%d] DEBUG: unable to send response headers (%s)\n",
+				thread_id, strerror(errno));
+
+			return ERROR;
+
+		}
+
+		conn->out_sent += w;
+
+		stats_add(&(stats.bytes_sent), w);
+
+	}
+
+	while (conn->file_fd >= 0 && conn->file_offset < conn->file_size) {
+
+		if (limit == 0) {
+			return CONN_FLUSH_MORE;
+		}
+
+		count = conn->file_size - conn->file_offset;
+
+		if (limit > 0 && count > (size_t) limit) {
+			count = limit;
+		}
+
+		w = sendfile(conn->sockfd,
+			conn->file_fd,
+			&(conn->file_offset),
+			count);
+
+		if (w < 0) {
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			}
+
+			debug(conf.output_level,
+				"[%d] DEBUG: unable to send response content (%s)\n",
+				thread_id, strerror(errno));
+
+			return ERROR;
+
+		} else if (w == 0) {
+			/* The file has been truncated while sending it */
+			return ERROR;
+		}
+
+		stats_add(&(stats.bytes_sent), w);
+
+		if (limit > 0) {
+			limit -= w;
+		}
+
+	}
+
+	return 1;
+
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __CONN_H
+#define __CONN_H
+
+/* connection states */
+#define CONN_READING		0			// waiting for a complete request
+#define CONN_WRITING		1			// flushing the response
+#define CONN_BODY			2			// header parsed, waiting for the message body
+
+/* connection deadlines */
+#define CONN_TIMEOUT_IDLE	0			// waiting for a request (RequestTimeout, then KeepAliveTimeout)
+#define CONN_TIMEOUT_HEADER	1			// receiving the header block (HeaderTimeout)
+#define CONN_TIMEOUT_BODY	2			// receiving the message body (BodyTimeout)
+#define CONN_TIMEOUT_SEND	3			// sending the response (SendTimeout)
+
+#define CONN_ALLOC_SIZE		4096		// initial size of the receive buffer
+#define CONN_FLUSH_CHUNK	262144		// file bytes sent between two checks of a bulk transfer time slice
+#define CONN_INLINE_SIZE	65536		// files sent along with the headers on a Unix socket, up to (bytes)
+#define CONN_BATCH_MAX		32			// pipelined responses sent in a single write, at most
+#define CONN_BATCH_SIZE		131072		// bytes of pipelined responses held back, at most
+
+/* conn_flush_limit() result when the limit has been reached */
+#define CONN_FLUSH_MORE		2
+
+typedef struct conn {
+	int sockfd;
+	uint8_t local;						// Unix domain socket
+	uint8_t state;
+	uint8_t keep_alive;
+	uint8_t bulk;
+	uint32_t req_count;
+	config_t *config;
+	uint8_t timeout;
+	wheel_t *wheel;
+	wheel_timer_t timer;
+	uint64_t queued_at;
+	char *out;
+	size_t out_length;
+	size_t out_sent;
+	int file_fd;
+	off_t file_offset;
+	off_t file_size;
+	char *file_buffer;
+	struct cache_entry *cached;
+	struct conn_batch *batch;
+	char *in;
+	size_t in_length;
+	size_t in_size;
+	size_t in_needed;
+	uint16_t pending;
+	uint8_t recv_armed;
+	uint8_t closing;
+	uint32_t coro;
+	request_t request;
+	response_t response;
+	struct conn *prev;
+	struct conn *next;
+} conn_t;
+
+conn_t *conn_new(int sockfd);
+void conn_reset(conn_t *conn);
+void conn_free(int thread_id, conn_t *conn);
+void conn_detach(conn_t *conn);
+uint32_t conn_count(void);
+void conn_set_timeout(conn_t *conn, int timeout);
+void set_nonblocking(int sockfd, int nonblocking);
+void set_io_timeouts(int sockfd);
+void set_low_latency(int sockfd);
+int conn_append(conn_t *conn, char *data, size_t length);
+int conn_reserve(conn_t *conn, size_t size);
+ssize_t conn_receive(conn_t *conn, int flags);
+void conn_consume(conn_t *conn, size_t length);
+int is_keep_alive(request_t *req);
+void conn_prepare_response(int thread_id, conn_t *conn);
+int conn_batch(int thread_id, conn_t *conn);
+int conn_batched(conn_t *conn);
+struct msghdr *conn_batch_message(conn_t *conn);
+void conn_sent(conn_t *conn, size_t length);
+int conn_flush(int thread_id, conn_t *conn);
+int conn_flush_limit(int thread_id, conn_t *conn, off_t limit);
+
+#endif
\ No newline at end of file
@@ -8,9 +8,18 @@
 #ifndef __CONSTANTS_H
 #define __CONSTANTS_H
 
-#define MAX_LISTEN		30
+#define MAX_LISTEN		30			// default listen backlog
+#define LISTEN_UNIX_MODE	0660	// default permissions of the Unix listener socket file
+#define ACCEPT_BATCH	64			// default connections accepted per wakeup
 #define MAX_THREADS		10
+#define POOL_IDLE		30			// default seconds before an idle worker retires
+#define HEADER_TIMEOUT	10			// default seconds to receive a whole header block
+#define BODY_TIMEOUT	10			// default seconds without progress receiving a body
+#define SEND_TIMEOUT	30			// default seconds without progress sending a response
+#define RETRY_AFTER		1			// default seconds a shed client is told to wait
+#define BULK_SIZE		1048576		// default size of a response sent in time slices (bytes)
 #define MAX_DATE_SIZE 	64
+#define DATE_CACHE_SLOTS	2		// date formats cached per thread
 #define MAX_BUFFER		1024
 
 /* OUTPUT LEVEL */
@@ -50,6 +59,21 @@
 #define TIME_OUT		10			// Keep Alive timeout 10 seconds
 #define RECV_TIME_OUT	10
 
+/*
+ * SERVER MODES
+ */
+#define MODE_THREADS	0			// one pool thread per connection
+#define MODE_EVENT		1			// epoll event loops
+#define MODE_URING		2			// io_uring loops, falls back to MODE_EVENT
+#define MODE_CORO		3			// coroutine handlers on epoll event loops
+#define MODE_PERCORE	4			// shared nothing epoll event loops, one per core
+
+/*
+ * LISTEN MODES
+ */
+#define LISTEN_SHARED		0		// one listener, one acceptor thread
+#define LISTEN_REUSEPORT	1		// one SO_REUSEPORT listener per worker
+
 /*
  * ERRORS
  */
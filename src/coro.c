@@ -0,0 +1,182 @@
+/*
+ * Coroutine connection handlers. Each connection runs the request path as
+ * straight-line code (read the header, read the body, answer, repeat) that
+ * suspends whenever the socket would block and is resumed by an event loop
+ * once it is ready again. Coroutines are stackless: a connection costs its
+ * conn_t and receive buffer, a few KB, instead of a thread.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "coro.h"
+#include "util.h"
+
+extern config_t conf;
+
+/*
+ * Appends whatever the socket has available to the connection receive
+ * buffer
+ *
+ * @param thread_id: the thread id running the coroutine
+ * @param conn: the connection state
+ * @param buffer: scratch buffer to receive into
+ * @param size: size of the scratch buffer
+ * @return: number of bytes received, 0 when the socket would block, -1 on
+ * error or when the client closed the connection
+ */
+static int coro_recv(int thread_id, conn_t *conn, char *buffer, size_t size) {
+
+	ssize_t n;
+
+	while ((n = recv(conn->sockfd, buffer, size, 0)) < 0 && errno == EINTR);
+
+	if (n < 0) {
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+
+		debug(conf.output_level,
+			"[%d] DEBUG: unable to receive request (%s)\n",
+			thread_id, strerror(errno));
+
+		return ERROR;
+
+	} else if (n == 0) {
+
+		debug(conf.output_level,
+			"[%d] DEBUG: client closed connection\n",
+			thread_id);
+
+		return ERROR;
+
+	}
+
+	if (conn_append(conn, buffer, n) < 0) {
+		reject_message_body(thread_id, conn);
+		return ERROR;
+	}
+
+	return n;
+
+}
+
+/*
+ * Runs the connection until it would block or is over. Called again, it
+ * resumes right where it was suspended.
+ *
+ * @param thread_id: the thread id running the coroutine
+ * @param conn: the connection state
+ * @param buffer: scratch buffer to receive into
+ * @param size: size of the scratch buffer
+ * @return: CORO_READ or CORO_WRITE when suspended, CORO_DONE when the
+ * connection must be closed
+ */
+int conn_coroutine(int thread_id, conn_t *conn, char *buffer, size_t size) {
+
+	int r;
+
+	CORO_BEGIN(&(conn->coro));
+
+	while (1) {
+
+		/* Receive until the whole header block is in */
+		while ((r = parse_request_header(thread_id, conn)) == 0) {
+
+			if ((r = coro_recv(thread_id, conn, buffer, size)) < 0) {
+				break;
+			} else if (r == 0) {
+				CORO_YIELD(&(conn->coro), CORO_READ);
+			} else if (conn->timeout == CONN_TIMEOUT_IDLE) {
+				/* The request has started, the whole header block is due now */
+				conn_set_timeout(conn, CONN_TIMEOUT_HEADER);
+			}
+
+		}
+
+		/* A rejected request only has its error response left to send */
+		if (r < 0 && conn->state != CONN_WRITING) {
+			CORO_EXIT(&(conn->coro));
+		}
+
+		if (conn->state != CONN_WRITING && conn->in_length < conn->in_needed) {
+			conn_set_timeout(conn, CONN_TIMEOUT_BODY);
+		}
+
+		/* Receive the message body, if any, as long as it keeps coming */
+		while (conn->state != CONN_WRITING && conn->in_length < conn->in_needed) {
+
+			if ((r = coro_recv(thread_id, conn, buffer, size)) < 0) {
+
+				if (conn->state != CONN_WRITING) {
+					CORO_EXIT(&(conn->coro));
+				}
+
+			} else if (r == 0) {
+				CORO_YIELD(&(conn->coro), CORO_READ);
+			} else {
+				conn_set_timeout(conn, CONN_TIMEOUT_BODY);
+			}
+
+		}
+
+		if (conn->state != CONN_WRITING) {
+
+			parse_request_body(thread_id, conn);
+
+			conn->keep_alive = is_keep_alive(&(conn->request));
+
+			conn_prepare_response(thread_id, conn);
+
+			/* Pipelined requests already received are answered in a single write */
+			if (conn_batch(thread_id, conn)) {
+				continue;
+			}
+
+		}
+
+		/* Send the response, as long as the client keeps reading it */
+		while ((r = conn_flush(thread_id, conn)) == 0) {
+
+			conn_set_timeout(conn, CONN_TIMEOUT_SEND);
+
+			CORO_YIELD(&(conn->coro), CORO_WRITE);
+
+		}
+
+		if (r < 0) {
+			CORO_EXIT(&(conn->coro));
+		}
+
+		conn->req_count++;
+
+		if ( ! conn->keep_alive || conn->req_count > conn->config->max_keep_alive_requests) {
+			CORO_EXIT(&(conn->coro));
+		}
+
+		conn_reset(conn);
+
+		conn_set_timeout(conn, CONN_TIMEOUT_IDLE);
+
+	}
+
+	CORO_END(&(conn->coro));
+
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __CORO_H
+#define __CORO_H
+
+/* why a connection coroutine returned */
+#define CORO_DONE		0			// finished, the connection must be closed
+#define CORO_READ		1			// suspended until the socket is readable
+#define CORO_WRITE		2			// suspended until the socket is writable
+
+/*
+ * Stackless coroutines: the resume point is the only state kept between
+ * calls, so local variables do not survive a CORO_YIELD and no switch
+ * statement may enclose one.
+ */
+#define CORO_BEGIN(pc)			switch (*(pc)) { case 0:
+#define CORO_YIELD(pc, status)	do { *(pc) = __LINE__; return (status); case __LINE__:; } while (0)
+#define CORO_EXIT(pc)			do { *(pc) = 0; return CORO_DONE; } while (0)
+#define CORO_END(pc)			} *(pc) = 0; return CORO_DONE
+
+int conn_coroutine(int thread_id, conn_t *conn, char *buffer, size_t size);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,607 @@
+/*
+ * Event driven connection engine. Each pool thread runs an epoll loop
+ * (edge-triggered, non-blocking sockets) and multiplexes many connections.
+ * The per-request step is still handle_request() and prepare_response(),
+ * but it only runs once the whole request header is in the connection
+ * buffer, the message body is received as it arrives (CONN_BODY), and the
+ * response is flushed whenever the socket is writable.
+ *
+ * In coroutine mode the loops resume the connection coroutines instead (see
+ * coro.c).
+ *
+ * In percore mode the loops share nothing: each one is pinned to its CPU,
+ * accepts from its own listener and keeps its own statistics, access log
+ * buffer and open file cache, all allocated from the memory of its node.
+ *
+ * Connections are either accepted by the main thread and handed over to the
+ * loops, or accepted by each loop from its own SO_REUSEPORT listener.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "cache.h"
+#include "coro.h"
+#include "event.h"
+#include "listener.h"
+#include "upgrade.h"
+#include "stats.h"
+#include "util.h"
+
+extern config_t conf;
+
+static reactor_t *reactors;
+
+/*
+ * Removes the connection from the event loop, closes it and frees it
+ *
+ * @param reactor: the event loop owning the connection
+ * @param conn: the connection state
+ */
+static void reactor_close(reactor_t *reactor, conn_t *conn) {
+
+	wheel_cancel(&(conn->timer));
+
+	reactor->num_conns--;
+
+	conn_free(reactor->id, conn);
+
+}
+
+/*
+ * Registers a new connection in the event loop
+ *
+ * @param reactor: the event loop that will own the connection
+ * @param conn: the connection state
+ */
+static void reactor_add(reactor_t *reactor, conn_t *conn) {
+
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = conn;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, conn->sockfd, &event) < 0) {
+
+		debug(conf.output_level,
+			"[%d] DEBUG: unable to watch socket %d (%s)\n",
+			reactor->id, conn->sockfd, strerror(errno));
+
+		conn_free(reactor->id, conn);
+
+		return;
+
+	}
+
+	conn->wheel = &(reactor->wheel);
+	conn_set_timeout(conn, CONN_TIMEOUT_IDLE);
+
+	reactor->num_conns++;
+
+	debug(conf.output_level,
+		"[%d] DEBUG: handling connection at socket %d (%d open)\n",
+		reactor->id, conn->sockfd, reactor->num_conns);
+
+}
+
+/*
+ * Advances the connection as far as possible without blocking: flushes the
+ * pending response and serves every complete request already received.
+ *
+ * @param reactor: the event loop owning the connection
+ * @param conn: the connection state
+ */
+static void conn_process(reactor_t *reactor, conn_t *conn) {
+
+	int n, r;
+
+	while (1) {
+
+		if (conn->state == CONN_WRITING) {
+
+			if ((r = conn_flush(reactor->id, conn)) < 0) {
+
+				reactor_close(reactor, conn);
+				return;
+
+			} else if (r == 0) {
+				/* Socket buffer is full, wait until it is writable again */
+				conn_set_timeout(conn, CONN_TIMEOUT_SEND);
+				return;
+
+			}
+
+			conn->req_count++;
+
+			if ( ! conn->keep_alive || conn->req_count > conn->config->max_keep_alive_requests) {
+
+				reactor_close(reactor, conn);
+				return;
+
+			}
+
+			conn_reset(conn);
+
+			conn_set_timeout(conn, CONN_TIMEOUT_IDLE);
+
+		}
+
+		/* Only parse the request once the whole header block is available */
+		if (conn->state == CONN_READING) {
+
+			if ((r = parse_request_header(reactor->id, conn)) < 0) {
+
+				/* The error response, if any, goes out as any other */
+				if (conn->state == CONN_WRITING) {
+					continue;
+				}
+
+				reactor_close(reactor, conn);
+				return;
+
+			} else if (r == 0) {
+
+				if ((n = conn_receive(conn, 0)) < 0) {
+
+					if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						reactor_close(reactor, conn);
+					} else if (conn->in_length > 0 && conn->timeout == CONN_TIMEOUT_IDLE) {
+						/* The request has started, the whole header block is due now */
+						conn_set_timeout(conn, CONN_TIMEOUT_HEADER);
+					}
+
+					return;
+
+				} else if (n == 0) {
+
+					debug(conf.output_level,
+						"[%d] DEBUG: client closed connection\n",
+						reactor->id);
+
+					reactor_close(reactor, conn);
+					return;
+
+				}
+
+				continue;
+
+			}
+
+			conn->state = CONN_BODY;
+
+			if (conn->in_length < conn->in_needed) {
+				conn_set_timeout(conn, CONN_TIMEOUT_BODY);
+			}
+
+		}
+
+		/* Receive the message body, if any, as long as it keeps coming. The
+		 * other connections of the reactor are served in the meantime. */
+		if (conn->in_length < conn->in_needed) {
+
+			if ((n = conn_receive(conn, 0)) < 0) {
+
+				if (errno == ENOMEM) {
+
+					reject_message_body(reactor->id, conn);
+
+					if (conn->state == CONN_WRITING) {
+						continue;
+					}
+
+					reactor_close(reactor, conn);
+
+				} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					reactor_close(reactor, conn);
+				}
+
+				return;
+
+			} else if (n == 0) {
+
+				debug(conf.output_level,
+					"[%d] DEBUG: client closed connection\n",
+					reactor->id);
+
+				reactor_close(reactor, conn);
+				return;
+
+			}
+
+			conn_set_timeout(conn, CONN_TIMEOUT_BODY);
+
+			continue;
+
+		}
+
+		parse_request_body(reactor->id, conn);
+
+		conn->keep_alive = is_keep_alive(&(conn->request));
+
+		conn_prepare_response(reactor->id, conn);
+
+		/* Pipelined requests already received are answered in a single write */
+		conn_batch(reactor->id, conn);
+
+	}
+
+}
+
+/*
+ * Resumes the connection coroutine and closes the connection once it is
+ * over (coroutine mode)
+ *
+ * @param reactor: the event loop owning the connection
+ * @param conn: the connection state
+ */
+static void conn_resume(reactor_t *reactor, conn_t *conn) {
+
+	if (conn_coroutine(reactor->id, conn, reactor->peek_buffer, REQUEST_MAX_SIZE) == CORO_DONE) {
+		reactor_close(reactor, conn);
+	}
+
+}
+
+/*
+ * Closes the connections whose deadline is over
+ *
+ * @param reactor: the event loop
+ */
+static void reactor_expire(reactor_t *reactor) {
+
+	conn_t *conn;
+
+	wheel_timer_t *timer, *next;
+
+	timer = wheel_advance(&(reactor->wheel), get_time_ns() / 1000000);
+
+	while (timer != NULL) {
+
+		next = timer->next;
+
+		conn = WHEEL_ENTRY(timer, conn_t, timer);
+
+		debug(conf.output_level,
+			"[%d] DEBUG: connection timed out\n",
+			reactor->id);
+
+		stats_add(&(stats.timed_out), 1);
+
+		reactor_close(reactor, conn);
+
+		timer = next;
+
+	}
+
+}
+
+/*
+ * Accepts every pending connection of an event loop listener
+ *
+ * @param reactor: the event loop
+ * @param listen_sockfd: its own listener or the Unix one
+ */
+static void reactor_accept(reactor_t *reactor, int listen_sockfd) {
+
+	int sockfd;
+
+	socklen_t client_size;
+
+	struct sockaddr_in client_addr;
+
+	if (upgrade_draining()) {
+		/* The new process accepts from the same listener now */
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, listen_sockfd, NULL);
+		return;
+	}
+
+	while (1) {
+
+		client_size = sizeof(client_addr);
+
+		sockfd = accept4(listen_sockfd,
+			(struct sockaddr *) &client_addr, &client_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (sockfd < 0) {
+
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				debug(conf.output_level,
+					"[%d] DEBUG: accept failed (%s)\n",
+					reactor->id, strerror(errno));
+			}
+
+			return;
+
+		}
+
+		set_low_latency(sockfd);
+
+		stats_add(&(stats.accepted), 1);
+
+		reactor_add(reactor, conn_new(sockfd));
+
+		log_client(&client_addr);
+
+	}
+
+}
+
+static void *reactor_run(void *arg) {
+
+	conn_t *conn, *inbox;
+
+	int i, n, cpu, timeout;
+
+	uint64_t value, spin_until;
+
+	struct epoll_event events[EVENT_MAX_EVENTS];
+
+	reactor_t *reactor;
+
+	reactor = (reactor_t *) arg;
+
+	if ((cpu = worker_cpu(reactor->id)) >= 0 && pin_thread(cpu) < 0) {
+		debug(conf.output_level, "[%d] DEBUG: unable to pin thread to cpu %d\n", reactor->id, cpu);
+	}
+
+	/* Allocated once pinned, from the memory of the reactor's node */
+	reactor->peek_buffer = node_alloc(REQUEST_MAX_SIZE, worker_node(reactor->id));
+
+	if (conf.server_mode == MODE_PERCORE) {
+		stats_local_init(worker_node(reactor->id));
+		cache_init(worker_node(reactor->id));
+		log_buffer_init(worker_node(reactor->id));
+	}
+
+	debug(conf.output_level, "[%d] DEBUG: event loop with local id %d running\n", reactor->id, reactor->id);
+
+	wheel_init(&(reactor->wheel), get_time_ns() / 1000000);
+
+	spin_until = 0;
+
+	while (1) {
+
+		/* Busy poll for a while after the last event, then sleep */
+		timeout = get_time_ns() < spin_until ? 0 : EVENT_TIMER_INTERVAL;
+
+		if ((n = epoll_wait(reactor->epfd, events, EVENT_MAX_EVENTS, timeout)) < 0) {
+
+			if (errno == EINTR) continue;
+
+			handle_error("epoll_wait");
+
+		}
+
+		if (n > 0 && conf.busy_poll > 0) {
+			spin_until = get_time_ns() + conf.busy_poll * 1000ULL;
+		} else if (n == 0 && timeout == 0) {
+			cpu_relax();
+		}
+
+		for (i = 0; i < n; i++) {
+
+			if (events[i].data.ptr == reactor) {
+				/* Connections waiting on the own listener */
+				reactor_accept(reactor, reactor->listen_sockfd);
+
+				continue;
+
+			} else if (events[i].data.ptr == &(reactor->unix_sockfd)) {
+				/* Connections waiting on the Unix listener */
+				reactor_accept(reactor, reactor->unix_sockfd);
+
+				continue;
+
+			} else if (events[i].data.ptr == NULL) {
+				/* New connections handed over by the acceptor */
+				if (read(reactor->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+					handle_error("read");
+				}
+
+				pthread_mutex_lock(&(reactor->mutex_inbox));
+				inbox = reactor->inbox;
+				reactor->inbox = NULL;
+				pthread_mutex_unlock(&(reactor->mutex_inbox));
+
+				while (inbox != NULL) {
+
+					conn = inbox;
+					inbox = inbox->next;
+
+					reactor_add(reactor, conn);
+
+				}
+
+				continue;
+
+			}
+
+			if (conf.server_mode == MODE_CORO) {
+				conn_resume(reactor, (conn_t *) events[i].data.ptr);
+			} else {
+				conn_process(reactor, (conn_t *) events[i].data.ptr);
+			}
+
+		}
+
+		reactor_expire(reactor);
+
+		log_flush();
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Starts one event loop per pool thread. With a shared listener the calling
+ * thread accepts the connections and hands them to the loops in a round
+ * robin fashion, otherwise each loop accepts from its own listener. Never
+ * returns.
+ *
+ * @param server_sockfd: the shared listening socket
+ * @param listen_sockfds: one listening socket per loop, or NULL
+ */
+void event_server(int server_sockfd, int *listen_sockfds) {
+
+	int i, n, next;
+
+	uint64_t value;
+
+	conn_t *conn;
+	reactor_t *reactor;
+
+	accepted_t *accepted;
+
+	struct epoll_event event;
+
+	next = 0;
+	value = 1;
+
+	reactors = malloc(conf.thread_pool_size * sizeof(reactor_t));
+	memset(reactors, 0, conf.thread_pool_size * sizeof(reactor_t));
+
+	for (i = 0; i < conf.thread_pool_size; i++) {
+
+		reactor = &reactors[i];
+
+		reactor->id = i;
+		reactor->listen_sockfd = -1;
+		reactor->unix_sockfd = -1;
+
+		pthread_mutex_init(&(reactor->mutex_inbox), NULL);
+
+		if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+			handle_error("epoll_create1");
+		}
+
+		if ((reactor->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			handle_error("eventfd");
+		}
+
+		memset(&event, 0, sizeof(event));
+
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+
+		if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->eventfd, &event) < 0) {
+			handle_error("epoll_ctl");
+		}
+
+		if (listen_sockfds != NULL) {
+
+			reactor->listen_sockfd = listen_sockfds[i];
+
+			set_nonblocking(reactor->listen_sockfd, TRUE);
+
+			event.events = EPOLLIN;
+			event.data.ptr = reactor;
+
+			if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->listen_sockfd, &event) < 0) {
+				handle_error("epoll_ctl");
+			}
+
+		}
+
+		/* Without a shared acceptor every loop takes from the Unix
+		 * listener, one woken up per connection */
+		if (listen_sockfds != NULL && listener_unix() >= 0) {
+
+			reactor->unix_sockfd = listener_unix();
+
+			event.events = EPOLLIN | EPOLLEXCLUSIVE;
+			event.data.ptr = &(reactor->unix_sockfd);
+
+			if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->unix_sockfd, &event) < 0) {
+				handle_error("epoll_ctl");
+			}
+
+		}
+
+		if (pthread_create(&(reactor->thread), NULL, reactor_run, reactor) != 0) {
+			handle_error("pthread_create");
+		}
+
+	}
+
+	if (listen_sockfds != NULL) {
+
+		for (i = 0; i < conf.thread_pool_size; i++) {
+			pthread_join(reactors[i].thread, NULL);
+		}
+
+		exit(EXIT_SUCCESS);
+
+	}
+
+	accepted = malloc(conf.accept_batch * sizeof(accepted_t));
+
+	while (1) {
+
+		n = listener_accept(server_sockfd, SOCK_NONBLOCK | SOCK_CLOEXEC, accepted, conf.accept_batch);
+
+		stats_add(&(stats.accepted), n);
+
+		for (i = 0; i < n; i++) {
+
+			set_low_latency(accepted[i].sockfd);
+
+			conn = conn_new(accepted[i].sockfd);
+
+			reactor = &reactors[(next + i) % conf.thread_pool_size];
+
+			pthread_mutex_lock(&(reactor->mutex_inbox));
+			conn->next = reactor->inbox;
+			reactor->inbox = conn;
+			pthread_mutex_unlock(&(reactor->mutex_inbox));
+
+		}
+
+		/* One wake up per event loop that got connections from the batch */
+		for (i = 0; i < n && i < conf.thread_pool_size; i++) {
+
+			if (write(reactors[(next + i) % conf.thread_pool_size].eventfd, &value, sizeof(value)) < 0) {
+				handle_error("write");
+			}
+
+		}
+
+		next = (next + n) % conf.thread_pool_size;
+
+		for (i = 0; i < n; i++) {
+			log_client(&(accepted[i].client_addr));
+		}
+
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#define EVENT_MAX_EVENTS		256
+#define EVENT_TIMER_INTERVAL	100			// expire connection timers at least every 100 ms (ms)
+
+typedef struct reactor {
+	int id;
+	int epfd;
+	int eventfd;
+	int listen_sockfd;
+	int unix_sockfd;
+	uint32_t num_conns;
+	char *peek_buffer;
+	conn_t *inbox;
+	wheel_t wheel;
+	pthread_t thread;
+	pthread_mutex_t mutex_inbox;
+} reactor_t;
+
+void event_server(int server_sockfd, int *listen_sockfds);
+
+#endif
\ No newline at end of file
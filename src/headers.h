@@ -10,4 +10,15 @@ typedef struct header {
 	char *value;
 } header_t;
 
+/* a string held in the connection receive buffer */
+typedef struct view {
+	char *data;
+	uint32_t length;
+} view_t;
+
+typedef struct request_header {
+	view_t name;
+	view_t value;
+} request_header_t;
+
 #endif
\ No newline at end of file
@@ -12,7 +12,7 @@
 #include <stdint.h>
 
 /* connection */
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -25,6 +25,9 @@
 /* threading */
 #include <pthread.h>
 
+/* signals */
+#include <signal.h>
+
 /* error */
 #include <errno.h>
 
@@ -33,6 +36,9 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+/* io_uring */
+#include <linux/io_uring.h>
+
 /* local header files */
 #include "constants.h"
 #include "config.h"
@@ -40,241 +46,401 @@
 #include "headers.h"
 #include "request.h"
 #include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "scan.h"
+#include "event.h"
+#include "uring.h"
+#include "listener.h"
+#include "queue.h"
+#include "sched.h"
+#include "park.h"
+#include "watchdog.h"
+#include "prefork.h"
+#include "admission.h"
+#include "upgrade.h"
+#include "stats.h"
+#include "util.h"
 
 /*
  * GLOBALS
  */
-pthread_cond_t cond_sockfd_full, cond_sockfd_empty;
-pthread_mutex_t mutex_sockfd;
+/* Accepted connections waiting for a pool thread */
+queue_t conn_queue;
 
-volatile int *client_sockfd;
-volatile int client_sockfd_rd;
-volatile int client_sockfd_wr;
-volatile int client_sockfd_count;
+/* Listening sockets of the reuseport listen mode, one per worker */
+int *listen_sockfds;
 
 /* Server config */
 config_t conf;
 
+/* Idle keep alive connections go to the parking area (shared listen mode) */
+static int parking = FALSE;
+
 static const char *name = "ARiSO HTTP web server";
 static const char *version = "0.1.3";
 static const char *author = "Dani Huertas";
 
-void close_conn(int thread_id, int sockfd) {
+/*
+ * Waits until the client socket is readable. The wait is bounded by the
+ * connection deadline: when it is over the watchdog shuts the socket down,
+ * which makes it readable.
+ *
+ * @param thread_id: the thread id handling the connection
+ * @param sockfd: the client socket
+ * @return: TRUE when there is data (or a closed connection) to be read
+ */
+int wait_readable(int thread_id, int sockfd) {
+
+	int n, timeout;
+
+	uint64_t spin_until;
+
+	struct pollfd pfd;
+
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+
+	spin_until = get_time_ns() + conf.busy_poll * 1000ULL;
+
+	while (1) {
+
+		/* Busy poll first, sleep once the spin budget is over */
+		timeout = conf.busy_poll > 0 && get_time_ns() < spin_until ? 0 : -1;
+
+		if ((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+			continue;
+		} else if (n != 0) {
+			break;
+		}
+
+		cpu_relax();
+
+	}
 
-	if (close(sockfd) < 0) {
+	if (n < 0 || (pfd.revents & POLLNVAL)) {
 
 		debug(conf.output_level, 
-			"[%d] DEBUG: error closing socket (%s)\n", 
-			thread_id, strerror(errno));
+			"[%d] DEBUG: client closed connection\n",
+			thread_id);
+
+		return FALSE;
 
 	}
- 
+
+	return TRUE;
+
 }
 
-void request_handler(int thread_id, int client_sockfd) {
+/*
+ * Disarms the connection deadline, closes the connection and frees it. The
+ * responses batched for the pipelined requests that came before a failing
+ * one are sent first, for as long as SendTimeout allows.
+ *
+ * @param thread_id: the thread id handling the connection
+ * @param conn: the connection state
+ */
+static void close_connection(int thread_id, conn_t *conn) {
 
-	char *connection;
+	watchdog_cancel(conn);
 
-	int i, n, req_count;
+	if (conn_batched(conn) > 0) {
+		conn_flush(thread_id, conn);
+	}
 
-	fd_set select_set;
- 
- 	struct timeval timeout;
+	conn_free(thread_id, conn);
 
-	request_t request;
-	response_t response;
+}
 
-	connection = NULL;
+/*
+ * Sends the prepared response. A response up to BulkSize is sent at once
+ * on the blocking socket. A larger one, with the scheduler, is a bulk
+ * transfer: the socket is made non-blocking and the worker sends one time
+ * slice after another while nothing else is runnable. Otherwise it hands
+ * the connection over to the bulk queue (slice over) or to the parking
+ * area (the client is not reading) so that shorter responses go first.
+ *
+ * @param thread_id: the thread id handling the connection
+ * @param conn: the connection state, its state is CONN_WRITING
+ * @return: 1 when the response has been sent, 0 when the connection has
+ * been handed over, -1 on error
+ */
+static int flush_response(int thread_id, conn_t *conn) {
 
- 	i = 0;
-	n = 0;
-	req_count = 0;
+	int n;
 
-	/* Init request */
-	request.num_headers = 0;
-	memset(&(request._mask), 0, sizeof(uint32_t));
+	uint64_t slice_end;
 
-	/* Init response */
-	response.num_headers = 0;
-	memset(&(response._mask), 0, sizeof(uint32_t));
-	response.status_code = 0;
-	response.file_exists = FALSE;
-	
-	timeout.tv_sec = conf.request_timeout;
-	timeout.tv_usec = 0;
+	struct pollfd pfd;
 
-	debug(conf.output_level, 
-		"[%d] DEBUG: handling request at socket %d\n", 
-		thread_id, client_sockfd);
+	if ( ! parking || conn->config->bulk_size == 0 || conn->file_size <= conn->config->bulk_size) {
+		/* Blocking, not being writable means SendTimeout is over */
+		return conn_flush(thread_id, conn) == 1 ? 1 : ERROR;
+	}
 
-	/* Wait for data to be received or connection timeout */
-	FD_ZERO(&select_set);
-	FD_SET(client_sockfd, &select_set);
+	if ( ! conn->bulk) {
+		conn->bulk = TRUE;
+		set_nonblocking(conn->sockfd, TRUE);
+	}
 
-	n = select(client_sockfd + 1, &select_set, NULL, NULL, &timeout);
+	pfd.fd = conn->sockfd;
+	pfd.events = POLLOUT;
 
-	if (n < 0) {
+	while (1) {
 
-		if (errno != EBADF) {
-			handle_error("select");
-		} 
+		slice_end = get_time_ns() + SCHED_SLICE * 1000000ULL;
 
-		close_conn(thread_id, client_sockfd);
+		while ((n = conn_flush_limit(thread_id, conn, CONN_FLUSH_CHUNK)) == CONN_FLUSH_MORE
+			&& get_time_ns() < slice_end);
 
-		debug(conf.output_level, 
-			"[%d] DEBUG: client closed connection\n",
-			thread_id);
+		if ((n != 0 && n != CONN_FLUSH_MORE) || sched_preempt()) {
+			break;
+		}
 
-		free_request(&request);
-		free_response(&response);
+		/* Nobody else needs the worker, keep it for one more slice */
+		if (n == 0 && poll(&pfd, 1, SCHED_SLICE) <= 0) {
+			break;
+		}
 
-		return;
+	}
 
-	} else if (n == 0) {
-		
-		debug(conf.output_level, 
-			"[%d] DEBUG: connection timed out\n",
-			thread_id);
+	switch (n) {
 
-		free_request(&request);
-		free_response(&response);
+		case 1:
+			conn->bulk = FALSE;
+			set_nonblocking(conn->sockfd, FALSE);
+			return 1;
 
-		return;
+		case 0:
+			/* The socket timeouts do not apply anymore, the watchdog does */
+			watchdog_arm(conn, CONN_TIMEOUT_SEND);
+			park_conn(thread_id, conn);
+			return 0;
 
-	} else {
+		case CONN_FLUSH_MORE:
+			sched_bulk(conn);
+			return 0;
 
-		if (FD_ISSET(client_sockfd, &select_set)) {
+	}
 
-			if (handle_request(thread_id, client_sockfd, &request) < 0) {
-				/* 
-				 * There has been an error with the client request. Close connection.
-				 */
-				close_conn(thread_id, client_sockfd);
+	return ERROR;
 
-				free_request(&request);
-				free_response(&response);
+}
 
-				return;
+/*
+ * Serves one request of the connection and waits for the next one when the
+ * client asked to keep the connection alive. With the parking area the
+ * connection is parked instead of waiting.
+ *
+ * Waiting for a request and receiving its header block are bounded by the
+ * watchdog; receiving the body and sending the response, by the socket
+ * timeouts (see set_io_timeouts()). A bulk transfer comes back here for
+ * each of its time slices (see flush_response()).
+ *
+ * @param thread_id: the thread id handling the connection
+ * @param conn: the connection state
+ * @return: TRUE when the next request is ready to be read, FALSE when the
+ * connection has been closed, parked or queued
+ */
+int request_handler(int thread_id, conn_t *conn) {
 
-			}
+	int n;
 
-		}
+	if (conn->state == CONN_WRITING) {
 
-	}
+		/* The next time slice of a bulk transfer */
+		watchdog_cancel(conn);
 
-	get_request_header(&request, "Connection", &connection);
+	} else if (conn->req_count == 0) {
 
-	if (connection == NULL) {
-		/* Some http clients (e.g. curl) may not send the Connection header ... */
-		handle_response(thread_id, client_sockfd, &request, &response);
+		debug(conf.output_level, 
+			"[%d] DEBUG: handling request at socket %d\n", 
+			thread_id, conn->sockfd);
 
-	} else if (strncasecmp(connection, "close", strlen("close")) == 0) {
+		/* Wait for data to be received or connection timeout */
+		watchdog_arm(conn, CONN_TIMEOUT_IDLE);
 
-		handle_response(thread_id, client_sockfd, &request, &response);
+		if ( ! wait_readable(thread_id, conn->sockfd)) {
+			close_connection(thread_id, conn);
+			return FALSE;
+		}
 
 	} else {
 
 		debug(conf.output_level, 
-			"[%d] DEBUG: Connection keep alive (%d seconds)\n", 
-			thread_id, TIME_OUT);
+			"[%d] DEBUG: connection is still open\n", 
+			thread_id);
 
-		timeout.tv_sec = conf.keep_alive_timeout;
-		timeout.tv_usec = 0;
+	}
 
-		/* Persistent connections are the default behavior in HTTP/1.1 */
-		handle_response(thread_id, client_sockfd, &request, &response);
+	/* Pipelined requests already received are answered in a single write */
+	while (conn->state != CONN_WRITING) {
 
-		while ((n = select(client_sockfd + 1, &select_set, NULL, NULL, &timeout)) > 0) {
+		/* The request has started, the whole header block is due now */
+		watchdog_arm(conn, CONN_TIMEOUT_HEADER);
 
-			if (FD_ISSET(client_sockfd, &select_set)) {
+		if (handle_request_header(thread_id, conn) < 0) {
+			/* 
+			 * There has been an error with the client request. Close connection,
+			 * once the error response, if any, has been sent.
+			 */
+			if (conn->state != CONN_WRITING) {
+				close_connection(thread_id, conn);
+				return FALSE;
+			}
 
-				free_request(&request);
-				free_response(&response);
+			watchdog_cancel(conn);
+			break;
 
-				debug(conf.output_level, 
-					"[%d] DEBUG: connection is still open\n", 
-					thread_id);
+		}
 
-				handle_request(thread_id, client_sockfd, &request);
-				handle_response(thread_id, client_sockfd, &request, &response);
+		/* From now on the socket timeouts bound the connection */
+		watchdog_cancel(conn);
 
-				req_count++;
+		if (handle_request_body(thread_id, conn) < 0) {
 
+			if (conn->state != CONN_WRITING) {
+				close_connection(thread_id, conn);
+				return FALSE;
 			}
 
-			if (req_count > conf.max_keep_alive_requests) {
+			break;
 
-				debug(conf.output_level, 
-					"[%d] DEBUG: Max keep alive requests reached\n", 
-					thread_id);
+		}
 
-				break;
+		conn->keep_alive = is_keep_alive(&(conn->request));
 
-			}
-		}
+		conn_prepare_response(thread_id, conn);
+
+		conn_batch(thread_id, conn);
 
 	}
 
-	if (n < 0) {
+	if ((n = flush_response(thread_id, conn)) == 0) {
+		return FALSE;
+	} else if (n < 0) {
+		/* The client is gone or not reading, the connection is unusable */
+		conn->keep_alive = FALSE;
+	}
 
-		if (errno != EBADF) {
-			handle_error("select");
-		}
+	conn->req_count++;
 
-		debug(conf.output_level, 
-			"[%d] DEBUG: client closed connection\n",
-			thread_id);
+	conn_reset(conn);
+
+	if ( ! conn->keep_alive) {
+		close_connection(thread_id, conn);
+		return FALSE;
+	}
 
-	} else if (n == 0) {
+	if (conn->req_count > conn->config->max_keep_alive_requests) {
 
 		debug(conf.output_level, 
-			"[%d] DEBUG: connection timed out\n",
+			"[%d] DEBUG: Max keep alive requests reached\n", 
 			thread_id);
 
+		close_connection(thread_id, conn);
+		return FALSE;
+
 	}
 
-	close_conn(thread_id, client_sockfd);
+	debug(conf.output_level, 
+		"[%d] DEBUG: Connection keep alive (%d seconds)\n", 
+		thread_id, conn->config->keep_alive_timeout);
+
+	watchdog_arm(conn, CONN_TIMEOUT_IDLE);
+
+	if (conn->in_length > 0) {
+		/* A pipelined request has already been received along with this one */
+		return TRUE;
+	}
+
+	if (parking) {
+
+		n = conn_receive(conn, MSG_DONTWAIT);
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* Do not hold the thread while the client is idle */
+			park_conn(thread_id, conn);
+			return FALSE;
+		}
+
+		/* A request, or a closed connection, is handled right away */
+		return TRUE;
 
-	FD_CLR(client_sockfd, &select_set);
-	FD_ZERO(&select_set);
+	}
+
+	/* Persistent connections are the default behavior in HTTP/1.1 */
+	if ( ! wait_readable(thread_id, conn->sockfd)) {
+		close_connection(thread_id, conn);
+		return FALSE;
+	}
 
-	free_request(&request);
-	free_response(&response);
+	return TRUE;
 
 }
 
 void *run(void *arg) {
 	
-	int *id, sockfd;
+	int cpu;
+	int *id;
+
+	conn_t *conn;
 
 	id = (int *) arg;
 
+	if ((cpu = worker_cpu(*id)) >= 0 && pin_thread(cpu) < 0) {
+		debug(conf.output_level, "[%d] DEBUG: unable to pin thread to cpu %d\n", *id, cpu);
+	}
+
 	debug(conf.output_level, "[%d] DEBUG: thread with local id %d running\n", *id, *id);
 
-	while (1) {
+	while ((conn = sched_next(*id)) != NULL) {
 
-		// start of mutex area
+		/* Queue the next request so that idle threads may steal it */
+		while (request_handler(*id, conn) && sched_push(*id, conn) < 0);
 
-		pthread_mutex_lock(&mutex_sockfd);
+	}
 
-		while (client_sockfd_count == 0) {
+	return NULL;
 
-			pthread_cond_wait(&cond_sockfd_empty, &mutex_sockfd);
+}
 
-		}
+/*
+ * Worker of the reuseport listen mode: accepts connections from its own
+ * listening socket and serves them, no handoff involved.
+ */
+void *run_listener(void *arg) {
+
+	int cpu;
+	int *id;
+
+	conn_t *conn;
+
+	accepted_t accepted;
+
+	id = (int *) arg;
+
+	if ((cpu = worker_cpu(*id)) >= 0 && pin_thread(cpu) < 0) {
+		debug(conf.output_level, "[%d] DEBUG: unable to pin thread to cpu %d\n", *id, cpu);
+	}
 
-		sockfd = client_sockfd[client_sockfd_rd];
+	debug(conf.output_level, "[%d] DEBUG: thread with local id %d accepting\n", *id, *id);
+
+	while (1) {
 
-		client_sockfd_rd++;
-		client_sockfd_rd = client_sockfd_rd % conf.thread_pool_size;
-		client_sockfd_count--;
+		/* The worker serves what it accepts, take one connection at a time */
+		listener_accept(listen_sockfds[*id], SOCK_CLOEXEC, &accepted, 1);
 
-		pthread_cond_broadcast(&cond_sockfd_full);
-		pthread_mutex_unlock(&mutex_sockfd);
-		
-		// end of mutex area
+		stats_add(&(stats.accepted), 1);
 
-		request_handler(*id, sockfd);
+		log_client(&(accepted.client_addr));
+
+		set_io_timeouts(accepted.sockfd);
+		set_low_latency(accepted.sockfd);
+
+		conn = conn_new(accepted.sockfd);
+
+		while (request_handler(*id, conn));
 
 	}
 
@@ -353,101 +519,154 @@ int main(int argc, char *argv[]) {
 
 	printf("%s (version %s)\n", name, version);
 
-	read_config(cvalue);
+	/* A client closing early must not kill the server, send() reports EPIPE */
+	signal(SIGPIPE, SIG_IGN);
 
-	char date_buffer[MAX_DATE_SIZE];
+	read_config(cvalue);
 
-	int server_sockfd;
-	int sockfd, client_size;
+	int server_sockfd, unix_sockfd;
+	int n;
 
 	// Local thread id (e.g. 0, 1, 2, 3 ... N)
-	int i, tid[conf.thread_pool_size];
+	int i, *tid;
 
-	struct sockaddr_in server_addr, client_addr;
-	pthread_t thread_id[conf.thread_pool_size];
+	accepted_t *accepted;
 
-	// Initialize the client_sockfd array
-	client_sockfd = malloc(conf.thread_pool_size*sizeof(int));
-	
-	server_sockfd = socket(PF_INET, SOCK_STREAM, 0);
+	pthread_t *thread_id;
 
-	// Initialize addr structs
-	memset(&server_addr, 0, sizeof(server_addr));
-	memset(&client_addr, 0, sizeof(client_addr));
+	/* The request tokenizer for this CPU, before any thread is started */
+	n = scan_init(SCAN_AUTO);
 
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(conf.listen_port);
+	debug(conf.output_level, "DEBUG: request tokenizer %s\n", scan_name(n));
 
-	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	server_sockfd = -1;
+	unix_sockfd = -1;
+	listen_sockfds = NULL;
 
-	bind(server_sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr));
+	if (upgrade_inherit(&server_sockfd, &listen_sockfds, &unix_sockfd) == 0) {
+		/* Started by an upgrade, the listeners are already open */
+	} else if (conf.listen_mode == LISTEN_REUSEPORT) {
+		listen_sockfds = listener_open_group(conf.thread_pool_size, conf.reuseport_steering);
+	} else {
+		server_sockfd = listener_open(FALSE);
+	}
 
-	listen(server_sockfd, MAX_LISTEN);
+	if (conf.listen_unix != NULL && unix_sockfd < 0) {
+		unix_sockfd = listener_open_unix();
+	}
 
-	client_size = sizeof(client_addr);
+	/* Served next to the TCP listeners by every mode */
+	listener_add_unix(unix_sockfd);
 
-	// Initialize threads mutex and conditions
-	pthread_mutex_init(&mutex_sockfd, NULL);
-	pthread_cond_init(&cond_sockfd_empty, NULL);
-	pthread_cond_init(&cond_sockfd_full, NULL);
+	upgrade_init(argv, server_sockfd, listen_sockfds, unix_sockfd);
 
-	client_sockfd_count = 0;
-	client_sockfd_rd = 0;
-	client_sockfd_wr = 0;
+	/* The old process stops accepting, new connections wait in the backlog */
+	upgrade_ready();
 
-	// Wake up threads
-	for (i = 0; i < conf.thread_pool_size; i++) {
+	if (conf.workers > 0) {
+		/* Only returns in the worker processes, which inherit the listeners */
+		prefork(conf.workers);
+	}
 
-		tid[i] = i;
+	/* Before any other thread is started, see upgrade_watch() and config_watch() */
+	upgrade_watch(conf.workers == 0);
+	config_watch(cvalue);
 
-		if (pthread_create(&thread_id[i], NULL, run, &tid[i]) != 0) {
-			handle_error("pthread_create");
-		}
- 
+	if (conf.server_mode == MODE_URING && uring_server(server_sockfd, listen_sockfds) < 0) {
+		/* The io_uring loops could not start, use the epoll ones instead */
+		conf.server_mode = MODE_EVENT;
 	}
 
-	while (1) {
+	if (conf.server_mode == MODE_EVENT || conf.server_mode == MODE_CORO
+		|| conf.server_mode == MODE_PERCORE) {
+		/* The event loops take over the accepted connections */
+		event_server(server_sockfd, listen_sockfds);
+	}
 
-		sockfd = accept(server_sockfd, (struct sockaddr *) &client_addr, &client_size);
+	if (conf.listen_mode == LISTEN_REUSEPORT) {
+		/* Every worker accepts for itself, there is nothing to dispatch */
+		tid = malloc(conf.thread_pool_size * sizeof(int));
+		thread_id = malloc(conf.thread_pool_size * sizeof(pthread_t));
 
-		// start of mutex area
-		pthread_mutex_lock(&mutex_sockfd);
+		watchdog_init();
+
+		for (i = 0; i < conf.thread_pool_size; i++) {
+
+			tid[i] = i;
+
+			if (pthread_create(&thread_id[i], NULL, run_listener, &tid[i]) != 0) {
+				handle_error("pthread_create");
+			}
 
-		while (client_sockfd_count > conf.thread_pool_size) {
-			pthread_cond_wait(&cond_sockfd_full, &mutex_sockfd);
 		}
 
-		client_sockfd[client_sockfd_wr] = sockfd;
+		for (i = 0; i < conf.thread_pool_size; i++) {
+		    pthread_join(thread_id[i], NULL);
+		}
 
-		client_sockfd_count++;
-		client_sockfd_wr++;
-		client_sockfd_wr = client_sockfd_wr % conf.thread_pool_size;
+		exit(EXIT_SUCCESS);
 
-		
-		pthread_cond_broadcast(&cond_sockfd_empty);
-		pthread_mutex_unlock(&mutex_sockfd);
+	}
 
-		// end of mutex area
+	// Initialize the connection queue
+	queue_init(&conn_queue, conf.queue_capacity);
 
-		get_date(date_buffer, "%H:%M:%S, %a %b %d %Y");
+	conf.queue_capacity = conn_queue.capacity;
 
-		// Request received :)
-		printf("[%s] %s \n", date_buffer, inet_ntoa(client_addr.sin_addr));
+	watchdog_init();
 
-	}
+	/* Busy polling workers keep their connections instead */
+	if (conf.busy_poll == 0) {
+
+		park_init();
+
+		parking = TRUE;
 
-	for (i = 0; i < conf.thread_pool_size; i++) {
-	    pthread_join(thread_id[i], NULL);
 	}
 
-	pthread_cond_destroy(&cond_sockfd_empty);
-	pthread_cond_destroy(&cond_sockfd_full);
-	pthread_mutex_destroy(&mutex_sockfd);
+	admission_init();
+
+	// Wake up threads, the pool resizes itself from now on
+	sched_init(run);
+
+	accepted = malloc(conf.accept_batch * sizeof(accepted_t));
+
+	while (1) {
+
+		n = listener_accept(server_sockfd, SOCK_CLOEXEC, accepted, conf.accept_batch);
+
+		stats_add(&(stats.accepted), n);
+
+		for (i = 0; i < n; i++) {
+
+			/* Overloaded: a fast 503 beats a connect timeout */
+			if ( ! admission_admit()) {
+				admission_reject(accepted[i].sockfd);
+				continue;
+			}
+
+			set_io_timeouts(accepted[i].sockfd);
+			set_low_latency(accepted[i].sockfd);
+
+			/* Not even room to wait in the queue */
+			if (sched_accept(accepted[i].sockfd) < 0) {
+				admission_reject(accepted[i].sockfd);
+			}
+
+		}
+
+		/* Log once the whole batch has been handed over */
+		for (i = 0; i < n; i++) {
+			log_client(&(accepted[i].client_addr));
+		}
+
+	}
 
 	// Closing time
 	close(server_sockfd);
 
-	// free(client_sockfd);
+	free(conn_queue.cells);
+	free(accepted);
 
 	exit(EXIT_SUCCESS);
 
@@ -0,0 +1,485 @@
+/*
+ * Listening sockets. Besides the single shared listener the server may open
+ * one SO_REUSEPORT socket per worker so that every worker accepts its own
+ * connections, optionally steered by a classic BPF program to the worker
+ * running on the CPU that received the SYN.
+ *
+ * Listeners are non-blocking: the acceptor drains every pending connection
+ * each time it wakes up (see listener_accept()).
+ *
+ * A Unix domain socket listener (see Listen) may serve a reverse proxy on
+ * the same host next to the TCP one. Its connections go through the same
+ * acceptors, event loops and rings as the TCP ones.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <grp.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "listener.h"
+#include "upgrade.h"
+#include "util.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+
+extern config_t conf;
+
+static __thread char *log_buffer;
+static __thread size_t log_length;
+
+/* the Unix domain socket listener, or -1 */
+static int unix_sockfd = -1;
+
+/*
+ * Creates a TCP socket listening on the configured port
+ *
+ * @param reuseport: TRUE to join the SO_REUSEPORT group of the port
+ * @return: the listening socket
+ */
+int listener_open(int reuseport) {
+
+	int sockfd, on;
+
+	struct sockaddr_in server_addr;
+
+	on = 1;
+
+	if ((sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		handle_error("socket");
+	}
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+		handle_error("setsockopt");
+	}
+
+	if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		handle_error("setsockopt");
+	}
+
+	memset(&server_addr, 0, sizeof(server_addr));
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(conf.listen_port);
+
+	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+		handle_error("bind");
+	}
+
+	/* Not fatal, the options only save work to the server */
+	if (conf.defer_accept > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		&(conf.defer_accept), sizeof(conf.defer_accept)) < 0) {
+
+		debug(conf.output_level,
+			"DEBUG: unable to set TCP_DEFER_ACCEPT (%s)\n",
+			strerror(errno));
+
+	}
+
+	if (conf.fast_open > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+		&(conf.fast_open), sizeof(conf.fast_open)) < 0) {
+
+		debug(conf.output_level,
+			"DEBUG: unable to set TCP_FASTOPEN (%s)\n",
+			strerror(errno));
+
+	}
+
+	if (listen(sockfd, conf.listen_backlog) < 0) {
+		handle_error("listen");
+	}
+
+	return sockfd;
+
+}
+
+/*
+ * Creates the Unix domain socket listener at the configured path, with the
+ * configured permissions. A socket file left behind by a previous run is
+ * removed first.
+ *
+ * @return: the listening socket
+ */
+int listener_open_unix(void) {
+
+	int sockfd;
+
+	mode_t mask;
+
+	struct sockaddr_un server_addr;
+	struct stat file_info;
+	struct group *group;
+
+	if (strlen(conf.listen_unix) >= sizeof(server_addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		handle_error("listen unix");
+	}
+
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		handle_error("socket");
+	}
+
+	memset(&server_addr, 0, sizeof(server_addr));
+
+	server_addr.sun_family = AF_UNIX;
+	strncpy(server_addr.sun_path, conf.listen_unix, sizeof(server_addr.sun_path) - 1);
+
+	/* Only a socket is replaced, never a regular file */
+	if (lstat(conf.listen_unix, &file_info) == 0 && S_ISSOCK(file_info.st_mode)) {
+		unlink(conf.listen_unix);
+	}
+
+	/* The socket file is created for the owner only, the configured
+	 * permissions apply once it belongs to the configured group */
+	mask = umask(S_IRWXG | S_IRWXO);
+
+	if (bind(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+		handle_error("bind");
+	}
+
+	umask(mask);
+
+	if (conf.listen_unix_group != NULL) {
+
+		if ((group = getgrnam(conf.listen_unix_group)) == NULL) {
+			printf("Unknown ListenUnixGroup %s\n", conf.listen_unix_group);
+			exit(EXIT_FAILURE);
+		}
+
+		if (chown(conf.listen_unix, -1, group->gr_gid) < 0) {
+			handle_error("chown");
+		}
+
+	}
+
+	if (chmod(conf.listen_unix, conf.listen_unix_mode) < 0) {
+		handle_error("chmod");
+	}
+
+	if (listen(sockfd, conf.listen_backlog) < 0) {
+		handle_error("listen");
+	}
+
+	return sockfd;
+
+}
+
+/*
+ * Makes the acceptors, event loops and rings serve a Unix domain socket
+ * listener too
+ *
+ * @param sockfd: the listening socket, or -1
+ */
+void listener_add_unix(int sockfd) {
+
+	unix_sockfd = sockfd;
+
+}
+
+/*
+ * Gives the Unix domain socket listener
+ *
+ * @return: the listening socket, or -1 when there is none
+ */
+int listener_unix(void) {
+
+	return unix_sockfd;
+
+}
+
+/*
+ * Attaches a classic BPF program to the SO_REUSEPORT group which selects,
+ * for the CPU handling the incoming SYN, the socket of the worker pinned to
+ * that CPU (see worker_cpu()). CPUs without a worker fall back to the socket
+ * with index (cpu % count). Sockets are indexed in the order they joined
+ * the group.
+ *
+ * @param sockfd: any socket of the group
+ * @param count: number of sockets in the group
+ */
+static void listener_attach_cbpf(int sockfd, int count) {
+
+	int i, n, cpu;
+
+	struct sock_filter *code;
+
+	struct sock_fprog prog;
+
+	n = 0;
+
+	code = malloc((2 * count + 3) * sizeof(struct sock_filter));
+
+	/* A = raw_smp_processor_id() */
+	code[n++] = (struct sock_filter) { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+
+	/* if (A == cpu of worker i) return i */
+	for (i = 0; i < count && 2 * count + 3 <= BPF_MAXINSNS; i++) {
+
+		if ((cpu = worker_cpu(i)) < 0) {
+			break;
+		}
+
+		code[n++] = (struct sock_filter) { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, cpu };
+		code[n++] = (struct sock_filter) { BPF_RET | BPF_K, 0, 0, i };
+
+	}
+
+	/* A = A % count */
+	code[n++] = (struct sock_filter) { BPF_ALU | BPF_MOD | BPF_K, 0, 0, count };
+	/* return A */
+	code[n++] = (struct sock_filter) { BPF_RET | BPF_A, 0, 0, 0 };
+
+	prog.len = n;
+	prog.filter = code;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		/* Not fatal: the kernel falls back to hashing the connections */
+		debug(conf.output_level,
+			"DEBUG: unable to attach reuseport CBPF program (%s)\n",
+			strerror(errno));
+	}
+
+	free(code);
+
+}
+
+/*
+ * Opens one SO_REUSEPORT listener per worker
+ *
+ * @param count: number of listeners
+ * @param steering: TRUE to steer connections to the worker on the CPU that
+ * received them (listener i must be served by worker i, pinned to
+ * worker_cpu(i))
+ * @return: array of listening sockets
+ *
+ * WARNING: this function allocates memory. Remember to free it when not
+ * in use.
+ */
+int *listener_open_group(int count, int steering) {
+
+	int i;
+	int *sockfds;
+
+	if ((sockfds = malloc(count * sizeof(int))) == NULL) {
+		handle_error("malloc");
+	}
+
+	/* Open them in order, the group index of each socket is its position */
+	for (i = 0; i < count; i++) {
+		sockfds[i] = listener_open(TRUE);
+	}
+
+	if (steering && count > 0) {
+		listener_attach_cbpf(sockfds[0], count);
+	}
+
+	return sockfds;
+
+}
+
+/*
+ * Accepts the pending connections of a listener, and of the Unix listener
+ * if any, up to max, and sleeps until a connection arrives when there is
+ * none. The listener tried first alternates, so that neither starves the
+ * other. Once the process is draining after an upgrade it sleeps until the
+ * process exits.
+ *
+ * @param sockfd: the listening socket
+ * @param flags: accept4() flags of the new sockets
+ * @param accepted: where the new sockets and client addresses are stored
+ * @param max: maximum number of connections to accept
+ * @return: number of accepted connections
+ */
+int listener_accept(int sockfd, int flags, accepted_t *accepted, int max) {
+
+	int n, i, tried, count, client_sockfd;
+
+	uint64_t spin_until;
+
+	socklen_t client_size;
+
+	struct pollfd pfd[2];
+
+	static __thread int turn;
+
+	n = 0;
+	tried = 0;
+	spin_until = 0;
+
+	pfd[0].fd = sockfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = unix_sockfd;
+	pfd[1].events = POLLIN;
+
+	count = unix_sockfd >= 0 ? 2 : 1;
+	i = turn++ % count;
+
+	while (n < max) {
+
+		if (n == 0 && upgrade_draining()) {
+			/* The new process accepts from the same listener now */
+			while (1) pause();
+		}
+
+		client_size = sizeof(struct sockaddr_in);
+
+		/* A Unix client address is cut down to its family, see log_client() */
+		client_sockfd = accept4(pfd[i].fd,
+			(struct sockaddr *) &(accepted[n].client_addr), &client_size, flags);
+
+		if (client_sockfd < 0) {
+
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				debug(conf.output_level,
+					"DEBUG: accept failed (%s)\n",
+					strerror(errno));
+			}
+
+			/* Try the other listener before waiting */
+			i = (i + 1) % count;
+
+			if (++tried < count) {
+				continue;
+			}
+
+			tried = 0;
+
+			if (n > 0) {
+				break;
+			}
+
+			/* Busy poll first, sleep once the spin budget is over */
+			if (conf.busy_poll > 0) {
+
+				if (spin_until == 0) {
+					spin_until = get_time_ns() + conf.busy_poll * 1000ULL;
+				}
+
+				if (get_time_ns() < spin_until) {
+					cpu_relax();
+					continue;
+				}
+
+			}
+
+			if (poll(pfd, count, -1) < 0 && errno != EINTR) {
+				handle_error("poll");
+			}
+
+			continue;
+
+		}
+
+		tried = 0;
+
+		accepted[n].sockfd = client_sockfd;
+		n++;
+
+	}
+
+	return n;
+
+}
+
+/*
+ * Prints a line for each accepted connection
+ *
+ * @param client_addr: address of the client
+ */
+void log_client(struct sockaddr_in *client_addr) {
+
+	char date_buffer[MAX_DATE_SIZE];
+
+	char *client;
+
+	get_date(date_buffer, "%H:%M:%S, %a %b %d %Y");
+
+	client = client_addr->sin_family == AF_UNIX ? "unix" : inet_ntoa(client_addr->sin_addr);
+
+	if (log_buffer != NULL) {
+
+		if (LOG_BUFFER_SIZE - log_length < LOG_LINE_SIZE) {
+			log_flush();
+		}
+
+		log_length += snprintf(log_buffer + log_length, LOG_BUFFER_SIZE - log_length,
+			"[%s] %s \n", date_buffer, client);
+
+		return;
+
+	}
+
+	// Request received :)
+	printf("[%s] %s \n", date_buffer, client);
+
+}
+
+/*
+ * Makes log_client() collect the lines of the calling thread in a buffer
+ * of its own, written with log_flush(), instead of going through the
+ * stdout stream (which is locked by every printf).
+ *
+ * @param node: the NUMA node the buffer is allocated from, or -1
+ */
+void log_buffer_init(int node) {
+
+	/* Lines printed before must come first */
+	fflush(stdout);
+
+	log_buffer = node_alloc(LOG_BUFFER_SIZE, node);
+	log_length = 0;
+
+}
+
+/*
+ * Writes the lines collected by log_client() in the calling thread
+ */
+void log_flush(void) {
+
+	size_t written;
+	ssize_t w;
+
+	written = 0;
+
+	while (written < log_length) {
+
+		if ((w = write(STDOUT_FILENO, log_buffer + written, log_length - written)) < 0) {
+
+			if (errno == EINTR) continue;
+
+			break;
+
+		}
+
+		written += w;
+
+	}
+
+	log_length = 0;
+
+}
\ No newline at end of file
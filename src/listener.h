@@ -0,0 +1,26 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __LISTENER_H
+#define __LISTENER_H
+
+#define LOG_BUFFER_SIZE		65536		// access log bytes collected per thread before writing them
+#define LOG_LINE_SIZE		128			// room left for one more access log line
+
+typedef struct accepted {
+	int sockfd;
+	struct sockaddr_in client_addr;
+} accepted_t;
+
+int listener_open(int reuseport);
+int *listener_open_group(int count, int steering);
+int listener_open_unix(void);
+void listener_add_unix(int sockfd);
+int listener_unix(void);
+int listener_accept(int sockfd, int flags, accepted_t *accepted, int max);
+void log_client(struct sockaddr_in *client_addr);
+void log_buffer_init(int node);
+void log_flush(void);
+
+#endif
\ No newline at end of file
@@ -35,7 +35,8 @@ int get_mime_type(char *ext, char **mime_type) {
 
 		}
 
-		result = i;
+		/* Unknown extensions use the default type */
+		result = i < n ? i : -1;
 
 	} else {
 
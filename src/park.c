@@ -0,0 +1,138 @@
+/*
+ * Parking area of the threads server mode. A keep alive connection with
+ * no request pending is handed over to a single epoll thread instead of
+ * holding its worker until the next request shows up. When the socket
+ * becomes readable the connection is submitted to the workers again. The
+ * keep alive deadline stays with the watchdog, which shuts the socket down
+ * when it is over: the socket becomes readable as well and the worker
+ * closes the connection. The workers still serve every request with the
+ * blocking handler. Bulk transfers the client is not reading fast enough
+ * are parked as well, until the socket is writable again.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "park.h"
+#include "sched.h"
+#include "watchdog.h"
+#include "stats.h"
+
+extern config_t conf;
+
+static int epfd;
+
+static pthread_t thread;
+
+static void *park_run(void *arg) {
+
+	int i, n;
+
+	conn_t *conn;
+
+	struct epoll_event events[PARK_MAX_EVENTS];
+
+	while (1) {
+
+		if ((n = epoll_wait(epfd, events, PARK_MAX_EVENTS, -1)) < 0) {
+
+			if (errno == EINTR) continue;
+
+			handle_error("epoll_wait");
+
+		}
+
+		for (i = 0; i < n; i++) {
+
+			conn = (conn_t *) events[i].data.ptr;
+
+			epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+
+			stats_add(&(stats.parked), -1);
+			stats_add(&(stats.park_resumed), 1);
+
+			/* The next request, the room to send (or the client hang up, or the
+			 * deadline) is ready */
+			sched_submit(conn);
+
+		}
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Creates the parking area and starts its thread
+ */
+void park_init(void) {
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		handle_error("epoll_create1");
+	}
+
+	if (pthread_create(&thread, NULL, park_run, NULL) != 0) {
+		handle_error("pthread_create");
+	}
+
+}
+
+/*
+ * Parks an idle keep alive connection until its next request arrives or
+ * the keep alive time is over, or a bulk transfer (CONN_WRITING) until the
+ * client makes room for the rest of the response. The connection is not
+ * owned by the caller anymore.
+ *
+ * @param thread_id: the thread id handing the connection over
+ * @param conn: the connection state
+ */
+void park_conn(int thread_id, conn_t *conn) {
+
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+
+	event.events = (conn->state == CONN_WRITING ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT;
+	event.data.ptr = conn;
+
+	debug(conf.output_level,
+		"[%d] DEBUG: parking connection at socket %d\n",
+		thread_id, conn->sockfd);
+
+	stats_add(&(stats.parked), 1);
+
+	/* Once registered the connection may be resumed (and freed) any time */
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sockfd, &event) < 0) {
+
+		debug(conf.output_level,
+			"[%d] DEBUG: unable to park socket %d (%s)\n",
+			thread_id, conn->sockfd, strerror(errno));
+
+		stats_add(&(stats.parked), -1);
+
+		watchdog_cancel(conn);
+
+		conn_free(thread_id, conn);
+
+		return;
+
+	}
+
+}
\ No newline at end of file
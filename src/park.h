@@ -0,0 +1,13 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __PARK_H
+#define __PARK_H
+
+#define PARK_MAX_EVENTS			256
+
+void park_init(void);
+void park_conn(int thread_id, conn_t *conn);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,259 @@
+/*
+ * Prefork process model. The master process reads the configuration and
+ * opens the listeners, then forks the worker processes (see Workers), which
+ * inherit the listeners and each run the configured server mode with its
+ * own threads and malloc arenas. A worker dying, e.g. in handle_error(),
+ * only drops its own connections: the master forks a new one in its place.
+ *
+ * The statistics of every worker live in a shared memory segment (see
+ * stats_shared_init()), the master prints the totals on SIGUSR1.
+ *
+ * On SIGUSR2 the master hands the listeners over to a new master (see
+ * upgrade_start()), then the workers drain their connections and exit and
+ * so does the master, without restarting them. SIGHUP is passed on to the
+ * workers, each one reloads its configuration (see config_reload()).
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "prefork.h"
+#include "upgrade.h"
+#include "stats.h"
+#include "util.h"
+
+extern config_t conf;
+
+static volatile sig_atomic_t prefork_signal;
+
+static void prefork_handler(int signum) {
+
+	prefork_signal = signum;
+
+}
+
+/*
+ * Forks a worker process
+ *
+ * @param worker: the worker number
+ * @return: the process id of the worker in the master, 0 in the worker,
+ * -1 on error
+ */
+static pid_t prefork_spawn(int worker) {
+
+	pid_t pid, master;
+
+	master = getpid();
+
+	/* Lines printed so far must not be printed again by the worker */
+	fflush(stdout);
+
+	if ((pid = fork()) < 0) {
+
+		printf("Unable to start worker %d (%s)\n", worker, strerror(errno));
+
+		return ERROR;
+
+	} else if (pid > 0) {
+
+		return pid;
+
+	}
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+
+	/* Not to be killed by a reload before config_watch() */
+	signal(SIGHUP, SIG_IGN);
+
+	/* Workers do not outlive the master */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	if (getppid() != master) {
+		exit(EXIT_FAILURE);
+	}
+
+	stats_process_init(worker);
+
+	debug(conf.output_level, "DEBUG: worker %d running (pid %d)\n", worker, getpid());
+
+	return 0;
+
+}
+
+/*
+ * Sends a signal to every worker and waits for them. The new master of an
+ * upgrade is not waited for.
+ *
+ * @param workers: the worker process ids
+ * @param count: number of workers
+ * @param signum: SIGTERM to stop them, SIGUSR2 to let them drain
+ */
+static void prefork_stop(pid_t *workers, int count, int signum) {
+
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (workers[i] > 0) kill(workers[i], signum);
+	}
+
+	for (i = 0; i < count; i++) {
+		while (workers[i] > 0 && waitpid(workers[i], NULL, 0) < 0 && errno == EINTR);
+	}
+
+}
+
+/*
+ * Starts the worker processes and supervises them. Only returns in the
+ * workers, the master restarts the workers that die until it is asked to
+ * stop (SIGTERM or SIGINT) or upgraded (SIGUSR2).
+ *
+ * @param count: number of worker processes
+ * @return: the worker number (0 ... count - 1)
+ */
+int prefork(int count) {
+
+	int i, status;
+
+	char *text;
+
+	pid_t pid, *workers;
+	time_t *started;
+
+	struct sigaction action;
+
+	workers = malloc(count * sizeof(pid_t));
+	started = malloc(count * sizeof(time_t));
+
+	stats_shared_init(count, conf.thread_pool_size);
+
+	/* No SA_RESTART: the signals must interrupt waitpid() */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = prefork_handler;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGUSR2, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+
+	for (i = 0; i < count; i++) {
+
+		started[i] = time(NULL);
+
+		while ((workers[i] = prefork_spawn(i)) < 0) {
+			sleep(PREFORK_MIN_LIFETIME);
+		}
+
+		if (workers[i] == 0) {
+			free(workers);
+			free(started);
+			return i;
+		}
+
+	}
+
+	while (1) {
+
+		pid = waitpid(-1, &status, 0);
+
+		if (prefork_signal == SIGUSR1) {
+
+			prefork_signal = 0;
+
+			stats_format(&text);
+			printf("%s", text);
+			fflush(stdout);
+			free(text);
+
+		} else if (prefork_signal == SIGHUP) {
+
+			prefork_signal = 0;
+
+			for (i = 0; i < count; i++) {
+				if (workers[i] > 0) kill(workers[i], SIGHUP);
+			}
+
+		} else if (prefork_signal == SIGUSR2) {
+
+			prefork_signal = 0;
+
+			if (upgrade_start() == 0) {
+
+				prefork_stop(workers, count, SIGUSR2);
+
+				printf("Workers drained, exiting\n");
+
+				exit(EXIT_SUCCESS);
+
+			}
+
+		} else if (prefork_signal != 0) {
+
+			prefork_stop(workers, count, SIGTERM);
+
+			exit(EXIT_SUCCESS);
+
+		}
+
+		if (pid < 0 && errno != EINTR && errno != ECHILD) {
+			handle_error("waitpid");
+		}
+
+		for (i = 0; i < count; i++) {
+
+			if (pid > 0 && workers[i] == pid) {
+
+				if (WIFSIGNALED(status)) {
+					printf("Worker %d (pid %d) killed by signal %d\n", i, pid, WTERMSIG(status));
+				} else {
+					printf("Worker %d (pid %d) exited with status %d\n", i, pid, WEXITSTATUS(status));
+				}
+
+				workers[i] = -1;
+
+			}
+
+			if (workers[i] > 0 || prefork_signal != 0) {
+				continue;
+			}
+
+			/* Do not spin when workers die right away (e.g. bad configuration) */
+			if (time(NULL) - started[i] < PREFORK_MIN_LIFETIME) {
+				sleep(PREFORK_MIN_LIFETIME);
+			}
+
+			started[i] = time(NULL);
+
+			while ((workers[i] = prefork_spawn(i)) < 0) {
+				sleep(PREFORK_MIN_LIFETIME);
+			}
+
+			if (workers[i] == 0) {
+				free(workers);
+				free(started);
+				return i;
+			}
+
+		}
+
+	}
+
+}
\ No newline at end of file
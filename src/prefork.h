@@ -0,0 +1,12 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __PREFORK_H
+#define __PREFORK_H
+
+#define PREFORK_MIN_LIFETIME	1		// a worker dying sooner is restarted after 1 s (s)
+
+int prefork(int count);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,223 @@
+/*
+ * Lock-free bounded MPMC queue used to hand accepted connections over to
+ * the pool threads when their deques are full (see sched.c, which wakes
+ * them up). A producer finding it full may sleep on a futex until a pop
+ * makes room.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "queue.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Initializes the queue
+ *
+ * @param q: the queue
+ * @param capacity: number of slots, rounded up to a power of two
+ */
+void queue_init(queue_t *q, uint32_t capacity) {
+
+	uint32_t i, size;
+
+	size = 2;
+
+	while (size < capacity) size <<= 1;
+
+	memset(q, 0, sizeof(queue_t));
+
+	q->capacity = size;
+	q->mask = size - 1;
+
+	if ((q->cells = malloc(size * sizeof(queue_cell_t))) == NULL) {
+		handle_error("malloc");
+	}
+
+	for (i = 0; i < size; i++) {
+		q->cells[i].sequence = i;
+	}
+
+}
+
+/*
+ * Adds a socket to the queue without blocking
+ *
+ * @param q: the queue
+ * @param sockfd: the accepted socket
+ * @return: 0 on success, -1 when the queue is full
+ */
+int queue_push(queue_t *q, int sockfd) {
+
+	queue_cell_t *cell;
+
+	uint64_t pos, seq;
+	int64_t diff;
+
+	pos = __atomic_load_n(&(q->enqueue_pos), __ATOMIC_RELAXED);
+
+	while (1) {
+
+		cell = &(q->cells[pos & q->mask]);
+		seq = __atomic_load_n(&(cell->sequence), __ATOMIC_ACQUIRE);
+		diff = (int64_t) seq - (int64_t) pos;
+
+		if (diff == 0) {
+
+			if (__atomic_compare_exchange_n(&(q->enqueue_pos), &pos, pos + 1,
+				TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+
+		} else if (diff < 0) {
+
+			return ERROR;
+
+		} else {
+
+			pos = __atomic_load_n(&(q->enqueue_pos), __ATOMIC_RELAXED);
+
+		}
+
+	}
+
+	cell->sockfd = sockfd;
+	cell->enqueued_at = get_time_ns();
+
+	__atomic_store_n(&(cell->sequence), pos + 1, __ATOMIC_RELEASE);
+
+	stats_add(&(stats.queue_enqueued), 1);
+
+	return 0;
+
+}
+
+/*
+ * Takes the oldest socket from the queue without blocking
+ *
+ * @param q: the queue
+ * @param sockfd: where to store the socket
+ * @param wait_time: where to store the time (ns) it spent in the queue,
+ * may be NULL
+ * @return: 0 on success, -1 when the queue is empty
+ */
+int queue_pop(queue_t *q, int *sockfd, uint64_t *wait_time) {
+
+	queue_cell_t *cell;
+
+	uint64_t pos, seq, waited;
+	int64_t diff;
+
+	pos = __atomic_load_n(&(q->dequeue_pos), __ATOMIC_RELAXED);
+
+	while (1) {
+
+		cell = &(q->cells[pos & q->mask]);
+		seq = __atomic_load_n(&(cell->sequence), __ATOMIC_ACQUIRE);
+		diff = (int64_t) seq - (int64_t) (pos + 1);
+
+		if (diff == 0) {
+
+			if (__atomic_compare_exchange_n(&(q->dequeue_pos), &pos, pos + 1,
+				TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+
+		} else if (diff < 0) {
+
+			return ERROR;
+
+		} else {
+
+			pos = __atomic_load_n(&(q->dequeue_pos), __ATOMIC_RELAXED);
+
+		}
+
+	}
+
+	*sockfd = cell->sockfd;
+	waited = get_time_ns() - cell->enqueued_at;
+
+	__atomic_store_n(&(cell->sequence), pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	stats_add(&(stats.queue_dequeued), 1);
+	stats_add(&(stats.queue_wait_total), waited);
+	stats_max(&(stats.queue_wait_max), waited);
+
+	if (wait_time != NULL) {
+		*wait_time = waited;
+	}
+
+	/* Pairs with the fence in queue_push_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&(q->producers_waiting), __ATOMIC_RELAXED) > 0) {
+
+		__atomic_add_fetch(&(q->space), 1, __ATOMIC_RELEASE);
+		futex_wake(&(q->space), 1);
+
+	}
+
+	return 0;
+
+}
+
+/*
+ * Adds a socket to the queue, sleeping while it is full
+ *
+ * @param q: the queue
+ * @param sockfd: the accepted socket
+ */
+void queue_push_wait(queue_t *q, int sockfd) {
+
+	uint32_t space;
+
+	while (queue_push(q, sockfd) < 0) {
+
+		stats_add(&(stats.queue_full), 1);
+
+		space = __atomic_load_n(&(q->space), __ATOMIC_ACQUIRE);
+
+		__atomic_add_fetch(&(q->producers_waiting), 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		/* A slot may have been freed before we registered as a waiter */
+		if (queue_push(q, sockfd) == 0) {
+			__atomic_sub_fetch(&(q->producers_waiting), 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		futex_wait(&(q->space), space);
+
+		__atomic_sub_fetch(&(q->producers_waiting), 1, __ATOMIC_RELAXED);
+
+	}
+
+}
+
+/*
+ * Approximate number of sockets waiting in the queue
+ *
+ * @param q: the queue
+ */
+uint32_t queue_depth(queue_t *q) {
+
+	uint64_t enqueued, dequeued;
+
+	dequeued = __atomic_load_n(&(q->dequeue_pos), __ATOMIC_RELAXED);
+	enqueued = __atomic_load_n(&(q->enqueue_pos), __ATOMIC_RELAXED);
+
+	return enqueued > dequeued ? enqueued - dequeued : 0;
+
+}
\ No newline at end of file
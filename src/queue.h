@@ -0,0 +1,40 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+#define QUEUE_CAPACITY		1024		// default number of slots
+#define CACHE_LINE			64
+
+typedef struct queue_cell {
+	uint64_t sequence;
+	uint64_t enqueued_at;
+	int sockfd;
+} queue_cell_t;
+
+/*
+ * Bounded multi-producer/multi-consumer queue of accepted sockets. Every
+ * cell carries a sequence number telling whether it is ready to be written
+ * (sequence == position) or read (sequence == position + 1), so producers
+ * and consumers only compete for their own position counter.
+ */
+typedef struct queue {
+	uint32_t capacity;
+	uint32_t mask;
+	queue_cell_t *cells;
+	uint64_t enqueue_pos __attribute__((aligned(CACHE_LINE)));
+	uint64_t dequeue_pos __attribute__((aligned(CACHE_LINE)));
+	/* futex word, bumped each time a waiting producer has to be woken up */
+	uint32_t space __attribute__((aligned(CACHE_LINE)));
+	uint32_t producers_waiting;
+} queue_t;
+
+void queue_init(queue_t *q, uint32_t capacity);
+int queue_push(queue_t *q, int sockfd);
+int queue_pop(queue_t *q, int *sockfd, uint64_t *wait_time);
+void queue_push_wait(queue_t *q, int sockfd);
+uint32_t queue_depth(queue_t *q);
+
+#endif
\ No newline at end of file
@@ -2,149 +2,285 @@
  * @author dhuertas
  * @email huertas.dani@gmail.com
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 /* local header files */
 #include "constants.h"
 #include "config.h"
 #include "headers.h"
 #include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "scan.h"
 
 extern config_t conf;
 
+/* Perfect hash of the well-known header field names: their first letter
+ * (either case) and their length are enough to tell them apart */
+#define HEADER_HASH(c, length)		((((c) | 0x20) + (length)) & 31)
+
+typedef struct header_slot {
+	const char *name;
+	size_t length;
+	int slot;
+} header_slot_t;
+
+static const header_slot_t header_slots[32] = {
+	[HEADER_HASH('h', 4)] = { "Host", 4, HEADER_HOST },
+	[HEADER_HASH('c', 10)] = { "Connection", 10, HEADER_CONNECTION },
+	[HEADER_HASH('c', 14)] = { "Content-Length", 14, HEADER_CONTENT_LENGTH },
+	[HEADER_HASH('c', 12)] = { "Content-Type", 12, HEADER_CONTENT_TYPE },
+	[HEADER_HASH('t', 17)] = { "Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING },
+	[HEADER_HASH('e', 6)] = { "Expect", 6, HEADER_EXPECT },
+	[HEADER_HASH('i', 13)] = { "If-None-Match", 13, HEADER_IF_NONE_MATCH },
+	[HEADER_HASH('i', 17)] = { "If-Modified-Since", 17, HEADER_IF_MODIFIED_SINCE },
+	[HEADER_HASH('r', 5)] = { "Range", 5, HEADER_RANGE },
+	[HEADER_HASH('a', 6)] = { "Accept", 6, HEADER_ACCEPT },
+	[HEADER_HASH('a', 15)] = { "Accept-Encoding", 15, HEADER_ACCEPT_ENCODING },
+	[HEADER_HASH('u', 10)] = { "User-Agent", 10, HEADER_USER_AGENT },
+	[HEADER_HASH('c', 6)] = { "Cookie", 6, HEADER_COOKIE },
+	[HEADER_HASH('a', 13)] = { "Authorization", 13, HEADER_AUTHORIZATION },
+};
+
+/*
+ * Finds the slot of a well-known header field name
+ *
+ * @param name: the header field name
+ * @param length: the name length
+ * @return: the slot (HEADER_*), -1 when the name is not a well-known one
+ */
+static int header_slot(const char *name, size_t length) {
+
+	const header_slot_t *entry;
+
+	if (length == 0) {
+		return -1;
+	}
+
+	entry = &(header_slots[HEADER_HASH(name[0], length)]);
+
+	if (entry->length != length || strncasecmp(entry->name, name, length) != 0) {
+		return -1;
+	}
+
+	return entry->slot;
+
+}
+
 /*
- * Reads the data from the socket and puts it in a buffer
+ * Receives into the connection buffer until it holds a complete request
+ * header block. Whatever the client sent is read at once, so a request
+ * usually takes a single read; bytes past the header block (the body or a
+ * pipelined request) are kept in the buffer.
  *
  * @param thread_id: the thread id handling the request
- * @param sockfd: socket file descriptor to read data from
- * @param data: buffer where readed data will be stored
+ * @param conn: the connection to read data from
+ * @return: the header block length, CRLF CRLF included, -1 on error
  */
-int receive_request(int thread_id, int sockfd, char **data) {
+int receive_request(int thread_id, conn_t *conn) {
 
-	uint8_t chunk[1];
-	uint8_t i;
-	uint32_t received, n;
+	char *end;
+
+	size_t scanned;
 
-	i = 0;
-	received = 0;
-	n = 0;
+	ssize_t n;
 
-	/* Read byte by byte and look for the end of line */
-	while ((n = read(sockfd, chunk, 1)) > 0) {
+	scanned = 0;
 
-		if (received + n > REQUEST_MAX_SIZE) {
+	while ((end = scan_header_end(conn->in + scanned, conn->in_length - scanned)) == NULL) {
+
+		if (conn->in_length >= REQUEST_MAX_SIZE) {
 			/* max size per request has been reached! */
 			debug(conf.output_level,
 				"[%d] DEBUG: max request size reached (%d bytes)\n",
-				thread_id, received + n);
+				thread_id, (int) conn->in_length);
 
 			return ERROR;
 
 		}
 
-		if (received + n > (i + 1) * REQUEST_ALLOC_SIZE) {
-
-			i++;
+		/* The end of line may be split between two reads */
+		scanned = conn->in_length > 3 ? conn->in_length - 3 : 0;
 
-			debug(conf.output_level, 
-				"[%d] DEBUG: reallocating...\n",
-				thread_id);
+		if ((n = conn_receive(conn, 0)) <= 0) {
 
-			if ((*data = realloc(*data, received + REQUEST_ALLOC_SIZE)) == NULL) {
-				handle_error("realloc");
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				debug(conf.output_level,
+					"[%d] DEBUG: request header timed out\n",
+					thread_id);
 			}
 
+			return ERROR;
+
 		}
 
-		memcpy(*data + received, chunk, n);
-		received += n;
+	}
 
-		/* Read the end of line... backwards */
-		if (received >= 4 && strncmp(*data + received - 4, "\r\n\r\n", 4) == 0) {
+	if (end + 4 - conn->in > REQUEST_MAX_SIZE) {
 
-			debug(conf.output_level, 
-				"[%d] DEBUG: end of request found\n",
-				thread_id);
+		debug(conf.output_level,
+			"[%d] DEBUG: max request size reached (%d bytes)\n",
+			thread_id, (int) (end + 4 - conn->in));
 
-			return received;
+		return ERROR;
 
-		}
+	}
+
+	debug(conf.output_level, 
+		"[%d] DEBUG: end of request found\n",
+		thread_id);
+
+	return end + 4 - conn->in;
+
+}
 
+/*
+ * Answers the current request with an empty error response and closes the
+ * connection after it. The response is queued as the connection output,
+ * behind the responses batched for the previous pipelined requests, and
+ * each server mode sends it the way it sends any response: the event
+ * loops never wait for a client that is not reading. Without memory left
+ * for it nothing is queued and the connection is just closed.
+ *
+ * @param conn: the connection, the request rejected is its current one
+ * @param status: the status line, code and reason phrase
+ */
+static void reject_request(conn_t *conn, char *status) {
+
+	char *response;
+
+	int length;
+
+	if ((response = malloc(REQUEST_REJECT_SIZE)) == NULL) {
+		return;
+	}
+
+	length = snprintf(response, REQUEST_REJECT_SIZE,
+		"%s %s\r\n"
+		"Server: %s\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		conn->config->http_version, status, conn->config->server_name);
+
+	if (length <= 0 || length >= REQUEST_REJECT_SIZE) {
+		free(response);
+		return;
 	}
 
-	return ERROR;
+	free(conn->out);
+
+	conn->out = response;
+	conn->out_length = length;
+	conn->out_sent = 0;
+
+	conn->keep_alive = FALSE;
+	conn->state = CONN_WRITING;
 
 }
 
 /*
- * Reads the data from the socket and puts it in a buffer
+ * Answers a request that can not be parsed with a 400 (see
+ * reject_request())
  *
  * @param thread_id: the thread id handling the request
- * @param sockfd: socket file descriptor to read data from
- * @param data: buffer where readed data will be stored
+ * @param conn: the connection
  */
-int receive_message_body(int thread_id, int sockfd, char **data, size_t length) {
+void reject_malformed_request(int thread_id, conn_t *conn) {
 
-	int i, n, received;
+	debug(conf.output_level, "[%d] DEBUG: malformed request\n", thread_id);
 
-	uint8_t chunk[1];
+	reject_request(conn, "400 Bad Request");
+
+}
+
+/*
+ * Answers a request whose message body is too large to be held with a 413
+ * (see reject_request())
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection
+ */
+void reject_message_body(int thread_id, conn_t *conn) {
 
-	fd_set select_set;
+	debug(conf.output_level,
+		"[%d] DEBUG: message body too large (%s)\n",
+		thread_id, strerror(errno));
 
- 	struct timeval timeout;
+	reject_request(conn, "413 Payload Too Large");
 
-	i = 0;
-	n = 0;
-	received = 0;
+}
 
-	while ((n = read(sockfd, chunk, 1)) > 0) {
-		
-		if (received + n > REQUEST_MAX_MESSAGE_SIZE) {
-			/* max size per request has been reached! */
-			debug(conf.output_level, 
-				"[%d] DEBUG: max message body size reached (%d bytes)\n", 
-				thread_id, received + n);
+/*
+ * Receives into the connection buffer until it holds the whole request,
+ * message body included. The buffer grows with the bytes that actually
+ * arrive, never ahead of them up to the announced length.
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection to read data from
+ * @param length: number of bytes the request takes in the buffer
+ * @return: number of bytes in the buffer, -1 on error
+ */
+int receive_message_body(int thread_id, conn_t *conn, size_t length) {
 
-			return ERROR;
-		}
+	ssize_t n;
 
-		if (received + n > (i + 1) * REQUEST_ALLOC_MESSAGE_SIZE) {
+	while (conn->in_length < length) {
 
-			i++;
+		if ((n = conn_receive(conn, 0)) == 0) {
 
-			debug(conf.output_level, 
-				"[%d] DEBUG: reallocating...\n",
+			debug(conf.output_level,
+				"[%d] DEBUG: client closed connection\n",
 				thread_id);
 
-			if ((*data = realloc(*data, received + REQUEST_ALLOC_SIZE)) == NULL) {
-				handle_error("realloc");
-			}
+			return ERROR;
 
-		}
+		} else if (n < 0) {
 
-		memcpy(*data + received, chunk, n);
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* SO_RCVTIMEO expired while waiting for the rest of the body */
+				debug(conf.output_level,
+					"[%d] DEBUG: message body timed out\n",
+					thread_id);
 
-		received += n;
+				return ERROR;
 
-		if (received >= length) break;
+			} else if (errno == ENOMEM) {
 
-	}
+				reject_message_body(thread_id, conn);
+
+				return ERROR;
+
+			}
+
+			debug(conf.output_level,
+				"[%d] DEBUG: unable to receive message body (%s)\n",
+				thread_id, strerror(errno));
+
+			return ERROR;
+
+		}
 
-	if (n < 0) {
-		handle_error("read");
 	}
 
-	return received;
+	return conn->in_length;
 
 }
 
 /*
- * Iterate through the header_t content looking for the specified header name
+ * Looks for the specified header name (case insensitive). Well-known names
+ * are found in their slot, other ones by iterating through the request
+ * headers.
  *
  * @param req: pointer to the request struct
  * @param name: the name of the header we are looking for
@@ -155,10 +291,19 @@ int get_request_header(request_t *req, char *name, char **value) {
 
 	int i;
 
+	size_t length;
+
+	length = strlen(name);
+
+	if ((i = header_slot(name, length)) >= 0) {
+		return get_request_slot(req, i, value);
+	}
+
 	for (i = 0; i < req->num_headers; i++) {
 
-		if (strncmp(req->headers[i]->name, name, strlen(name)) == 0) {
-			*value = req->headers[i]->value;
+		if (req->headers[i].name.length == length
+			&& strncasecmp(req->headers[i].name.data, name, length) == 0) {
+			*value = req->headers[i].value.data;
 			return i;
 		}
 
@@ -169,257 +314,443 @@ int get_request_header(request_t *req, char *name, char **value) {
 }
 
 /*
- * Handles the request process. It uses the receive_request function
- * and parses the received data filling a request_t data structure.
+ * Gets a well-known header of the request
+ *
+ * @param req: pointer to the request struct
+ * @param slot: the header (HEADER_*)
+ * @param value: a pointer to access the header value when found
+ * @return: the position of the header in the request struct, -1 otherwise
+ */
+int get_request_slot(request_t *req, int slot, char **value) {
+
+	int i;
+
+	if ((i = req->slots[slot] - 1) >= 0) {
+		*value = req->headers[i].value.data;
+	}
+
+	return i;
+
+}
+
+/*
+ * Parses a complete request header block (request line and headers up
+ * to the empty line) filling a request_t data structure. The tokens are
+ * measured and validated by the request tokenizer (see scan.c). Nothing
+ * is copied: the request fields point into the buffer, whose delimiters
+ * are replaced by null characters so that the fields can be used as
+ * strings.
  *
  * @param thread_id: the thread id handling the request
- * @param sockfd: socket file descriptor to read data from the client
+ * @param buffer: the request header block
+ * @param length: the header block length, final CRLF CRLF included
  * @param req: request_t data structure to store the parsed data
+ * @return: 0 on success, -1 when the request is malformed
  */
-int handle_request(int thread_id, int sockfd, request_t *req) {
+int parse_request(int thread_id, char *buffer, size_t length, request_t *req) {
 
-	char *buffer = NULL;
-	char *method = NULL;
-	char *query = NULL;
-	char *content_length = NULL;
+	char *end, *line, *question, *value, *last;
+
+	int slot;
 
-	int start, end, pos, tmp, n;
-	int string_length, message_length;
-	int received;
+	size_t n;
 
 	uint8_t i;
 
-	start = 0;
-	end = 0;
+	request_header_t *header;
 
-	pos = 0;
-	tmp = 0;
-	n = 0;
+	end = buffer + length;
 
-	string_length = 0;
-	message_length = 0;
-	received = 0;
+	/* Request line: method, request target and version. No token goes
+	 * past the final CRLF CRLF, the byte that follows can always be read */
+	if ((n = scan_span(buffer, length, SCAN_TOKEN)) == 0 || buffer[n] != ' ') {
+		return ERROR;
+	}
 
-	/* allocate first 1024 bytes for the request */
-	buffer = malloc(REQUEST_ALLOC_SIZE);
-	memset(buffer, 0, REQUEST_ALLOC_SIZE);
+	for (i = 0; i < 7; i++) {
 
-	if ((n = receive_request(thread_id, sockfd, &buffer)) < 0) {
-		/* There has been an error receiving the client request :( */
-		free(buffer);
+		if (strlen(methods[i]) == n && strncmp(methods[i], buffer, n) == 0) {
+			req->method = i;
+			break;
+		}
 
+	}
+
+	req->uri.data = buffer + n + 1;
+
+	if ((n = scan_span(req->uri.data, end - req->uri.data, SCAN_TARGET)) == 0
+		|| req->uri.data[n] != ' ') {
 		return ERROR;
+	}
 
-	} else if (n == 0) {
+	req->uri.data[n] = '\0';
+	req->uri.length = n;
 
-		free(buffer);
+	req->_mask |= _REQUEST_URI;
 
-		debug(conf.output_level, "[%d] empty request\n", thread_id);
+	req->version.data = req->uri.data + n + 1;
 
+	if ((n = scan_span(req->version.data, end - req->version.data, SCAN_TARGET)) == 0
+		|| strncmp(req->version.data + n, "\r\n", 2) != 0) {
 		return ERROR;
+	}
+
+	req->version.data[n] = '\0';
+	req->version.length = n;
+
+	req->_mask |= _REQUEST_VERSION;
+
+	/* The resource is the request target up to the query string */
+	req->resource.data = req->uri.data;
+	req->resource.length = req->uri.length;
+
+	if ((question = memchr(req->uri.data, '?', req->uri.length)) != NULL) {
+
+		*question = '\0';
+		req->resource.length = question - req->uri.data;
+
+		req->query.data = question + 1;
+		req->query.length = req->uri.length - req->resource.length - 1;
+
+		req->_mask |= _REQUEST_QUERY;
+
+		debug(conf.output_level,
+			"[%d] DEBUG: query %s\n",
+			thread_id, req->query.data);
 
 	}
 
-	debug(conf.output_level, "[%d] Request:\n%s\n", thread_id, buffer);
+	req->_mask |= _REQUEST_RESOURCE;
 
-	while (strncmp(&buffer[start], "\r\n", 2) != 0) {
+	/* Header fields, up to the empty line */
+	for (line = req->version.data + n + 2; strncmp(line, "\r\n", 2) != 0; line = value + n + 2) {
 
-		while (strncmp(&buffer[end], "\r\n", 2) != 0) end++;
+		if ((n = scan_span(line, end - line, SCAN_TOKEN)) == 0 || line[n] != ':') {
+			return ERROR;
+		}
 
-		if (start == 0) {
+		if (req->num_headers == REQUEST_MAX_HEADERS) {
 
-			pos = 0;
-			tmp = 0;
+			debug(conf.output_level,
+				"[%d] DEBUG: too many header fields\n",
+				thread_id);
 
-			/* allocate request. REMEMBER TO FREE request AFTER sending response */
-			while (strncmp(&buffer[pos], " ", 1) != 0) pos++;
+			return ERROR;
 
-			method = malloc(pos + 1);
-			memset(method, 0, pos + 1);
-			strncat(method, buffer, pos);
+		}
 
-			for (i = 0; i < 7; i++) {
-				if(strncmp(methods[i], method, strlen(method)) == 0) {
-					req->method = i;
-				}
-			}
+		header = &(req->headers[req->num_headers++]);
 
-			paranoid_free_string(method);
+		line[n] = '\0';
+		header->name.data = line;
+		header->name.length = n;
 
-			pos++;
-			
-			tmp = pos;
+		/* The first field of a well-known name is the one looked up */
+		if ((slot = header_slot(line, n)) >= 0 && req->slots[slot] == 0) {
+			req->slots[slot] = req->num_headers;
+		}
 
-			while (strncmp(&buffer[pos], " ", 1) != 0) pos++;
-			
-			req->uri = malloc(pos + 1 - tmp);
-			memset(req->uri, 0, pos + 1 - tmp);
-			strncat(req->uri, &buffer[tmp], pos - tmp);
-			
-			req->_mask |= _REQUEST_URI;
+		/* The value goes without the white space around it */
+		for (value = line + n + 1; *value == ' ' || *value == '\t'; value++);
 
-			pos++;
-			
-			tmp = pos;
+		n = scan_span(value, end - value, SCAN_VALUE);
 
-			while (strncmp(&buffer[pos], "\r\n", 2) != 0) pos++;
+		if (strncmp(value + n, "\r\n", 2) != 0) {
+			return ERROR;
+		}
 
-			req->version = malloc(pos + 1 - tmp);
-			memset(req->version, 0, pos + 1 - tmp);
-			strncat(req->version, &buffer[tmp], pos - tmp);
+		for (last = value + n; last > value && (last[-1] == ' ' || last[-1] == '\t'); last--);
 
-			req->_mask |= _REQUEST_VERSION;
+		*last = '\0';
+		header->value.data = value;
+		header->value.length = last - value;
 
-		} else {
+	}
 
-			pos = 0;
-			tmp = 0;
+	return 0;
 
-			/* reallocate header_t struct of request_t */
-			if (req->num_headers == 0) {
-				req->headers = malloc(sizeof(header_t *));
-			} else {
-				req->headers = realloc(req->headers, (req->num_headers + 1)*sizeof(header_t *));
-			}
+}
 
-			req->headers[req->num_headers] = malloc(sizeof(header_t *));
+/*
+ * Points the request at its message body, received right after the
+ * header block
+ *
+ * @param req: the request the body belongs to
+ * @param data: the message body
+ * @param length: the message body length
+ */
+void set_request_body(request_t *req, char *data, size_t length) {
 
-			/* parse headers */
-			while (strncmp(&buffer[start + pos], ":", 1) != 0) pos++;
-			req->headers[req->num_headers]->name = malloc(pos++);
-			tmp = pos;
+	req->message_body.data = data;
+	req->message_body.length = length;
 
-			while (strncmp(&buffer[start + pos], "\r\n", 2) != 0) pos++;
-			req->headers[req->num_headers]->value = malloc((pos++) - tmp);
-			tmp = pos;
+	req->_mask |= _REQUEST_MESSAGE;
 
-			sscanf(&buffer[start], "%[^:]: %[^\r\n]", 
-				req->headers[req->num_headers]->name, 
-				req->headers[req->num_headers]->value);
+}
 
-			req->num_headers++;
+/*
+ * Moves the request fields along with the receive buffer when it has been
+ * reallocated
+ *
+ * @param req: the request pointing into the buffer
+ * @param offset: new buffer address minus the old one
+ */
+void rebase_request(request_t *req, intptr_t offset) {
 
-		}
+	int i;
 
-		end += 2;
-		start = end;
+	if (req->_mask & _REQUEST_URI) req->uri.data += offset;
+	if (req->_mask & _REQUEST_VERSION) req->version.data += offset;
+	if (req->_mask & _REQUEST_RESOURCE) req->resource.data += offset;
+	if (req->_mask & _REQUEST_QUERY) req->query.data += offset;
+	if (req->_mask & _REQUEST_MESSAGE) req->message_body.data += offset;
 
+	for (i = 0; i < req->num_headers; i++) {
+		req->headers[i].name.data += offset;
+		req->headers[i].value.data += offset;
 	}
 
-	/* Look for the query part */
-	if (strchr(req->uri, '?') != NULL) {
+}
 
-		query = strchr(req->uri, '?');
+/*
+ * Reads a Content-Length value, made of decimal digits only
+ *
+ * @param value: the header field value
+ * @return: the message body length (LLONG_MAX when it does not fit), -1
+ * when the value is not a length
+ */
+static long long content_length_value(char *value) {
 
-		string_length = strlen(query);
+	char *end;
 
-		req->query = malloc(string_length + 1);
-		memset(req->query, 0, string_length + 1);
-		strncat(req->query, query, string_length);
+	long long length;
 
-		req->_mask |= _REQUEST_QUERY;
+	/* strtoll() would take white space and a sign as well */
+	if (*value < '0' || *value > '9') {
+		return ERROR;
+	}
 
-		debug(conf.output_level,
-			"[%d] DEBUG: query %s\n",
-			thread_id, req->query);
+	errno = 0;
 
+	length = strtoll(value, &end, 10);
+
+	if (*end != '\0') {
+		return ERROR;
 	}
 
-	/* Get the resource requested */
-	if (req->_mask & _REQUEST_QUERY) {
-		string_length = strlen(req->uri) - strlen(req->query); // Strip query string from uri
-	} else {
-		string_length = strlen(req->uri);
+	return errno == ERANGE ? LLONG_MAX : length;
+
+}
+
+/*
+ * Parses the request header block, the first length bytes of the
+ * connection buffer, and adds the message body announced to the length of
+ * the whole request in conn->in_needed.
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection state
+ * @param length: the header block length, final CRLF CRLF included
+ * @return: 1 on success, -1 when the request is rejected
+ */
+static int parse_header_block(int thread_id, conn_t *conn, size_t length) {
+
+	char *content_length = NULL;
+
+	long long message_length;
+
+	debug(conf.output_level, "[%d] Request:\n%.*s\n", thread_id, (int) length, conn->in);
+
+	if (parse_request(thread_id, conn->in, length, &(conn->request)) < 0) {
+
+		reject_malformed_request(thread_id, conn);
+
+		return ERROR;
+
 	}
 
-	req->resource = malloc(string_length + 1);
-	memset(req->resource, 0, string_length + 1);
-	strncat(req->resource, req->uri, string_length);
+	conn->in_needed = length;
 
-	req->_mask |= _REQUEST_RESOURCE;
+	if (get_request_slot(&(conn->request), HEADER_CONTENT_LENGTH, &content_length) != -1) {
 
-	string_length = 0;
+		if ((message_length = content_length_value(content_length)) < 0) {
 
-	/* free buffer */
-	free(buffer);
+			reject_malformed_request(thread_id, conn);
 
-	if (get_request_header(req, "Content-Length", &content_length) != -1) {
+			return ERROR;
 
-		message_length = atoi(content_length);
+		}
 
 		if (message_length > REQUEST_MAX_MESSAGE_SIZE) {
+
+			errno = EFBIG;
+			reject_message_body(thread_id, conn);
+
 			return ERROR;
+
 		}
 
-		buffer = malloc(REQUEST_ALLOC_MESSAGE_SIZE);
+		conn->in_needed += message_length;
 
-		if ((received = receive_message_body(thread_id, sockfd, &buffer, message_length)) < 0) {
-			/* There has been an error receiving the message body :( */
-			free(buffer);
-			free_request(req);
-			return ERROR;
+	}
 
+	return 1;
+
+}
+
+/*
+ * Parses the request header from what the connection buffer holds so far,
+ * without receiving anything: each server mode receives its own way and
+ * calls it again when more bytes are in. The length of the whole request,
+ * message body included, is left in conn->in_needed.
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection state
+ * @return: 1 when the request header has been parsed, 0 when the header
+ * block is not complete yet, -1 when the request is rejected: the
+ * connection is to be closed, once its output has been sent when it has
+ * been left CONN_WRITING with an error response (see reject_request())
+ */
+int parse_request_header(int thread_id, conn_t *conn) {
+
+	char *end;
+
+	if ((end = scan_header_end(conn->in, conn->in_length)) == NULL) {
+
+		if (conn->in_length < REQUEST_MAX_SIZE) {
+			return 0;
 		}
 
-		req->message_body = malloc(received + 1);
-		memset(req->message_body, 0, received + 1);
+		debug(conf.output_level,
+			"[%d] DEBUG: max request size reached (%d bytes)\n",
+			thread_id, (int) conn->in_length);
+
+		return ERROR;
+
+	}
 
-		memcpy(req->message_body, buffer, received);
-		req->_mask |= _REQUEST_MESSAGE;
+	if (end + 4 - conn->in > REQUEST_MAX_SIZE) {
 
-		free(buffer);
+		debug(conf.output_level,
+			"[%d] DEBUG: max request size reached (%d bytes)\n",
+			thread_id, (int) (end + 4 - conn->in));
 
-		debug(conf.output_level, 
-			"[%d] DEBUG: message body: %s\n",
-			thread_id, req->message_body);
+		return ERROR;
 
- 	}
+	}
 
-	return 0;
+	return parse_header_block(thread_id, conn, end + 4 - conn->in);
 
 }
 
 /*
- * Free the allocated memory for the request struct
+ * Points the request at its message body, if any, once the connection
+ * buffer holds the whole request (see parse_request_header())
  *
- * @param req: pointer to a request_t struct
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection state
  */
-void free_request(request_t *req) {
+void parse_request_body(int thread_id, conn_t *conn) {
 
-	int i;
+	char *content_length = NULL;
 
-	/* free request headers */
-	if (req->num_headers > 0) {
+	long long message_length;
 
-		for (i = 0; i < req->num_headers; i++) {
+	request_t *req;
 
-			paranoid_free_string(req->headers[i]->name);
-			paranoid_free_string(req->headers[i]->value);
-			free(req->headers[i]);
+	req = &(conn->request);
 
-		}
+	if (get_request_slot(req, HEADER_CONTENT_LENGTH, &content_length) == -1) {
+		return;
+	}
+
+	/* Checked along with the request header */
+	message_length = content_length_value(content_length);
 
-		free(req->headers);
+	set_request_body(req, conn->in + conn->in_needed - message_length, message_length);
 
-		req->num_headers = 0;
+	debug(conf.output_level,
+		"[%d] DEBUG: message body: %.*s\n",
+		thread_id, (int) req->message_body.length, req->message_body.data);
 
+}
+
+/*
+ * Receives the request header block and parses it filling the request_t
+ * data structure of the connection. The length of the whole request,
+ * message body included, is left in conn->in_needed.
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection to read data from
+ * @return: 0 on success, -1 on error (see parse_request_header())
+ */
+int handle_request_header(int thread_id, conn_t *conn) {
+
+	int n;
+
+	if ((n = receive_request(thread_id, conn)) < 0) {
+		/* There has been an error receiving the client request :( */
+		return ERROR;
 	}
 
-	if (req->_mask & _REQUEST_MESSAGE) paranoid_free_string(req->message_body);
-	req->_mask &= ~_REQUEST_MESSAGE;
+	if (parse_header_block(thread_id, conn, n) < 0) {
+		return ERROR;
+	}
 
-	if (req->_mask & _REQUEST_QUERY) paranoid_free_string(req->query);
-	req->_mask &= ~_REQUEST_QUERY;
+	return 0;
 
-	if (req->_mask & _REQUEST_RESOURCE) paranoid_free_string(req->resource);
-	req->_mask &= ~_REQUEST_RESOURCE;
+}
 
-	if (req->_mask & _REQUEST_VERSION) paranoid_free_string(req->version);
-	req->_mask &= ~_REQUEST_VERSION;
+/*
+ * Receives the message body announced by the parsed request header, if
+ * any, and points the request at it. The request stays in the connection
+ * buffer until conn_reset().
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection with the parsed request header
+ * @return: 0 on success, -1 on error (see parse_request_header())
+ */
+int handle_request_body(int thread_id, conn_t *conn) {
+
+	if (receive_message_body(thread_id, conn, conn->in_needed) < 0) {
+		/* There has been an error receiving the message body :( */
+		return ERROR;
+	}
+
+	parse_request_body(thread_id, conn);
+
+	return 0;
+
+}
+
+/*
+ * Handles the request process. It uses the receive_request function
+ * and parses the received data filling a request_t data structure.
+ *
+ * @param thread_id: the thread id handling the request
+ * @param conn: the connection to read data from
+ */
+int handle_request(int thread_id, conn_t *conn) {
+
+	if (handle_request_header(thread_id, conn) < 0) {
+		return ERROR;
+	}
 
-	if (req->_mask & _REQUEST_URI) paranoid_free_string(req->uri);
-	req->_mask &= ~_REQUEST_URI;
+	return handle_request_body(thread_id, conn);
+
+}
 
+/*
+ * Clears the request struct. Its fields point into the receive buffer, so
+ * there is nothing to free.
+ *
+ * @param req: pointer to a request_t struct
+ */
+void free_request(request_t *req) {
+
+	req->_mask = 0;
+	req->num_headers = 0;
 	req->method = 0;
 
+	memset(req->slots, 0, sizeof(req->slots));
+
 }
\ No newline at end of file
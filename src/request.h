@@ -5,10 +5,27 @@
 #ifndef __REQUEST_H
 #define __REQUEST_H
 
-#define REQUEST_ALLOC_SIZE			512			// allocate first 512 bytes for requests
 #define REQUEST_MAX_SIZE			8192		// 8 KB
-#define REQUEST_ALLOC_MESSAGE_SIZE	1048576		// 1 MB
 #define REQUEST_MAX_MESSAGE_SIZE	1073741824	// 1 GB
+#define REQUEST_MAX_HEADERS			64			// header fields per request, at most
+#define REQUEST_REJECT_SIZE			512			// room for an error response sent before closing
+
+/* well-known header fields, found without a scan (see get_request_slot()) */
+#define HEADER_HOST					0
+#define HEADER_CONNECTION			1
+#define HEADER_CONTENT_LENGTH		2
+#define HEADER_CONTENT_TYPE			3
+#define HEADER_TRANSFER_ENCODING	4
+#define HEADER_EXPECT				5
+#define HEADER_IF_NONE_MATCH		6
+#define HEADER_IF_MODIFIED_SINCE	7
+#define HEADER_RANGE				8
+#define HEADER_ACCEPT				9
+#define HEADER_ACCEPT_ENCODING		10
+#define HEADER_USER_AGENT			11
+#define HEADER_COOKIE				12
+#define HEADER_AUTHORIZATION		13
+#define HEADER_SLOTS				14
 
 #define _REQUEST_URI				0x01
 #define _REQUEST_VERSION			0x02
@@ -27,18 +44,36 @@ typedef struct request {
 	// ........ ........ ........ ...x.... message body
 	uint16_t num_headers;
 	uint8_t method;
-	char *uri;
-	char *version;
-	char *resource;
-	char *query;
-	char *message_body;
-	header_t **headers;
+	// Every field points into the connection receive buffer, which holds
+	// the request until conn_reset(). The parser null terminates them in
+	// place, but for the uri (its '?' ends the resource) and the body.
+	view_t uri;
+	view_t version;
+	view_t resource;
+	view_t query;
+	view_t message_body;
+	request_header_t headers[REQUEST_MAX_HEADERS];
+	// Position + 1 in headers of the first field of each well-known
+	// name, 0 when the request does not have it
+	uint8_t slots[HEADER_SLOTS];
 } request_t;
 
-int receive_request(int thread_id, int sockfd, char **data);
-int receive_message_body(int thread_id, int sockfd, char **data, size_t length);
+struct conn;
+
+int receive_request(int thread_id, struct conn *conn);
+int receive_message_body(int thread_id, struct conn *conn, size_t length);
+void reject_malformed_request(int thread_id, struct conn *conn);
+void reject_message_body(int thread_id, struct conn *conn);
 int get_request_header(request_t *req, char *name, char **value);
-int handle_request(int thread_id, int sockfd, request_t *req);
+int get_request_slot(request_t *req, int slot, char **value);
+int parse_request(int thread_id, char *buffer, size_t length, request_t *req);
+int parse_request_header(int thread_id, struct conn *conn);
+void parse_request_body(int thread_id, struct conn *conn);
+void set_request_body(request_t *req, char *data, size_t length);
+void rebase_request(request_t *req, intptr_t offset);
+int handle_request_header(int thread_id, struct conn *conn);
+int handle_request_body(int thread_id, struct conn *conn);
+int handle_request(int thread_id, struct conn *conn);
 void free_request(request_t *req);
 
 #endif
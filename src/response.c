@@ -8,6 +8,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 
 /* local header files */
 #include "constants.h"
@@ -16,9 +17,13 @@
 #include "headers.h"
 #include "request.h"
 #include "response.h"
+#include "upgrade.h"
+#include "stats.h"
 #include "util.h"
 
 extern config_t conf;
+extern __thread config_t *request_conf;
+extern __thread vhost_t *request_vhost;
 
 void set_response_status(response_t *resp, int status_code, char *reason_phrase) {
 
@@ -86,7 +91,7 @@ void write_response_header(response_t *resp, char *name, char *value) {
 
 		}
 
-		resp->headers[resp->num_headers] = malloc(sizeof(header_t *));
+		resp->headers[resp->num_headers] = malloc(sizeof(header_t));
 
 		resp->headers[resp->num_headers]->name = malloc(strlen(name) + 1);
 		resp->headers[resp->num_headers]->value = malloc(strlen(value) + 1);
@@ -126,31 +131,41 @@ void append_response_header(response_t *resp, char *name, char *value) {
 
 }
 
-void send_response_headers(int thread_id, int sockfd, response_t *resp) {
+/*
+ * Serializes the status line and the response headers, including the empty
+ * line that ends the headers part.
+ *
+ * @param resp: a pointer to a response_t struct
+ * @param buffer: address where the serialized headers will be stored
+ * @return: the length of the buffer
+ *
+ * WARNING: this function allocates memory. Remember to free it when not
+ * in use.
+ */
+int build_response_headers(response_t *resp, char **buffer) {
 
-	char *buffer;
 	char status_code[4];
 
-	int i, w, length;
+	int i, length;
 
 	sprintf(status_code, "%d", resp->status_code);
 
-	length = strlen(conf.http_version) 
+	length = strlen(request_conf->http_version) 
 		+ 1 + strlen(status_code) 
 		+ 1 + strlen(resp->reason_phrase) 
 		+ 3;
 
-	buffer = malloc(length);
-	memset(buffer, 0, length);
+	*buffer = malloc(length);
+	memset(*buffer, 0, length);
 
-	strncpy(buffer, conf.http_version, strlen(conf.http_version));
-	strncat(buffer, " ", 1);
+	strncpy(*buffer, request_conf->http_version, strlen(request_conf->http_version));
+	strncat(*buffer, " ", 1);
 
-	strncat(buffer, status_code, strlen(status_code));
-	strncat(buffer, " ", 1);
-	strncat(buffer, resp->reason_phrase, strlen(resp->reason_phrase));
+	strncat(*buffer, status_code, strlen(status_code));
+	strncat(*buffer, " ", 1);
+	strncat(*buffer, resp->reason_phrase, strlen(resp->reason_phrase));
 
-	strncat(buffer, "\r\n", 2);
+	strncat(*buffer, "\r\n", 2);
 
 	for (i = 0; i < resp->num_headers; i++) {
 
@@ -159,91 +174,54 @@ void send_response_headers(int thread_id, int sockfd, response_t *resp) {
 			+ strlen(resp->headers[i]->value)
 			+ 2;		
 
-		buffer = realloc(buffer, strlen(buffer) + length + 1);
-
-		strncat(buffer, resp->headers[i]->name, strlen(resp->headers[i]->name));
-		strncat(buffer, ": ", 2);
-		strncat(buffer, resp->headers[i]->value, strlen(resp->headers[i]->value));
-
-		strncat(buffer, "\r\n", 2);
-
-	}
-
-	if ((w = send(sockfd, buffer, strlen(buffer), 0)) != strlen(buffer)) {
-
-		if (errno == EBADF || errno == EPIPE) {
-
-			debug(conf.output_level, 
-				"[%d] DEBUG: unable to send response headers (%s)\n", 
-				thread_id, strerror(errno));
+		*buffer = realloc(*buffer, strlen(*buffer) + length + 1);
 
-		} else {
-
-			handle_error("send");
+		strncat(*buffer, resp->headers[i]->name, strlen(resp->headers[i]->name));
+		strncat(*buffer, ": ", 2);
+		strncat(*buffer, resp->headers[i]->value, strlen(resp->headers[i]->value));
 
-		}
+		strncat(*buffer, "\r\n", 2);
 
 	}
 
-	debug(conf.output_level, 
-		"[%d] Response:\n%s\n", 
-		thread_id, buffer);
-
-	/* Send a new line to end the headers part */
-	if ((w = send(sockfd, "\r\n", 2, 0)) != 2) {
+	/* A new line ends the headers part */
+	length = strlen(*buffer) + 2;
 
-		if (errno == EBADF || errno == EPIPE) {
+	*buffer = realloc(*buffer, length + 1);
+	strncat(*buffer, "\r\n", 2);
 
-			debug(conf.output_level, 
-				"[%d] DEBUG: unable to send response new line (%s)\n", 
-				thread_id, strerror(errno));
-
-		} else {
-
-			handle_error("send");
-
-		}
-
-	}
-
-	paranoid_free_string(buffer);
-
-}
-
-void send_response_content(int thread_id, int sockfd, response_t *resp) {
-
-	if (resp->_mask & _RESPONSE_FILE_PATH) {
-
-		send_file(sockfd, resp->file_path);
-
-	}
+	return length;
 
 }
 
 /*
- * Receives the client request and generates the response corresponding
- * to the requested method.
+ * Generates the response corresponding to the requested method without
+ * sending anything to the client.
  *
  * @param thread_id: the thread id handling the request
- * @param sockfd: the socket stream
  * @param req: request_t data structure where the request is stored
  * @param resp: response_t data structure
+ * @return: a combination of SEND_HEADERS and SEND_CONTENT telling which parts
+ * of the response have to be sent
  */
-void handle_response(int thread_id, int sockfd, request_t *req, response_t *resp) {
+int prepare_response(int thread_id, request_t *req, response_t *resp) {
 
 	char *connection;
 	char date_buffer[MAX_DATE_SIZE];
 
-	int i;
+	int flags;
 
 	connection = NULL;
+	flags = 0;
+
+	stats_add(&(stats.requests), 1);
 
 	get_date(date_buffer, "%a, %d %b %Y %H:%M:%S %Z");
 
 	write_response_header(resp, "Date", date_buffer);
-	write_response_header(resp, "Server", conf.server_name);
+	write_response_header(resp, "Server", request_conf->server_name);
 
-	get_request_header(req, "Connection", &connection);
+	get_request_slot(req, HEADER_CONNECTION, &connection);
 
 	if (connection == NULL) {
 
@@ -253,6 +231,11 @@ void handle_response(int thread_id, int sockfd, request_t *req, response_t *resp
 
 		write_response_header(resp, "Connection", "close");
 
+	} else if (upgrade_draining()) {
+
+		/* The connection is closed after this response, see upgrade_drain() */
+		write_response_header(resp, "Connection", "close");
+
 	} else {
 
 		write_response_header(resp, "Connection", "keep-alive");
@@ -263,16 +246,20 @@ void handle_response(int thread_id, int sockfd, request_t *req, response_t *resp
 
 		case GET:
 
-			if (handle_get(thread_id, req, resp) < 0) {
+			if (request_conf->status_location != NULL && strcmp(req->resource.data, request_conf->status_location) == 0) {
+
+				handle_status(thread_id, req, resp);
+				flags = SEND_HEADERS | SEND_CONTENT;
+
+			} else if (handle_get(thread_id, req, resp) < 0) {
 
 				set_response_status(resp, 500, "Internal Server Error");
 				set_error_document(thread_id, resp, 500);
-				send_response_headers(thread_id, sockfd, resp);
+				flags = SEND_HEADERS;
 
 			} else {
 
-				send_response_headers(thread_id, sockfd, resp);
-				send_response_content(thread_id, sockfd, resp);
+				flags = SEND_HEADERS | SEND_CONTENT;
 
 			}
 
@@ -286,7 +273,7 @@ void handle_response(int thread_id, int sockfd, request_t *req, response_t *resp
 
 			} else {
 
-				send_response_headers(thread_id, sockfd, resp);
+				flags = SEND_HEADERS;
 
 			}
 
@@ -298,12 +285,11 @@ void handle_response(int thread_id, int sockfd, request_t *req, response_t *resp
 
 				set_response_status(resp, 500, "Internal Server Error");
 				set_error_document(thread_id, resp, 500);
-				send_response_headers(thread_id, sockfd, resp);
+				flags = SEND_HEADERS;
 
 			} else {
 
-				send_response_headers(thread_id, sockfd, resp);
-				send_response_content(thread_id, sockfd, resp);
+				flags = SEND_HEADERS | SEND_CONTENT;
 
 			}
 
@@ -328,12 +314,14 @@ void handle_response(int thread_id, int sockfd, request_t *req, response_t *resp
 		default:
 
 			set_response_status(resp, 405, "Method Not Allowed");
-			send_response_headers(thread_id, sockfd, resp);
+			flags = SEND_HEADERS;
 
 			break;
 
 	}
 
+	return flags;
+
 }
 
 /*
@@ -366,7 +354,7 @@ int handle_get(int thread_id, request_t *req, response_t *resp) {
 
 	string_length = 0;
 
-	if (resource_path(req->resource, &res_path) < 0) {
+	if (resource_path(req->resource.data, &res_path) < 0) {
 		handle_error("resource_path");
 	}
 
@@ -406,9 +394,9 @@ int handle_get(int thread_id, request_t *req, response_t *resp) {
 
 			debug(conf.output_level,
 				"[%d] DEBUG: default mime type %s\n",
-				thread_id, conf.default_type);
+				thread_id, request_conf->default_type);
 
-			mime_type = conf.default_type;
+			mime_type = request_conf->default_type;
 
 		} else {
 
@@ -423,10 +411,10 @@ int handle_get(int thread_id, request_t *req, response_t *resp) {
 		/* Append charset when mime type is text */
 		if (strncmp(mime_type, "text", 4) == 0) {
 
-			charset = malloc(strlen("charset=") + strlen(conf.charset) + 1);
-			memset(charset, 0, strlen("charset=") + strlen(conf.charset) + 1);
+			charset = malloc(strlen("charset=") + strlen(request_conf->charset) + 1);
+			memset(charset, 0, strlen("charset=") + strlen(request_conf->charset) + 1);
 			strncat(charset, "charset=", strlen("charset="));
-			strncat(charset, conf.charset, strlen(conf.charset));
+			strncat(charset, request_conf->charset, strlen(request_conf->charset));
 
 			append_response_header(resp, "Content-Type", charset);
 
@@ -482,7 +470,7 @@ int handle_post(int thread_id, request_t *req, response_t *resp) {
 
 	string_length = 0;
 
-	if (resource_path(req->resource, &res_path) < 0) {
+	if (resource_path(req->resource.data, &res_path) < 0) {
 		handle_error("resource_path");
 	}
 
@@ -523,9 +511,9 @@ int handle_post(int thread_id, request_t *req, response_t *resp) {
 
 			debug(conf.output_level,
 				"[%d] DEBUG: default mime type %s\n",
-				thread_id, conf.default_type);
+				thread_id, request_conf->default_type);
 
-			mime_type = conf.default_type;
+			mime_type = request_conf->default_type;
 
 		} else {
 
@@ -540,10 +528,10 @@ int handle_post(int thread_id, request_t *req, response_t *resp) {
 		/* Append charset when mime type is text */
 		if (strncmp(mime_type, "text", 4) == 0) {
 
-			charset = malloc(strlen("charset=") + strlen(conf.charset) + 1);
-			memset(charset, 0, strlen("charset=") + strlen(conf.charset) + 1);
+			charset = malloc(strlen("charset=") + strlen(request_conf->charset) + 1);
+			memset(charset, 0, strlen("charset=") + strlen(request_conf->charset) + 1);
 			strncat(charset, "charset=", strlen("charset="));
-			strncat(charset, conf.charset, strlen(conf.charset));
+			strncat(charset, request_conf->charset, strlen(request_conf->charset));
 
 			append_response_header(resp, "Content-Type", charset);
 
@@ -598,7 +586,7 @@ int handle_head(int thread_id, request_t *req, response_t *resp) {
 
 	string_length = 0;
 
-	if (resource_path(req->resource, &res_path) < 0) {
+	if (resource_path(req->resource.data, &res_path) < 0) {
 		handle_error("resource_path");
 	}
 
@@ -638,9 +626,9 @@ int handle_head(int thread_id, request_t *req, response_t *resp) {
 
 			debug(conf.output_level,
 				"[%d] DEBUG: default mime type %s\n",
-				thread_id, conf.default_type);
+				thread_id, request_conf->default_type);
 
-			mime_type = conf.default_type;
+			mime_type = request_conf->default_type;
 
 		} else {
 
@@ -655,10 +643,10 @@ int handle_head(int thread_id, request_t *req, response_t *resp) {
 		/* Append charset when mime type is text */
 		if (strncmp(mime_type, "text", 4) == 0) {
 
-			charset = malloc(strlen("charset=") + strlen(conf.charset) + 1);
-			memset(charset, 0, strlen("charset=") + strlen(conf.charset) + 1);
+			charset = malloc(strlen("charset=") + strlen(request_conf->charset) + 1);
+			memset(charset, 0, strlen("charset=") + strlen(request_conf->charset) + 1);
 			strncat(charset, "charset=", strlen("charset="));
-			strncat(charset, conf.charset, strlen(conf.charset));
+			strncat(charset, request_conf->charset, strlen(request_conf->charset));
 
 			append_response_header(resp, "Content-Type", charset);
 
@@ -683,6 +671,37 @@ int handle_head(int thread_id, request_t *req, response_t *resp) {
 
 }
 
+/*
+ * Generate the server statistics page
+ *
+ * @param thread_id: the thread id handling the request
+ * @param req: request_t data structure
+ * @param resp: response_t data structure
+ * @return: 0 on success, -1 on error
+ */
+int handle_status(int thread_id, request_t *req, response_t *resp) {
+
+	char *content_length;
+
+	content_length = NULL;
+
+	set_response_status(resp, 200, "OK");
+
+	resp->content_length = stats_format(&(resp->content));
+	resp->_mask |= _RESPONSE_CONTENT;
+
+	write_response_header(resp, "Content-Type", "text/plain");
+
+	integer_to_ascii(resp->content_length, &content_length);
+
+	write_response_header(resp, "Content-Length", content_length);
+
+	paranoid_free_string(content_length);
+
+	return 0;
+
+}
+
 void set_error_document(int thread_id, response_t *resp, int status_code) {
 
 	char *res_path;
@@ -704,31 +723,31 @@ void set_error_document(int thread_id, response_t *resp, int status_code) {
 	i = 0;
 	string_length = 0;
 
-	for (i = 0; i < conf.error_documents_count; i++) {
+	for (i = 0; i < request_vhost->error_documents_count; i++) {
 
-		if (conf.error_documents[i]->status_code == status_code) {
+		if (request_vhost->error_documents[i]->status_code == status_code) {
 
-			if (conf.error_documents[i]->file_path[0] == '/') {
+			if (request_vhost->error_documents[i]->file_path[0] == '/') {
 				/* Absolute path */
-				string_length = strlen(conf.error_documents[i]->file_path);
+				string_length = strlen(request_vhost->error_documents[i]->file_path);
 
 				res_path = malloc(string_length + 1);
 				memset(res_path, 0, string_length + 1);
 
-				snprintf(res_path, string_length + 1, " %s", conf.error_documents[i]->file_path);
+				snprintf(res_path, string_length + 1, "%s", request_vhost->error_documents[i]->file_path);
 
 			} else {
 				/* Path is relative to server root folder */
-				string_length = strlen(conf.server_root) 
+				string_length = strlen(request_conf->server_root) 
 					+ 1 
-					+ strlen(conf.error_documents[i]->file_path);
+					+ strlen(request_vhost->error_documents[i]->file_path);
 
 				res_path = malloc(string_length + 1);
 				memset(res_path, 0, string_length);
 
 				snprintf(res_path, string_length + 1, "%s/%s", 
-					conf.server_root, 
-					conf.error_documents[i]->file_path);	
+					request_conf->server_root, 
+					request_vhost->error_documents[i]->file_path);	
 			}
 
 			if (is_file(res_path)) {
@@ -748,9 +767,9 @@ void set_error_document(int thread_id, response_t *resp, int status_code) {
 
 					debug(conf.output_level,
 						"[%d] DEBUG: default mime type %s\n",
-						thread_id, conf.default_type);
+						thread_id, request_conf->default_type);
 
-					mime_type = conf.default_type;
+					mime_type = request_conf->default_type;
 
 				} else {
 
@@ -765,10 +784,10 @@ void set_error_document(int thread_id, response_t *resp, int status_code) {
 				/* Append charset when mime type is text */
 				if (strncmp(mime_type, "text", 4) == 0) {
 
-					charset = malloc(strlen("charset=") + strlen(conf.charset) + 1);
-					memset(charset, 0, strlen("charset=") + strlen(conf.charset) + 1);
+					charset = malloc(strlen("charset=") + strlen(request_conf->charset) + 1);
+					memset(charset, 0, strlen("charset=") + strlen(request_conf->charset) + 1);
 					strncat(charset, "charset=", strlen("charset="));
-					strncat(charset, conf.charset, strlen(conf.charset));
+					strncat(charset, request_conf->charset, strlen(request_conf->charset));
 
 					append_response_header(resp, "Content-Type", charset);
 
@@ -819,6 +838,9 @@ void free_response(response_t *resp) {
 	if (resp->_mask & _RESPONSE_FILE_PATH) paranoid_free_string(resp->file_path);
 	resp->_mask &= ~_RESPONSE_FILE_PATH;
 
+	if (resp->_mask & _RESPONSE_CONTENT) free(resp->content);
+	resp->_mask &= ~_RESPONSE_CONTENT;
+
 	if (resp->_mask & _RESPONSE_REASON) paranoid_free_string(resp->reason_phrase);
 	resp->_mask &= ~_RESPONSE_REASON;
 
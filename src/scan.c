@@ -0,0 +1,402 @@
+/*
+ * Request tokenizer. Finds the end of the header block and the extent of
+ * the request tokens, validating their characters on the way, 32 bytes at
+ * a time with AVX2, 16 with SSE, or one at a time elsewhere. The
+ * implementation is picked at run time for the CPU the server runs on.
+ *
+ * A character class is tested on a whole vector with two table lookups
+ * (PSHUFB): the low nibble of each byte selects the set of high nibbles
+ * allowed with it, the high nibble selects its bit in that set. This way
+ * any set of ASCII characters is tested at the same cost, the token
+ * characters included; bytes above 0x7f are either all in or all out.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* local header files */
+#include "scan.h"
+
+typedef struct scan_class {
+	uint8_t lut[16];					// high nibbles allowed for each low nibble (ASCII)
+	uint8_t high;						// bytes above 0x7f are in the class
+	uint8_t member[256];
+} scan_class_t;
+
+static scan_class_t classes[SCAN_CLASSES];
+
+static size_t span_scalar(const uint8_t *buffer, size_t length, const scan_class_t *class);
+static char *header_end_scalar(const char *buffer, size_t length);
+
+static size_t (*span)(const uint8_t *, size_t, const scan_class_t *) = span_scalar;
+static char *(*header_end)(const char *, size_t) = header_end_scalar;
+
+/*
+ * Tells whether a character belongs to a class
+ *
+ * @param class: SCAN_TOKEN, SCAN_TARGET or SCAN_VALUE
+ * @param c: the character
+ * @return: TRUE (1) when it does, 0 otherwise
+ */
+static int is_member(int class, int c) {
+
+	switch (class) {
+
+		case SCAN_TOKEN:
+			return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+				|| (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+
+		case SCAN_TARGET:
+			return (c > 0x20 && c < 0x7f) || c > 0x7f;
+
+		case SCAN_VALUE:
+			return (c >= 0x20 && c < 0x7f) || c == '\t' || c > 0x7f;
+
+	}
+
+	return 0;
+
+}
+
+/*
+ * Number of leading bytes in the class, one byte at a time
+ */
+static size_t span_scalar(const uint8_t *buffer, size_t length, const scan_class_t *class) {
+
+	size_t i;
+
+	for (i = 0; i < length && class->member[buffer[i]]; i++);
+
+	return i;
+
+}
+
+/*
+ * First CRLF CRLF, one byte at a time
+ */
+static char *header_end_scalar(const char *buffer, size_t length) {
+
+	size_t i;
+
+	for (i = 0; i + 4 <= length; i++) {
+
+		if (buffer[i] == '\r' && buffer[i + 1] == '\n'
+			&& buffer[i + 2] == '\r' && buffer[i + 3] == '\n') {
+			return (char *) buffer + i;
+		}
+
+	}
+
+	return NULL;
+
+}
+
+#ifdef SCAN_X86
+
+/*
+ * Number of leading bytes in the class, 16 bytes at a time
+ */
+__attribute__((target("sse4.2")))
+static size_t span_sse(const uint8_t *buffer, size_t length, const scan_class_t *class) {
+
+	size_t i;
+
+	uint32_t mask, high;
+
+	__m128i lut, bits, nibble, x, lo, hi, m;
+
+	lut = _mm_loadu_si128((const __m128i *) class->lut);
+	bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+	nibble = _mm_set1_epi8(0x0f);
+
+	high = class->high ? 0xffff : 0;
+
+	for (i = 0; i + 16 <= length; i += 16) {
+
+		x = _mm_loadu_si128((const __m128i *) (buffer + i));
+
+		lo = _mm_and_si128(x, nibble);
+		hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+
+		/* Zero for the bytes out of the class, and for every byte above 0x7f */
+		m = _mm_and_si128(_mm_shuffle_epi8(lut, lo), _mm_shuffle_epi8(bits, hi));
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128()))
+			& ~(_mm_movemask_epi8(x) & high);
+
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+
+	}
+
+	return i + span_scalar(buffer + i, length - i, class);
+
+}
+
+/*
+ * First CRLF CRLF, 16 bytes at a time
+ */
+__attribute__((target("sse4.2")))
+static char *header_end_sse(const char *buffer, size_t length) {
+
+	size_t i;
+
+	uint32_t mask;
+
+	__m128i cr, lf;
+
+	cr = _mm_set1_epi8('\r');
+	lf = _mm_set1_epi8('\n');
+
+	for (i = 0; i + 16 + 3 <= length; i += 16) {
+
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i)), cr),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i + 1)), lf)),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i + 2)), cr),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i + 3)), lf))));
+
+		if (mask != 0) {
+			return (char *) buffer + i + __builtin_ctz(mask);
+		}
+
+	}
+
+	return header_end_scalar(buffer + i, length - i);
+
+}
+
+/*
+ * Number of leading bytes in the class, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static size_t span_avx2(const uint8_t *buffer, size_t length, const scan_class_t *class) {
+
+	size_t i;
+
+	uint32_t mask, high;
+
+	__m256i lut, bits, nibble, x, lo, hi, m;
+
+	lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) class->lut));
+	bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+		1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+	nibble = _mm256_set1_epi8(0x0f);
+
+	high = class->high ? 0xffffffff : 0;
+
+	for (i = 0; i + 32 <= length; i += 32) {
+
+		x = _mm256_loadu_si256((const __m256i *) (buffer + i));
+
+		lo = _mm256_and_si256(x, nibble);
+		hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+
+		m = _mm256_and_si256(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(bits, hi));
+
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(m, _mm256_setzero_si256()))
+			& ~(_mm256_movemask_epi8(x) & high);
+
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+
+	}
+
+	/* The last bytes go 16 at a time, in the same (VEX) encoding */
+	if (i + 16 <= length) {
+
+		x = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (buffer + i)));
+
+		lo = _mm256_and_si256(x, nibble);
+		hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+
+		m = _mm256_and_si256(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(bits, hi));
+
+		mask = (_mm256_movemask_epi8(_mm256_cmpeq_epi8(m, _mm256_setzero_si256()))
+			& ~(_mm256_movemask_epi8(x) & high)) & 0xffff;
+
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+
+		i += 16;
+
+	}
+
+	return i + span_scalar(buffer + i, length - i, class);
+
+}
+
+/*
+ * First CRLF CRLF, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static char *header_end_avx2(const char *buffer, size_t length) {
+
+	size_t i;
+
+	uint32_t mask;
+
+	__m256i cr, lf;
+
+	cr = _mm256_set1_epi8('\r');
+	lf = _mm256_set1_epi8('\n');
+
+	for (i = 0; i + 32 + 3 <= length; i += 32) {
+
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_and_si256(
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i)), cr),
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i + 1)), lf)),
+			_mm256_and_si256(
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i + 2)), cr),
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i + 3)), lf))));
+
+		if (mask != 0) {
+			return (char *) buffer + i + __builtin_ctz(mask);
+		}
+
+	}
+
+	return header_end_scalar(buffer + i, length - i);
+
+}
+
+#endif
+
+/*
+ * Builds the character class tables and picks the scanner implementation.
+ * Must be called before any other thread is started.
+ *
+ * @param level: SCAN_AUTO for the fastest one the CPU supports, or a given
+ * one (SCAN_SCALAR, SCAN_SSE, SCAN_AVX2)
+ * @return: the implementation in use, -1 when the CPU does not support
+ * the given one (the previous one is kept)
+ */
+int scan_init(int level) {
+
+	int class, c, best;
+
+	for (class = 0; class < SCAN_CLASSES; class++) {
+
+		memset(&(classes[class]), 0, sizeof(scan_class_t));
+
+		for (c = 0; c < 256; c++) {
+
+			if ( ! is_member(class, c)) {
+				continue;
+			}
+
+			classes[class].member[c] = 1;
+
+			if (c < 0x80) {
+				classes[class].lut[c & 0x0f] |= 1 << (c >> 4);
+			}
+
+		}
+
+		classes[class].high = classes[class].member[0x80];
+
+	}
+
+	best = SCAN_SCALAR;
+
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		best = SCAN_AVX2;
+	} else if (__builtin_cpu_supports("sse4.2")) {
+		best = SCAN_SSE;
+	}
+#endif
+
+	if (level == SCAN_AUTO) {
+		level = best;
+	} else if (level < SCAN_SCALAR || level > best) {
+		return -1;
+	}
+
+	switch (level) {
+
+#ifdef SCAN_X86
+		case SCAN_AVX2:
+			span = span_avx2;
+			header_end = header_end_avx2;
+			break;
+
+		case SCAN_SSE:
+			span = span_sse;
+			header_end = header_end_sse;
+			break;
+#endif
+
+		default:
+			span = span_scalar;
+			header_end = header_end_scalar;
+			break;
+
+	}
+
+	return level;
+
+}
+
+/*
+ * Name of a scanner implementation
+ *
+ * @param level: SCAN_SCALAR, SCAN_SSE or SCAN_AVX2
+ * @return: its name
+ */
+const char *scan_name(int level) {
+
+	switch (level) {
+		case SCAN_AVX2: return "avx2";
+		case SCAN_SSE: return "sse4.2";
+	}
+
+	return "scalar";
+
+}
+
+/*
+ * Measures the token at the start of the buffer. A header block always
+ * ends with a CR, which is in no class, so the byte right after the token
+ * can be read as long as the buffer is a whole header block.
+ *
+ * @param buffer: where the token starts
+ * @param length: bytes available
+ * @param class: SCAN_TOKEN, SCAN_TARGET or SCAN_VALUE
+ * @return: number of leading bytes in the class
+ */
+size_t scan_span(const char *buffer, size_t length, int class) {
+
+	return span((const uint8_t *) buffer, length, &(classes[class]));
+
+}
+
+/*
+ * Looks for the end of the header block
+ *
+ * @param buffer: the received bytes
+ * @param length: number of received bytes
+ * @return: the empty line CRLF CRLF, NULL when it has not been received
+ */
+char *scan_header_end(const char *buffer, size_t length) {
+
+	return header_end(buffer, length);
+
+}
\ No newline at end of file
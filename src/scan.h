@@ -0,0 +1,25 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __SCAN_H
+#define __SCAN_H
+
+/* scanner implementations */
+#define SCAN_AUTO			-1			// the fastest one the CPU supports
+#define SCAN_SCALAR			0			// one byte at a time, table lookup
+#define SCAN_SSE			1			// 16 bytes at a time (SSE4.2 CPUs)
+#define SCAN_AVX2			2			// 32 bytes at a time
+
+/* character classes */
+#define SCAN_TOKEN			0			// method and header field name (tchar)
+#define SCAN_TARGET			1			// request target and version (visible characters)
+#define SCAN_VALUE			2			// header field value (visible characters, space, tab)
+#define SCAN_CLASSES		3
+
+int scan_init(int level);
+const char *scan_name(int level);
+size_t scan_span(const char *buffer, size_t length, int class);
+char *scan_header_end(const char *buffer, size_t length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,704 @@
+/*
+ * Work-stealing scheduler of the threads server mode. The unit of work is
+ * one request of a connection: new connections are spread over the worker
+ * deques by the acceptor, and a connection whose next request is already
+ * readable goes back to the deque of the worker that served it. Idle
+ * workers steal from the tail of the other deques, so a worker busy with a
+ * long keep alive session does not hold back the connections queued behind
+ * it. A parked connection coming back when every deque is full waits in
+ * the overflow list with its state; only new connections fall back to the
+ * shared queue of sockets.
+ *
+ * The pool is adaptive: a monitor thread adds workers while connections
+ * are waiting and none of the workers is idle (all of them serving or
+ * blocked on disk), and retires the last worker after ThreadPoolIdle
+ * seconds with idle workers. Workers are added and retired in LIFO order so
+ * the active ones are always 0 .. num_workers - 1.
+ *
+ * Short responses go first: a response larger than BulkSize is sent in
+ * time slices of SCHED_SLICE milliseconds, and between two slices the
+ * connection waits in the bulk queue, which workers only look at when
+ * there is nothing else to run. A large download thus holds a worker for
+ * one slice at a time instead of for the whole transfer. The bulk queue is
+ * served first once its oldest transfer has waited SCHED_BULK_WAIT
+ * milliseconds, so that a steady flow of small requests can not starve it.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "queue.h"
+#include "sched.h"
+#include "admission.h"
+#include "stats.h"
+#include "util.h"
+
+extern config_t conf;
+extern queue_t conn_queue;
+
+static worker_t *workers;
+static uint32_t num_workers;
+
+/* workers at or above it retire, lowered by the monitor */
+static uint32_t pool_target;
+
+static void *(*worker_run)(void *);
+
+/* round robin position of the acceptor and the parking area */
+static uint32_t next_worker;
+
+/* futex word bumped to wake up idle workers */
+static uint32_t work;
+static uint32_t sleepers;
+
+/* bulk transfers waiting for their next time slice */
+static sched_list_t bulk = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* resumed connections that found every deque full */
+static sched_list_t overflow = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static int deque_push(deque_t *deque, conn_t *conn) {
+
+	pthread_mutex_lock(&(deque->mutex));
+
+	if ( ! deque->active || deque->count == SCHED_DEQUE_SIZE) {
+		pthread_mutex_unlock(&(deque->mutex));
+		return ERROR;
+	}
+
+	deque->tasks[(deque->head + deque->count) % SCHED_DEQUE_SIZE] = conn;
+	__atomic_store_n(&(deque->count), deque->count + 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&(deque->mutex));
+
+	return 0;
+
+}
+
+static conn_t *deque_pop_head(deque_t *deque) {
+
+	conn_t *conn;
+
+	if (__atomic_load_n(&(deque->count), __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	conn = NULL;
+
+	pthread_mutex_lock(&(deque->mutex));
+
+	if (deque->count > 0) {
+
+		conn = deque->tasks[deque->head];
+
+		deque->head = (deque->head + 1) % SCHED_DEQUE_SIZE;
+		__atomic_store_n(&(deque->count), deque->count - 1, __ATOMIC_RELAXED);
+
+	}
+
+	pthread_mutex_unlock(&(deque->mutex));
+
+	return conn;
+
+}
+
+static conn_t *deque_pop_tail(deque_t *deque) {
+
+	conn_t *conn;
+
+	if (__atomic_load_n(&(deque->count), __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	conn = NULL;
+
+	pthread_mutex_lock(&(deque->mutex));
+
+	if (deque->count > 0) {
+
+		conn = deque->tasks[(deque->head + deque->count - 1) % SCHED_DEQUE_SIZE];
+
+		__atomic_store_n(&(deque->count), deque->count - 1, __ATOMIC_RELAXED);
+
+	}
+
+	pthread_mutex_unlock(&(deque->mutex));
+
+	return conn;
+
+}
+
+/*
+ * Appends a connection to a list
+ *
+ * @param list: the list
+ * @param conn: the connection, in no other list
+ */
+static void list_push(sched_list_t *list, conn_t *conn) {
+
+	conn->next = NULL;
+
+	pthread_mutex_lock(&(list->mutex));
+
+	if (list->tail != NULL) {
+		list->tail->next = conn;
+	} else {
+		list->head = conn;
+	}
+
+	list->tail = conn;
+
+	__atomic_store_n(&(list->count), list->count + 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&(list->mutex));
+
+}
+
+/*
+ * Takes the oldest connection of a list, if it was queued before a given
+ * time
+ *
+ * @param list: the list
+ * @param before: latest queueing time accepted (ns, 0 = any)
+ * @return: the connection, or NULL
+ */
+static conn_t *list_pop(sched_list_t *list, uint64_t before) {
+
+	conn_t *conn;
+
+	if (__atomic_load_n(&(list->count), __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	conn = NULL;
+
+	pthread_mutex_lock(&(list->mutex));
+
+	if (list->head != NULL && (before == 0 || list->head->queued_at <= before)) {
+
+		conn = list->head;
+
+		if ((list->head = conn->next) == NULL) {
+			list->tail = NULL;
+		}
+
+		conn->next = NULL;
+
+		__atomic_store_n(&(list->count), list->count - 1, __ATOMIC_RELAXED);
+
+	}
+
+	pthread_mutex_unlock(&(list->mutex));
+
+	return conn;
+
+}
+
+/*
+ * Wakes up one idle worker, if any
+ */
+static void sched_wake(void) {
+
+	/* Pairs with the fence in sched_next() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&sleepers, __ATOMIC_RELAXED) > 0) {
+
+		__atomic_add_fetch(&work, 1, __ATOMIC_RELEASE);
+		futex_wake(&work, 1);
+
+	}
+
+}
+
+/*
+ * Counts the runnable connections waiting for a worker, bulk transfers
+ * between two time slices aside
+ */
+uint32_t sched_waiting(void) {
+
+	int i;
+
+	uint32_t waiting;
+
+	waiting = queue_depth(&conn_queue) + __atomic_load_n(&(overflow.count), __ATOMIC_RELAXED);
+
+	/* Retired deques are empty, no need to look at num_workers */
+	for (i = 0; i < conf.thread_pool_max; i++) {
+		waiting += __atomic_load_n(&(workers[i].deque.count), __ATOMIC_RELAXED);
+	}
+
+	return waiting;
+
+}
+
+/*
+ * Records how long the connection waited to be picked up
+ */
+static conn_t *sched_picked(conn_t *conn) {
+
+	uint64_t waited;
+
+	waited = get_time_ns() - conn->queued_at;
+
+	stats_add(&(stats.tasks_run), 1);
+	stats_add(&(stats.task_wait_total), waited);
+	stats_max(&(stats.task_wait_max), waited);
+
+	admission_picked(waited);
+
+	return conn;
+
+}
+
+/*
+ * Starts one more worker. Only called by the monitor (and before it runs).
+ */
+static void sched_add_worker(void) {
+
+	uint32_t id;
+
+	pthread_attr_t attr;
+
+	id = num_workers;
+
+	pthread_mutex_lock(&(workers[id].deque.mutex));
+	workers[id].deque.active = TRUE;
+	pthread_mutex_unlock(&(workers[id].deque.mutex));
+
+	__atomic_store_n(&pool_target, id + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&num_workers, id + 1, __ATOMIC_RELEASE);
+
+	stats_add(&(stats.pool_size), 1);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&(workers[id].thread), &attr, worker_run, &(workers[id].id)) != 0) {
+		handle_error("pthread_create");
+	}
+
+	pthread_attr_destroy(&attr);
+
+}
+
+/*
+ * Retires the calling worker once its own deque is empty
+ *
+ * @param worker_id: the worker
+ * @return: TRUE when the worker must exit
+ */
+static int sched_retire(int worker_id) {
+
+	deque_t *deque;
+
+	deque = &(workers[worker_id].deque);
+
+	pthread_mutex_lock(&(deque->mutex));
+
+	if (deque->count > 0) {
+		/* Serve what is queued first, nothing new gets in afterwards */
+		pthread_mutex_unlock(&(deque->mutex));
+		return FALSE;
+	}
+
+	deque->active = FALSE;
+
+	pthread_mutex_unlock(&(deque->mutex));
+
+	__atomic_store_n(&num_workers, worker_id, __ATOMIC_RELEASE);
+
+	stats_add(&(stats.pool_size), -1);
+	stats_add(&(stats.pool_shrunk), 1);
+
+	debug(conf.output_level, "[%d] DEBUG: idle thread retired\n", worker_id);
+
+	return TRUE;
+
+}
+
+/*
+ * Resizes the pool: grows it while connections wait and every worker is
+ * busy, shrinks it by one worker per ThreadPoolIdle seconds with idle
+ * workers.
+ */
+static void *sched_monitor(void *arg) {
+
+	uint32_t i, n, target, waiting, grow;
+
+	time_t now, idle_since;
+
+	idle_since = 0;
+
+	while (1) {
+
+		usleep(SCHED_INTERVAL * 1000);
+
+		now = time(NULL);
+
+		n = __atomic_load_n(&num_workers, __ATOMIC_ACQUIRE);
+		target = __atomic_load_n(&pool_target, __ATOMIC_ACQUIRE);
+
+		waiting = sched_waiting();
+
+		if (waiting > 0 && __atomic_load_n(&sleepers, __ATOMIC_RELAXED) == 0) {
+
+			idle_since = 0;
+
+			if (target < n) {
+				/* Work is piling up, keep the worker about to retire */
+				__atomic_store_n(&pool_target, n, __ATOMIC_RELEASE);
+				continue;
+			}
+
+			grow = conf.thread_pool_max - n;
+
+			if (grow > waiting) grow = waiting;
+			if (grow > SCHED_GROW_STEP) grow = SCHED_GROW_STEP;
+
+			for (i = 0; i < grow; i++) {
+				sched_add_worker();
+			}
+
+			if (grow > 0) {
+
+				stats_add(&(stats.pool_grown), grow);
+
+				debug(conf.output_level,
+					"DEBUG: %d connections waiting, pool grown to %d threads\n",
+					waiting, n + grow);
+
+			}
+
+		} else if (waiting == 0 && __atomic_load_n(&sleepers, __ATOMIC_RELAXED) > 0) {
+
+			if (idle_since == 0) {
+
+				idle_since = now;
+
+			} else if (now - idle_since >= conf.thread_pool_idle
+				&& n > conf.thread_pool_min && target == n) {
+
+				__atomic_store_n(&pool_target, n - 1, __ATOMIC_RELEASE);
+
+				/* Let the last worker notice it has to go */
+				__atomic_add_fetch(&work, 1, __ATOMIC_RELEASE);
+				futex_wake(&work, INT_MAX);
+
+				idle_since = now;
+
+			}
+
+		} else {
+
+			idle_since = 0;
+
+		}
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Creates the worker deques, starts ThreadPoolSize workers and the pool
+ * monitor
+ *
+ * @param run: the worker thread function, it gets a pointer to the worker
+ * id and returns when sched_next() returns NULL
+ */
+void sched_init(void *(*run)(void *)) {
+
+	int i;
+
+	pthread_t monitor;
+
+	worker_run = run;
+
+	workers = malloc(conf.thread_pool_max * sizeof(worker_t));
+	memset(workers, 0, conf.thread_pool_max * sizeof(worker_t));
+
+	for (i = 0; i < conf.thread_pool_max; i++) {
+
+		workers[i].id = i;
+
+		pthread_mutex_init(&(workers[i].deque.mutex), NULL);
+
+	}
+
+	for (i = 0; i < conf.thread_pool_size; i++) {
+		sched_add_worker();
+	}
+
+	if (conf.thread_pool_max > conf.thread_pool_min) {
+
+		if (pthread_create(&monitor, NULL, sched_monitor, NULL) != 0) {
+			handle_error("pthread_create");
+		}
+
+		pthread_detach(monitor);
+
+	}
+
+}
+
+/*
+ * Queues a connection on the next worker deque with room left
+ *
+ * @param conn: the connection state
+ * @return: 0 on success, -1 when every deque is full
+ */
+static int sched_deque(conn_t *conn) {
+
+	int i, n;
+
+	conn->queued_at = get_time_ns();
+
+	n = __atomic_load_n(&num_workers, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i++) {
+
+		if (deque_push(&(workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % n].deque), conn) == 0) {
+
+			stats_add(&(stats.tasks_queued), 1);
+
+			sched_wake();
+
+			return 0;
+
+		}
+
+	}
+
+	return ERROR;
+
+}
+
+/*
+ * Hands a parked connection whose next request (or room to send) has
+ * arrived over to the workers. Its state is kept whatever the load: when
+ * every deque is full it waits in the overflow list.
+ *
+ * @param conn: the connection state
+ */
+void sched_submit(conn_t *conn) {
+
+	if (sched_deque(conn) == 0) {
+		return;
+	}
+
+	list_push(&overflow, conn);
+
+	stats_add(&(stats.tasks_queued), 1);
+
+	sched_wake();
+
+}
+
+/*
+ * Hands a new connection over to the workers. When every deque is full
+ * only the socket waits in the queue, the worker starts the connection
+ * state. With admission control the acceptor does not wait for room in
+ * the queue, it sheds the connection instead.
+ *
+ * @param sockfd: the accepted socket
+ * @return: 0 on success, -1 when the queue is full (admission control)
+ */
+int sched_accept(int sockfd) {
+
+	conn_t *conn;
+
+	conn = conn_new(sockfd);
+
+	if (sched_deque(conn) == 0) {
+		return 0;
+	}
+
+	/* Nothing has been received nor armed yet */
+	conn_detach(conn);
+
+	if (conf.admission_budget == 0) {
+		queue_push_wait(&conn_queue, sockfd);
+	} else if (queue_push(&conn_queue, sockfd) < 0) {
+		stats_add(&(stats.queue_full), 1);
+		return ERROR;
+	}
+
+	sched_wake();
+
+	return 0;
+
+}
+
+/*
+ * Queues a connection whose next request is ready on the deque of the
+ * worker that served the previous one.
+ *
+ * @param worker_id: the worker
+ * @param conn: the connection
+ * @return: 0 on success, -1 when the deque is full and the caller has to
+ * serve the connection itself
+ */
+int sched_push(int worker_id, conn_t *conn) {
+
+	deque_t *deque;
+
+	deque = &(workers[worker_id].deque);
+
+	conn->queued_at = get_time_ns();
+
+	if (deque_push(deque, conn) < 0) {
+		return ERROR;
+	}
+
+	stats_add(&(stats.tasks_queued), 1);
+
+	/* The owner runs it next unless it has a backlog others can help with */
+	if (__atomic_load_n(&(deque->count), __ATOMIC_RELAXED) > 1) {
+		sched_wake();
+	}
+
+	return 0;
+
+}
+
+/*
+ * Tells whether a bulk transfer has to give its worker up at the end of a
+ * time slice: another connection, or another bulk transfer, is runnable.
+ */
+int sched_preempt(void) {
+
+	return sched_waiting() > 0 || __atomic_load_n(&(bulk.count), __ATOMIC_RELAXED) > 0;
+
+}
+
+/*
+ * Queues a bulk transfer whose time slice is over. Any worker resumes it
+ * once no other connection is runnable.
+ *
+ * @param conn: the connection, its state is CONN_WRITING
+ */
+void sched_bulk(conn_t *conn) {
+
+	conn->queued_at = get_time_ns();
+
+	list_push(&bulk, conn);
+
+	stats_add(&(stats.bulk_slices), 1);
+
+	sched_wake();
+
+}
+
+/*
+ * Gets the next runnable connection for a worker: from its own deque, then
+ * from the overflow list and the shared queue, then stolen from another
+ * worker, and the bulk
+ * transfers last (unless one of them has waited too long). Sleeps when
+ * there is nothing to do, after spinning for BusyPoll microseconds.
+ *
+ * @param worker_id: the worker
+ * @return: the connection, or NULL when the worker has been retired
+ */
+conn_t *sched_next(int worker_id) {
+
+	int i, n, sockfd;
+
+	uint32_t seq;
+	uint64_t spin_until, waited;
+
+	conn_t *conn;
+
+	spin_until = 0;
+
+	while (1) {
+
+		if (worker_id >= __atomic_load_n(&pool_target, __ATOMIC_ACQUIRE) && sched_retire(worker_id)) {
+			return NULL;
+		}
+
+		/* Bulk transfers wait behind short requests, but not forever */
+		if ((conn = list_pop(&bulk, get_time_ns() - SCHED_BULK_WAIT * 1000000ULL)) != NULL) {
+			return conn;
+		}
+
+		if ((conn = deque_pop_head(&(workers[worker_id].deque))) != NULL) {
+			return sched_picked(conn);
+		}
+
+		/* Connections that were already being served go before new ones */
+		if ((conn = list_pop(&overflow, 0)) != NULL) {
+			return sched_picked(conn);
+		}
+
+		if (queue_pop(&conn_queue, &sockfd, &waited) == 0) {
+			admission_picked(waited);
+			return conn_new(sockfd);
+		}
+
+		n = __atomic_load_n(&num_workers, __ATOMIC_ACQUIRE);
+
+		for (i = 1; i < n; i++) {
+
+			if ((conn = deque_pop_tail(&(workers[(worker_id + i) % n].deque))) != NULL) {
+
+				stats_add(&(stats.tasks_stolen), 1);
+
+				return sched_picked(conn);
+
+			}
+
+		}
+
+		if ((conn = list_pop(&bulk, 0)) != NULL) {
+			return conn;
+		}
+
+		if (conf.busy_poll > 0) {
+
+			if (spin_until == 0) {
+				spin_until = get_time_ns() + conf.busy_poll * 1000ULL;
+			}
+
+			if (get_time_ns() < spin_until) {
+				cpu_relax();
+				continue;
+			}
+
+		}
+
+		seq = __atomic_load_n(&work, __ATOMIC_ACQUIRE);
+
+		__atomic_add_fetch(&sleepers, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		/* Work may have been queued (or the worker retired) before we
+		 * registered as a sleeper */
+		if (sched_waiting() == 0 && __atomic_load_n(&(bulk.count), __ATOMIC_RELAXED) == 0
+			&& worker_id < __atomic_load_n(&pool_target, __ATOMIC_ACQUIRE)) {
+			futex_wait(&work, seq);
+		}
+
+		__atomic_sub_fetch(&sleepers, 1, __ATOMIC_RELAXED);
+
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __SCHED_H
+#define __SCHED_H
+
+#define SCHED_DEQUE_SIZE	64			// runnable connections per worker
+#define SCHED_INTERVAL		100			// pool monitor period (ms)
+#define SCHED_GROW_STEP		4			// maximum workers added per period
+#define SCHED_SLICE			2			// time slice of a bulk transfer (ms)
+#define SCHED_BULK_WAIT		100			// a bulk transfer waiting longer than this goes first (ms)
+
+/*
+ * Runnable connections of a worker. The owner takes them from the head,
+ * idle workers steal them from the tail.
+ */
+typedef struct deque {
+	uint8_t active;
+	uint32_t head;
+	uint32_t count;
+	conn_t *tasks[SCHED_DEQUE_SIZE];
+	pthread_mutex_t mutex;
+} deque_t;
+
+/* connections waiting in FIFO order, linked through their next field */
+typedef struct sched_list {
+	conn_t *head;
+	conn_t *tail;
+	uint32_t count;
+	pthread_mutex_t mutex;
+} sched_list_t;
+
+typedef struct worker {
+	int id;
+	deque_t deque;
+	pthread_t thread;
+} worker_t;
+
+void sched_init(void *(*run)(void *));
+void sched_submit(conn_t *conn);
+int sched_accept(int sockfd);
+int sched_push(int worker_id, conn_t *conn);
+void sched_bulk(conn_t *conn);
+int sched_preempt(void);
+conn_t *sched_next(int worker_id);
+uint32_t sched_waiting(void);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,441 @@
+/*
+ * Server statistics. Counters are updated with atomic operations from any
+ * thread and reported by the status location (see StatusLocation).
+ *
+ * A thread may own a private copy of the counters instead (see
+ * stats_local_init()): its updates go there without any locked instruction
+ * and the copies are only added up when the statistics are read.
+ *
+ * With worker processes (see Workers) every copy lives in a segment shared
+ * by all of them: one per process plus one per thread that asks for its
+ * own. Any process, the master included, reads the totals from there.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "stats.h"
+#include "util.h"
+
+extern config_t conf;
+
+stats_t stats;
+
+static __thread stats_t *stats_local;
+
+static stats_t *stats_process;
+static stats_t *stats_segment;
+static int stats_segment_count;
+static int stats_segment_threads;
+static int stats_process_threads;
+
+static stats_t **stats_locals;
+static int stats_locals_count;
+static pthread_mutex_t mutex_locals = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Creates the segment holding the counters of the worker processes. Must be
+ * called before forking them.
+ *
+ * @param processes: number of worker processes
+ * @param threads: copies each process may give to its threads
+ */
+void stats_shared_init(int processes, int threads) {
+
+	size_t size;
+
+	stats_segment_threads = threads;
+	stats_segment_count = processes * (threads + 1);
+
+	size = stats_segment_count * sizeof(stats_t);
+
+	stats_segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (stats_segment == MAP_FAILED) {
+		handle_error("mmap");
+	}
+
+}
+
+/*
+ * Makes the updates of the calling worker process go to its own place in
+ * the shared segment. The gauges left there by a previous instance of the
+ * worker are cleared, the totals are kept.
+ *
+ * @param process: the worker process number (0 ... processes - 1)
+ */
+void stats_process_init(int process) {
+
+	int i;
+
+	stats_process = &stats_segment[process * (stats_segment_threads + 1)];
+
+	for (i = 0; i <= stats_segment_threads; i++) {
+		__atomic_store_n(&(stats_process[i].parked), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(stats_process[i].pool_size), 0, __ATOMIC_RELAXED);
+	}
+
+}
+
+/*
+ * Gives the calling thread its own copy of the counters, allocated from the
+ * memory of a NUMA node (or taken from the shared segment). Every later
+ * update made by the thread goes there.
+ *
+ * @param node: the NUMA node, or -1
+ */
+void stats_local_init(int node) {
+
+	int slot;
+
+	stats_t *local;
+
+	if (stats_process != NULL) {
+
+		slot = __atomic_fetch_add(&stats_process_threads, 1, __ATOMIC_RELAXED);
+
+		/* Without room left the thread shares the copy of its process */
+		if (slot < stats_segment_threads) {
+			stats_local = &stats_process[slot + 1];
+		}
+
+		return;
+
+	}
+
+	local = node_alloc(sizeof(stats_t), node);
+
+	pthread_mutex_lock(&mutex_locals);
+
+	if ((stats_locals = realloc(stats_locals, (stats_locals_count + 1) * sizeof(stats_t *))) == NULL) {
+		handle_error("realloc");
+	}
+
+	stats_locals[stats_locals_count++] = local;
+
+	pthread_mutex_unlock(&mutex_locals);
+
+	stats_local = local;
+
+}
+
+/*
+ * Finds the place of a counter in a copy of the statistics
+ *
+ * @param copy: the copy, may be NULL
+ * @param counter: the counter in the shared statistics
+ * @return: the counter of the copy, or NULL when there is no copy
+ */
+static uint64_t *stats_copy_counter(stats_t *copy, uint64_t *counter) {
+
+	if (copy == NULL
+		|| counter < (uint64_t *) &stats
+		|| counter >= (uint64_t *) (&stats + 1)) {
+		return NULL;
+	}
+
+	return (uint64_t *) copy + (counter - (uint64_t *) &stats);
+
+}
+
+/*
+ * Adds a value to a counter
+ *
+ * @param counter: the counter
+ * @param value: amount to add
+ */
+void stats_add(uint64_t *counter, uint64_t value) {
+
+	uint64_t *copy;
+
+	if ((copy = stats_copy_counter(stats_local, counter)) != NULL) {
+		/* Single writer, readers only need a whole value */
+		__atomic_store_n(copy, *copy + value, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if ((copy = stats_copy_counter(stats_process, counter)) != NULL) {
+		counter = copy;
+	}
+
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+
+}
+
+/*
+ * Keeps the maximum value seen by a counter
+ *
+ * @param counter: the counter
+ * @param value: the new sample
+ */
+void stats_max(uint64_t *counter, uint64_t value) {
+
+	uint64_t current, *copy;
+
+	if ((copy = stats_copy_counter(stats_local, counter)) != NULL) {
+
+		if (value > *copy) {
+			__atomic_store_n(copy, value, __ATOMIC_RELAXED);
+		}
+
+		return;
+
+	}
+
+	if ((copy = stats_copy_counter(stats_process, counter)) != NULL) {
+		counter = copy;
+	}
+
+	current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	while (value > current) {
+
+		if (__atomic_compare_exchange_n(counter, &current, value,
+			TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+
+	}
+
+}
+
+/*
+ * Counts a sample in a log-linear histogram: values below 8 have a bucket
+ * of their own, larger ones share one of the 8 buckets that split each
+ * power of two (12.5% resolution).
+ *
+ * @param hist: the histogram (STATS_HIST_BUCKETS counters)
+ * @param value: the sample
+ */
+void stats_hist_add(uint64_t *hist, uint64_t value) {
+
+	int msb, bucket;
+
+	if (value < 8) {
+
+		bucket = value;
+
+	} else {
+
+		msb = 63 - __builtin_clzll(value);
+		bucket = (msb - 2) * 8 + ((value >> (msb - 3)) & 7);
+
+		if (bucket >= STATS_HIST_BUCKETS) {
+			bucket = STATS_HIST_BUCKETS - 1;
+		}
+
+	}
+
+	stats_add(&hist[bucket], 1);
+
+}
+
+/*
+ * Gets a percentile of a histogram
+ *
+ * @param hist: the histogram
+ * @param permille: the percentile, in thousandths (e.g. 990 for p99)
+ * @return: the highest value of the bucket holding the percentile
+ */
+static uint64_t stats_hist_percentile(uint64_t *hist, int permille) {
+
+	int i, msb;
+
+	uint64_t count, rank, seen;
+
+	count = 0;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		count += hist[i];
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+	rank = (count * permille + 999) / 1000;
+	seen = 0;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+
+		seen += hist[i];
+
+		if (seen >= rank) break;
+
+	}
+
+	if (i < 8) {
+		return i;
+	}
+
+	msb = i / 8 + 2;
+
+	return ((uint64_t) (8 + i % 8 + 1) << (msb - 3)) - 1;
+
+}
+
+/*
+ * Adds a copy of the statistics to a total. Maximums are merged as
+ * maximums.
+ *
+ * @param total: the total
+ * @param copy: the copy
+ */
+static void stats_merge(stats_t *total, stats_t *copy) {
+
+	int i, n;
+
+	uint64_t value, *sum, *counters;
+
+	n = sizeof(stats_t) / sizeof(uint64_t);
+
+	sum = (uint64_t *) total;
+	counters = (uint64_t *) copy;
+
+	for (i = 0; i < n; i++) {
+
+		value = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+
+		if (i == offsetof(stats_t, queue_wait_max) / sizeof(uint64_t)
+			|| i == offsetof(stats_t, task_wait_max) / sizeof(uint64_t)) {
+			if (value > sum[i]) sum[i] = value;
+		} else {
+			sum[i] += value;
+		}
+
+	}
+
+}
+
+/*
+ * Adds up the shared counters and every copy
+ *
+ * @param total: address where the statistics will be stored
+ */
+static void stats_snapshot(stats_t *total) {
+
+	int i;
+
+	memset(total, 0, sizeof(stats_t));
+
+	stats_merge(total, &stats);
+
+	if (stats_segment != NULL) {
+
+		for (i = 0; i < stats_segment_count; i++) {
+			stats_merge(total, &stats_segment[i]);
+		}
+
+		return;
+
+	}
+
+	pthread_mutex_lock(&mutex_locals);
+
+	for (i = 0; i < stats_locals_count; i++) {
+		stats_merge(total, stats_locals[i]);
+	}
+
+	pthread_mutex_unlock(&mutex_locals);
+
+}
+
+/*
+ * Writes the statistics as "Name: value" lines
+ *
+ * @param buffer: address where the text will be stored
+ * @return: the length of the text
+ *
+ * WARNING: this function allocates memory. Remember to free it when not
+ * in use.
+ */
+int stats_format(char **buffer) {
+
+	int length;
+
+	uint64_t enqueued, dequeued, wait_total, tasks_run, task_wait_total;
+
+	stats_t total;
+
+	stats_snapshot(&total);
+
+	enqueued = total.queue_enqueued;
+	dequeued = total.queue_dequeued;
+	wait_total = total.queue_wait_total;
+	tasks_run = total.tasks_run;
+	task_wait_total = total.task_wait_total;
+
+	if ((*buffer = malloc(STATS_MAX_SIZE)) == NULL) {
+		handle_error("malloc");
+	}
+
+	length = snprintf(*buffer, STATS_MAX_SIZE,
+		"Accepted: %lu\n"
+		"Requests: %lu\n"
+		"BytesSent: %lu\n"
+		"QueueCapacity: %u\n"
+		"QueueDepth: %lu\n"
+		"QueueEnqueued: %lu\n"
+		"QueueDequeued: %lu\n"
+		"QueueFull: %lu\n"
+		"QueueWaitAvgUs: %lu\n"
+		"QueueWaitMaxUs: %lu\n"
+		"TasksQueued: %lu\n"
+		"TasksRun: %lu\n"
+		"TasksStolen: %lu\n"
+		"TaskWaitAvgUs: %lu\n"
+		"TaskWaitMaxUs: %lu\n"
+		"Parked: %lu\n"
+		"ParkResumed: %lu\n"
+		"BulkSlices: %lu\n"
+		"TimedOut: %lu\n"
+		"PoolSize: %lu\n"
+		"PoolGrown: %lu\n"
+		"PoolShrunk: %lu\n"
+		"Shed: %lu\n"
+		"WaitP50Us: %lu\n"
+		"WaitP90Us: %lu\n"
+		"WaitP99Us: %lu\n"
+		"WaitP999Us: %lu\n",
+		total.accepted,
+		total.requests,
+		total.bytes_sent,
+		conf.queue_capacity,
+		enqueued > dequeued ? enqueued - dequeued : 0,
+		enqueued,
+		dequeued,
+		total.queue_full,
+		dequeued > 0 ? wait_total / dequeued / 1000 : 0,
+		total.queue_wait_max / 1000,
+		total.tasks_queued,
+		tasks_run,
+		total.tasks_stolen,
+		tasks_run > 0 ? task_wait_total / tasks_run / 1000 : 0,
+		total.task_wait_max / 1000,
+		total.parked,
+		total.park_resumed,
+		total.bulk_slices,
+		total.timed_out,
+		total.pool_size,
+		total.pool_grown,
+		total.pool_shrunk,
+		total.shed,
+		stats_hist_percentile(total.wait_hist, 500),
+		stats_hist_percentile(total.wait_hist, 900),
+		stats_hist_percentile(total.wait_hist, 990),
+		stats_hist_percentile(total.wait_hist, 999));
+
+	return length;
+
+}
\ No newline at end of file
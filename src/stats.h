@@ -0,0 +1,46 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __STATS_H
+#define __STATS_H
+
+#define STATS_MAX_SIZE		4096
+#define STATS_HIST_BUCKETS	256			// 8 buckets per power of two, up to ~4 hours (us)
+
+typedef struct stats {
+	uint64_t accepted;
+	uint64_t requests;
+	uint64_t bytes_sent;
+	uint64_t queue_enqueued;
+	uint64_t queue_dequeued;
+	uint64_t queue_full;
+	uint64_t queue_wait_total;			// ns
+	uint64_t queue_wait_max;			// ns
+	uint64_t tasks_queued;
+	uint64_t tasks_run;
+	uint64_t tasks_stolen;
+	uint64_t task_wait_total;			// ns
+	uint64_t task_wait_max;				// ns
+	uint64_t parked;					// connections in the parking area right now
+	uint64_t park_resumed;
+	uint64_t bulk_slices;				// bulk transfers preempted at the end of a time slice
+	uint64_t timed_out;					// connections closed by a deadline
+	uint64_t pool_size;					// workers right now
+	uint64_t pool_grown;
+	uint64_t pool_shrunk;
+	uint64_t shed;						// connections answered 503 by admission control
+	uint64_t wait_hist[STATS_HIST_BUCKETS];	// time until a worker picks a connection (us)
+} __attribute__((aligned(64))) stats_t;	// copies never share a cache line
+
+extern stats_t stats;
+
+void stats_shared_init(int processes, int threads);
+void stats_process_init(int process);
+void stats_local_init(int node);
+void stats_add(uint64_t *counter, uint64_t value);
+void stats_max(uint64_t *counter, uint64_t value);
+void stats_hist_add(uint64_t *hist, uint64_t value);
+int stats_format(char **buffer);
+
+#endif
\ No newline at end of file
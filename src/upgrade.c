@@ -0,0 +1,449 @@
+/*
+ * Binary upgrade without downtime. On SIGUSR2 the server starts the binary
+ * found at the path it was started from (the new build), with the same
+ * arguments, and hands its listening sockets over through a Unix socket
+ * (SCM_RIGHTS). The new process serves from the very same sockets, so no
+ * connection is refused and the kernel backlog is kept. Once it reports
+ * that it is running, the old process stops accepting, answers the
+ * requests of its open connections with "Connection: close" (idle ones go
+ * at their keep alive deadline), and exits when none is left (or after
+ * UPGRADE_DRAIN seconds).
+ *
+ * With Workers the master hands the listeners over and the worker
+ * processes drain. The file contents stay in the page cache, so the new
+ * process starts with a warm disk cache. The open file caches are not
+ * handed over: they belong to the threads of the old process (see
+ * cache.c) and nothing may touch them from another one. Each thread of
+ * the new process opens a file on the first request for it, one open()
+ * and fstat() that a cache hit saves, up to CACHE_SLOTS files per thread.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "upgrade.h"
+#include "util.h"
+
+extern config_t conf;
+extern char **environ;
+
+static char **upgrade_argv;
+static char *upgrade_path;
+
+/* listeners handed over to the new process */
+static int *upgrade_fds;
+static int upgrade_count;
+
+/* channel to the old process, in the new one */
+static int upgrade_channel = -1;
+
+static int draining = FALSE;
+
+/*
+ * Takes the listeners over from the old process when the server has been
+ * started by an upgrade. They must match the configured listen mode, and
+ * the Unix listener comes last.
+ *
+ * @param server_sockfd: where the shared listening socket is stored
+ * @param listen_sockfds: where the reuseport listening sockets are stored
+ * @param unix_sockfd: where the Unix listening socket is stored
+ * @return: 0 when the listeners have been inherited, -1 when the server
+ * has not been started by an upgrade
+ */
+int upgrade_inherit(int *server_sockfd, int **listen_sockfds, int *unix_sockfd) {
+
+	int count, expected, tcp;
+
+	int *fds;
+
+	char *value;
+	char control[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	if ((value = getenv(UPGRADE_ENV)) == NULL) {
+		return ERROR;
+	}
+
+	upgrade_channel = atoi(value);
+
+	/* Not to be inherited by a later upgrade */
+	unsetenv(UPGRADE_ENV);
+
+	iov.iov_base = &count;
+	iov.iov_len = sizeof(count);
+
+	memset(&msg, 0, sizeof(msg));
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(upgrade_channel, &msg, MSG_CMSG_CLOEXEC) != sizeof(count)
+		|| (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+		|| cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+
+		printf("Unable to upgrade: no listeners received\n");
+		exit(EXIT_FAILURE);
+
+	}
+
+	tcp = conf.listen_mode == LISTEN_REUSEPORT ? conf.thread_pool_size : 1;
+	expected = tcp + (conf.listen_unix != NULL ? 1 : 0);
+
+	if (count != expected || cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+
+		printf("Unable to upgrade: %d listeners received, %d expected\n", count, expected);
+		exit(EXIT_FAILURE);
+
+	}
+
+	fds = (int *) CMSG_DATA(cmsg);
+
+	if (conf.listen_mode == LISTEN_REUSEPORT) {
+
+		*listen_sockfds = malloc(tcp * sizeof(int));
+		memcpy(*listen_sockfds, fds, tcp * sizeof(int));
+
+	} else {
+
+		memcpy(server_sockfd, fds, sizeof(int));
+
+	}
+
+	if (conf.listen_unix != NULL) {
+		memcpy(unix_sockfd, fds + tcp, sizeof(int));
+	}
+
+	printf("Upgrade: %d listeners inherited\n", count);
+
+	return 0;
+
+}
+
+/*
+ * Remembers how the server was started and its listeners, for a later
+ * upgrade
+ *
+ * @param argv: the server arguments
+ * @param server_sockfd: the shared listening socket
+ * @param listen_sockfds: the reuseport listening sockets, or NULL
+ * @param unix_sockfd: the Unix listening socket, or -1
+ */
+void upgrade_init(char **argv, int server_sockfd, int *listen_sockfds, int unix_sockfd) {
+
+	upgrade_argv = argv;
+
+	/* A relative path would not survive a change of directory */
+	if (strchr(argv[0], '/') == NULL || (upgrade_path = realpath(argv[0], NULL)) == NULL) {
+		upgrade_path = argv[0];
+	}
+
+	upgrade_fds = malloc((conf.thread_pool_size + 1) * sizeof(int));
+
+	if (listen_sockfds != NULL) {
+
+		memcpy(upgrade_fds, listen_sockfds, conf.thread_pool_size * sizeof(int));
+		upgrade_count = conf.thread_pool_size;
+
+	} else {
+
+		upgrade_fds[0] = server_sockfd;
+		upgrade_count = 1;
+
+	}
+
+	if (unix_sockfd >= 0) {
+		upgrade_fds[upgrade_count++] = unix_sockfd;
+	}
+
+}
+
+/*
+ * Tells the old process that the new one is taking over, if the server has
+ * been started by an upgrade
+ */
+void upgrade_ready(void) {
+
+	char c;
+
+	if (upgrade_channel < 0) {
+		return;
+	}
+
+	c = 1;
+
+	if (write(upgrade_channel, &c, 1) < 0) {
+		printf("Unable to report the upgrade (%s)\n", strerror(errno));
+	}
+
+	close(upgrade_channel);
+	upgrade_channel = -1;
+
+}
+
+/*
+ * Starts the new binary and hands the listeners over to it
+ *
+ * @return: 0 once the new process is running, -1 when it did not take the
+ * listeners over (the old process goes on as if nothing happened)
+ */
+int upgrade_start(void) {
+
+	int i, n, pair[2];
+
+	char c;
+	char **envp;
+
+	pid_t pid;
+
+	sigset_t mask;
+
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct pollfd pfd;
+
+	char control[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+
+	if (upgrade_count > UPGRADE_MAX_FDS) {
+		printf("Unable to upgrade: too many listeners (%d)\n", upgrade_count);
+		return ERROR;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+		printf("Unable to upgrade (%s)\n", strerror(errno));
+		return ERROR;
+	}
+
+	/* The environment of the new process is built before fork(): only
+	 * async signal safe calls are allowed in the child */
+	for (n = 0; environ[n] != NULL; n++);
+
+	envp = malloc((n + 2) * sizeof(char *));
+
+	memcpy(envp, environ, n * sizeof(char *));
+
+	if (asprintf(&(envp[n]), "%s=%d", UPGRADE_ENV, pair[1]) < 0) {
+		handle_error("asprintf");
+	}
+
+	envp[n + 1] = NULL;
+
+	sigemptyset(&mask);
+
+	printf("Upgrading to %s\n", upgrade_path);
+
+	/* Lines printed so far must not be printed again by the child */
+	fflush(stdout);
+
+	if ((pid = fork()) < 0) {
+
+		printf("Unable to upgrade (%s)\n", strerror(errno));
+
+		close(pair[0]);
+		close(pair[1]);
+		free(envp[n]);
+		free(envp);
+
+		return ERROR;
+
+	} else if (pid == 0) {
+
+		/* Every other descriptor is close-on-exec, client sockets included */
+		fcntl(pair[1], F_SETFD, 0);
+
+		/* The signal mask of this thread would be inherited */
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		if (strchr(upgrade_path, '/') != NULL) {
+			execve(upgrade_path, upgrade_argv, envp);
+		} else {
+			execvpe(upgrade_path, upgrade_argv, envp);
+		}
+
+		_exit(EXIT_FAILURE);
+
+	}
+
+	close(pair[1]);
+	free(envp[n]);
+	free(envp);
+
+	iov.iov_base = &upgrade_count;
+	iov.iov_len = sizeof(upgrade_count);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(upgrade_count * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(upgrade_count * sizeof(int));
+
+	memcpy(CMSG_DATA(cmsg), upgrade_fds, upgrade_count * sizeof(int));
+
+	pfd.fd = pair[0];
+	pfd.events = POLLIN;
+
+	n = 0;
+
+	/* The new process reads its configuration, then reports back */
+	if (sendmsg(pair[0], &msg, MSG_NOSIGNAL) == sizeof(upgrade_count)) {
+
+		while ((i = poll(&pfd, 1, UPGRADE_TIMEOUT * 1000)) < 0 && errno == EINTR);
+
+		if (i > 0) {
+			while ((n = read(pair[0], &c, 1)) < 0 && errno == EINTR);
+		}
+
+	}
+
+	close(pair[0]);
+
+	if (n != 1) {
+
+		printf("Upgrade failed, the new process (pid %d) did not take over\n", pid);
+		fflush(stdout);
+
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+
+		return ERROR;
+
+	}
+
+	printf("Upgrade: new process (pid %d) running\n", pid);
+	fflush(stdout);
+
+	return 0;
+
+}
+
+/*
+ * Waits for SIGUSR2 and upgrades (or only drains, in a worker process)
+ */
+static void *upgrade_run(void *arg) {
+
+	int signum, handoff;
+
+	sigset_t set;
+
+	handoff = (int) (intptr_t) arg;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+
+	while (1) {
+
+		if (sigwait(&set, &signum) != 0) {
+			continue;
+		}
+
+		if (handoff && upgrade_start() < 0) {
+			continue;
+		}
+
+		upgrade_drain();
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Starts the thread waiting for the upgrade signal. Must be called before
+ * any other thread is started: they inherit the blocked signal, so that
+ * only this thread gets it.
+ *
+ * @param handoff: TRUE to hand the listeners over on the signal, FALSE to
+ * only drain the connections (the master has handed them over)
+ */
+void upgrade_watch(int handoff) {
+
+	sigset_t set, all;
+
+	pthread_t thread;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	/* The thread takes no signal but the one it waits for */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &set);
+
+	if (pthread_create(&thread, NULL, upgrade_run, (void *) (intptr_t) handoff) != 0) {
+		handle_error("pthread_create");
+	}
+
+	pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+	pthread_detach(thread);
+
+}
+
+/*
+ * Stops accepting, lets the open connections finish and exits. Never
+ * returns.
+ */
+void upgrade_drain(void) {
+
+	int i;
+
+	__atomic_store_n(&draining, TRUE, __ATOMIC_RELEASE);
+
+	printf("Draining %u connections\n", conn_count());
+	fflush(stdout);
+
+	for (i = 0; conn_count() > 0 && i < UPGRADE_DRAIN * 1000 / UPGRADE_INTERVAL; i++) {
+		usleep(UPGRADE_INTERVAL * 1000);
+	}
+
+	printf("Exiting, %u connections left\n", conn_count());
+
+	exit(EXIT_SUCCESS);
+
+}
+
+/*
+ * Tells whether the process is draining: no new connection is accepted
+ * and keep alive connections are closed after their current response
+ */
+int upgrade_draining(void) {
+
+	return __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+
+}
\ No newline at end of file
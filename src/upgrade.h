@@ -0,0 +1,22 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __UPGRADE_H
+#define __UPGRADE_H
+
+#define UPGRADE_ENV			"HTTPD_UPGRADE_FD"	// channel to the old process, set in the new one
+#define UPGRADE_MAX_FDS		253			// listeners handed over at most (SCM_MAX_FD)
+#define UPGRADE_TIMEOUT		10			// time the new process has to take the listeners over (s)
+#define UPGRADE_DRAIN		60			// time the old process keeps serving its connections at most (s)
+#define UPGRADE_INTERVAL	100			// period of the open connection checks while draining (ms)
+
+int upgrade_inherit(int *server_sockfd, int **listen_sockfds, int *unix_sockfd);
+void upgrade_init(char **argv, int server_sockfd, int *listen_sockfds, int unix_sockfd);
+void upgrade_ready(void);
+int upgrade_start(void);
+void upgrade_watch(int handoff);
+void upgrade_drain(void);
+int upgrade_draining(void);
+
+#endif
\ No newline at end of file
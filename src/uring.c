@@ -0,0 +1,997 @@
+/*
+ * io_uring connection engine. Each pool thread owns a ring and drives all
+ * of its connections through it: a multishot accept on the listener, a
+ * multishot recv per connection into a ring of provided buffers, and sends
+ * and file reads for the responses. Every completion only queues new
+ * submissions, which go to the kernel in one io_uring_enter() per loop, so
+ * a single system call covers many connections.
+ *
+ * The requests are parsed from the connection receive buffer with
+ * parse_request_header() and answered with conn_prepare_response(), the
+ * same way the other modes do. The ring is set up with the raw system
+ * calls, there is no liburing dependency.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "uring.h"
+#include "listener.h"
+#include "upgrade.h"
+#include "stats.h"
+#include "util.h"
+
+extern config_t conf;
+
+static uring_t *rings;
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params *params) {
+
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+
+}
+
+static int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+
+}
+
+static int sys_io_uring_register(int fd, uint32_t opcode, void *arg, uint32_t nr_args) {
+
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+
+}
+
+/*
+ * Gives a receive buffer back to the kernel
+ *
+ * @param ring: the ring owning the buffer
+ * @param bid: the buffer id
+ */
+static void uring_buffer_add(uring_t *ring, uint16_t bid) {
+
+	struct io_uring_buf *buf;
+
+	buf = &(ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)]);
+
+	buf->addr = (uint64_t) (uintptr_t) (ring->buffers + bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+
+	ring->buf_tail++;
+
+	__atomic_store_n(&(ring->buf_ring->tail), ring->buf_tail, __ATOMIC_RELEASE);
+
+}
+
+/*
+ * Creates the ring, maps its queues and registers the receive buffers
+ *
+ * @param ring: the ring to set up
+ * @return: 0 on success, ERROR when io_uring is not available
+ */
+static int uring_setup(uring_t *ring) {
+
+	int i;
+
+	size_t sq_size, cq_size;
+
+	char *sq_ptr, *cq_ptr;
+
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+
+	memset(&params, 0, sizeof(params));
+
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+	if ((ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params)) < 0) {
+
+		/* Older kernels do not know about the setup flags */
+		memset(&params, 0, sizeof(params));
+
+		if ((ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params)) < 0) {
+			return ERROR;
+		}
+
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+
+		if (cq_size > sq_size) sq_size = cq_size;
+		cq_size = sq_size;
+
+	}
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->ring_fd, IORING_OFF_SQ_RING);
+
+	if (sq_ptr == MAP_FAILED) {
+		close(ring->ring_fd);
+		return ERROR;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+
+		cq_ptr = sq_ptr;
+
+	} else {
+
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_CQ_RING);
+
+		if (cq_ptr == MAP_FAILED) {
+			close(ring->ring_fd);
+			return ERROR;
+		}
+
+	}
+
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->ring_fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED) {
+		close(ring->ring_fd);
+		return ERROR;
+	}
+
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (uint32_t *) (sq_ptr + params.sq_off.head);
+	ring->sq_tail = (uint32_t *) (sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (uint32_t *) (sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (uint32_t *) (sq_ptr + params.sq_off.array);
+	ring->sq_local_tail = *(ring->sq_tail);
+
+	/* Each submission queue slot always points to its own entry */
+	for (i = 0; i < ring->sq_entries; i++) {
+		ring->sq_array[i] = i;
+	}
+
+	ring->cq_head = (uint32_t *) (cq_ptr + params.cq_off.head);
+	ring->cq_tail = (uint32_t *) (cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (uint32_t *) (cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+
+	/* The provided buffer ring must be page aligned */
+	ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (ring->buf_ring == MAP_FAILED) {
+		close(ring->ring_fd);
+		return ERROR;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+
+	reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+
+	if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		/* Provided buffer rings need Linux 5.19 */
+		close(ring->ring_fd);
+		return ERROR;
+	}
+
+	/* The kernel fills them on behalf of the ring's worker, keep them on its node */
+	ring->buffers = node_alloc(URING_BUFFERS * URING_BUFFER_SIZE, worker_node(ring->id));
+
+	ring->buf_tail = 0;
+
+	for (i = 0; i < URING_BUFFERS; i++) {
+		uring_buffer_add(ring, i);
+	}
+
+	ring->multishot = TRUE;
+
+	return 0;
+
+}
+
+/*
+ * Hands the queued submissions to the kernel
+ *
+ * @param ring: the ring
+ * @param wait: number of completions to wait for
+ */
+static void uring_submit(uring_t *ring, uint32_t wait) {
+
+	uint32_t to_submit;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	while (sys_io_uring_enter(ring->ring_fd, to_submit, wait, IORING_ENTER_GETEVENTS) < 0) {
+
+		if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EBUSY) {
+			/* The completion queue is full, it is drained on the next loop */
+			return;
+		}
+
+		handle_error("io_uring_enter");
+
+	}
+
+}
+
+/*
+ * Makes sure the next submissions fit in the submission queue, so linked
+ * submissions are never split between two io_uring_enter() calls.
+ *
+ * @param ring: the ring
+ * @param count: number of submissions about to be queued
+ */
+static void uring_reserve(uring_t *ring, uint32_t count) {
+
+	while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+		> ring->sq_entries - count) {
+
+		uring_submit(ring, 0);
+
+	}
+
+}
+
+/*
+ * Returns the next free submission queue entry
+ *
+ * @param ring: the ring
+ * @return: a zeroed submission queue entry
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+
+	struct io_uring_sqe *sqe;
+
+	uring_reserve(ring, 1);
+
+	sqe = &(ring->sqes[ring->sq_local_tail & *(ring->sq_mask)]);
+	ring->sq_local_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+
+}
+
+static uint64_t uring_data(conn_t *conn, int op) {
+
+	return (uint64_t) (uintptr_t) conn | op;
+
+}
+
+/*
+ * Queues a (multishot) accept on a ring listener
+ *
+ * @param ring: the ring
+ * @param op: URING_OP_ACCEPT for the ring listener, URING_OP_ACCEPT_UNIX
+ * for the Unix one
+ */
+static void uring_accept(uring_t *ring, int op) {
+
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = op == URING_OP_ACCEPT_UNIX ? ring->unix_sockfd : ring->listen_sockfd;
+	/* Nothing may block the ring thread, not even a send made outside of it */
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = uring_data(NULL, op);
+
+}
+
+/*
+ * Cancels an operation not bound to a connection
+ *
+ * @param ring: the ring
+ * @param op: the operation (URING_OP_*)
+ */
+static void uring_cancel(uring_t *ring, int op) {
+
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = uring_data(NULL, op);
+	sqe->user_data = uring_data(NULL, URING_OP_CANCEL);
+
+}
+
+/*
+ * Cancels the accepts on the ring listeners: after an upgrade the new
+ * process accepts from them
+ *
+ * @param ring: the ring
+ */
+static void uring_cancel_accept(uring_t *ring) {
+
+	ring->draining = TRUE;
+
+	uring_cancel(ring, URING_OP_ACCEPT);
+
+	if (ring->unix_sockfd >= 0) {
+		uring_cancel(ring, URING_OP_ACCEPT_UNIX);
+	}
+
+}
+
+/*
+ * Queues the timeout that wakes the loop up to close idle connections
+ *
+ * @param ring: the ring
+ */
+static void uring_tick(uring_t *ring) {
+
+	struct io_uring_sqe *sqe;
+
+	ring->tick.tv_sec = URING_TICK / 1000;
+	ring->tick.tv_nsec = (URING_TICK % 1000) * 1000000;
+
+	sqe = uring_get_sqe(ring);
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t) (uintptr_t) &(ring->tick);
+	sqe->len = 1;
+	sqe->user_data = uring_data(NULL, URING_OP_TICK);
+
+}
+
+/*
+ * Queues a receive into the provided buffers. It keeps producing
+ * completions until it fails when multishot receives are supported.
+ *
+ * @param ring: the ring
+ * @param conn: the connection state
+ */
+static void uring_recv(uring_t *ring, conn_t *conn) {
+
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->sockfd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->ioprio = ring->multishot ? IORING_RECV_MULTISHOT : 0;
+	sqe->user_data = uring_data(conn, URING_OP_RECV);
+
+	conn->recv_armed = TRUE;
+	conn->pending++;
+
+}
+
+/*
+ * Marks the connection as closing. The socket is shut down so every
+ * operation still in flight completes, and the connection is freed once
+ * the last of them has.
+ *
+ * @param ring: the ring
+ * @param conn: the connection state
+ */
+static void uring_close(uring_t *ring, conn_t *conn) {
+
+	if (conn->closing) {
+		return;
+	}
+
+	conn->closing = TRUE;
+
+	wheel_cancel(&(conn->timer));
+
+	shutdown(conn->sockfd, SHUT_RDWR);
+
+}
+
+/*
+ * Removes the connection from the ring, closes it and frees it
+ *
+ * @param ring: the ring owning the connection
+ * @param conn: the connection state
+ */
+static void uring_free(uring_t *ring, conn_t *conn) {
+
+	ring->num_conns--;
+
+	conn_free(ring->id, conn);
+
+}
+
+/*
+ * Queues the next piece of the response: the pending headers (and in
+ * memory content) first, then the file, one chunk at a time with a read
+ * linked to the send of the bytes read.
+ *
+ * @param ring: the ring
+ * @param conn: the connection state
+ * @return: TRUE when the whole response has been sent already
+ */
+static int uring_write(uring_t *ring, conn_t *conn) {
+
+	uint32_t length;
+
+	struct io_uring_sqe *sqe;
+
+	if (conn_batched(conn) > 0) {
+
+		sqe = uring_get_sqe(ring);
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = conn->sockfd;
+		sqe->addr = (uint64_t) (uintptr_t) conn_batch_message(conn);
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (conn->file_fd >= 0 ? MSG_MORE : 0);
+		sqe->user_data = uring_data(conn, URING_OP_SEND);
+
+		conn->pending++;
+
+		return FALSE;
+
+	}
+
+	if (conn->out_sent < conn->out_length) {
+
+		sqe = uring_get_sqe(ring);
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->sockfd;
+		sqe->addr = (uint64_t) (uintptr_t) (conn->out + conn->out_sent);
+		sqe->len = conn->out_length - conn->out_sent;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (conn->file_fd >= 0 ? MSG_MORE : 0);
+		sqe->user_data = uring_data(conn, URING_OP_SEND);
+
+		conn->pending++;
+
+		return FALSE;
+
+	}
+
+	if (conn->file_fd >= 0 && conn->file_offset < conn->file_size) {
+
+		if (conn->file_buffer == NULL && (conn->file_buffer = malloc(URING_FILE_CHUNK)) == NULL) {
+			handle_error("malloc");
+		}
+
+		if (conn->file_size - conn->file_offset > URING_FILE_CHUNK) {
+			length = URING_FILE_CHUNK;
+		} else {
+			length = conn->file_size - conn->file_offset;
+		}
+
+		uring_reserve(ring, 2);
+
+		/* A short read breaks the link and cancels the send */
+		sqe = uring_get_sqe(ring);
+
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = conn->file_fd;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->addr = (uint64_t) (uintptr_t) conn->file_buffer;
+		sqe->len = length;
+		sqe->off = conn->file_offset;
+		sqe->user_data = uring_data(conn, URING_OP_READ);
+
+		sqe = uring_get_sqe(ring);
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->sockfd;
+		sqe->addr = (uint64_t) (uintptr_t) conn->file_buffer;
+		sqe->len = length;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL
+			| (conn->file_offset + length < conn->file_size ? MSG_MORE : 0);
+		sqe->user_data = uring_data(conn, URING_OP_SEND_FILE);
+
+		conn->pending += 2;
+
+		return FALSE;
+
+	}
+
+	return TRUE;
+
+}
+
+/*
+ * Serves every complete request in the connection receive buffer as long
+ * as no response is in flight.
+ *
+ * @param ring: the ring
+ * @param conn: the connection state
+ */
+static void uring_process(uring_t *ring, conn_t *conn) {
+
+	int r;
+
+	while ( ! conn->closing) {
+
+		if (conn->state == CONN_WRITING) {
+
+			if ( ! uring_write(ring, conn)) {
+				return;
+			}
+
+			conn->req_count++;
+
+			if ( ! conn->keep_alive || conn->req_count > conn->config->max_keep_alive_requests) {
+
+				uring_close(ring, conn);
+				return;
+
+			}
+
+			conn_reset(conn);
+
+			conn_set_timeout(conn, CONN_TIMEOUT_IDLE);
+
+		}
+
+		if (conn->state == CONN_READING) {
+
+			if ((r = parse_request_header(ring->id, conn)) < 0) {
+
+				/* The error response, if any, goes out as any other */
+				if (conn->state == CONN_WRITING) {
+					conn_set_timeout(conn, CONN_TIMEOUT_SEND);
+					continue;
+				}
+
+				uring_close(ring, conn);
+				return;
+
+			} else if (r == 0) {
+
+				if (conn->in_length > 0 && conn->timeout == CONN_TIMEOUT_IDLE) {
+					/* The request has started, the whole header block is due now */
+					conn_set_timeout(conn, CONN_TIMEOUT_HEADER);
+				}
+
+				return;
+
+			}
+
+			conn->state = CONN_BODY;
+
+		}
+
+		/* The message body may still be on its way, as long as it keeps coming */
+		if (conn->in_length < conn->in_needed) {
+			conn_set_timeout(conn, CONN_TIMEOUT_BODY);
+			return;
+		}
+
+		parse_request_body(ring->id, conn);
+
+		conn->keep_alive = is_keep_alive(&(conn->request));
+
+		conn_prepare_response(ring->id, conn);
+
+		/* Pipelined requests already received are answered in a single write */
+		if (conn_batch(ring->id, conn)) {
+			continue;
+		}
+
+		/* Sends are asynchronous, the deadline runs from now on */
+		conn_set_timeout(conn, CONN_TIMEOUT_SEND);
+
+	}
+
+}
+
+/*
+ * Handles a new connection accepted by the multishot accept
+ *
+ * @param ring: the ring
+ * @param sockfd: the client socket
+ */
+static void uring_add(uring_t *ring, int sockfd) {
+
+	conn_t *conn;
+
+	socklen_t client_size;
+
+	struct sockaddr_in client_addr;
+
+	stats_add(&(stats.accepted), 1);
+
+	set_low_latency(sockfd);
+
+	conn = conn_new(sockfd);
+
+	conn->wheel = &(ring->wheel);
+	conn_set_timeout(conn, CONN_TIMEOUT_IDLE);
+
+	ring->num_conns++;
+
+	uring_recv(ring, conn);
+
+	debug(conf.output_level,
+		"[%d] DEBUG: handling connection at socket %d (%d open)\n",
+		ring->id, conn->sockfd, ring->num_conns);
+
+	client_size = sizeof(client_addr);
+
+	if (getpeername(sockfd, (struct sockaddr *) &client_addr, &client_size) == 0) {
+		log_client(&client_addr);
+	}
+
+}
+
+/*
+ * Closes the connections whose deadline is over
+ *
+ * @param ring: the ring
+ */
+static void uring_expire(uring_t *ring) {
+
+	conn_t *conn;
+
+	wheel_timer_t *timer, *next;
+
+	timer = wheel_advance(&(ring->wheel), get_time_ns() / 1000000);
+
+	while (timer != NULL) {
+
+		next = timer->next;
+
+		conn = WHEEL_ENTRY(timer, conn_t, timer);
+
+		debug(conf.output_level,
+			"[%d] DEBUG: connection timed out\n",
+			ring->id);
+
+		stats_add(&(stats.timed_out), 1);
+
+		uring_close(ring, conn);
+
+		timer = next;
+
+	}
+
+}
+
+/*
+ * Handles a completion of a connection operation
+ *
+ * @param ring: the ring
+ * @param conn: the connection state
+ * @param op: the completed operation
+ * @param res: the operation result
+ * @param flags: the completion flags
+ */
+static void uring_complete(uring_t *ring, conn_t *conn, int op, int res, uint32_t flags) {
+
+	uint16_t bid;
+
+	if ( ! (flags & IORING_CQE_F_MORE)) {
+
+		conn->pending--;
+
+		if (op == URING_OP_RECV) {
+			conn->recv_armed = FALSE;
+		}
+
+	}
+
+	if (op == URING_OP_RECV) {
+
+		if (flags & IORING_CQE_F_BUFFER) {
+
+			bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+			/* Nothing is served after a last response, what follows it is dropped */
+			if (res > 0 && ! conn->closing && (conn->keep_alive || conn->state != CONN_WRITING)
+				&& conn_append(conn, ring->buffers + bid * URING_BUFFER_SIZE, res) < 0) {
+
+				/* Not while a response is on its way */
+				if (conn->state != CONN_WRITING) {
+					reject_message_body(ring->id, conn);
+				}
+
+				/* The 413 queued goes out as any other response */
+				if (conn->state == CONN_WRITING && ! conn->keep_alive) {
+					conn_set_timeout(conn, CONN_TIMEOUT_SEND);
+					uring_write(ring, conn);
+				} else {
+					uring_close(ring, conn);
+				}
+
+			}
+
+			uring_buffer_add(ring, bid);
+
+		}
+
+		if (conn->closing) {
+			/* Nothing to do but wait for the rest of operations */
+		} else if (res == 0) {
+
+			debug(conf.output_level,
+				"[%d] DEBUG: client closed connection\n",
+				ring->id);
+
+			uring_close(ring, conn);
+
+		} else if (res < 0 && res != -ENOBUFS && ! (res == -EINVAL && ring->multishot)) {
+
+			uring_close(ring, conn);
+
+		} else {
+
+			if (res == -EINVAL) {
+				/* Multishot receives need Linux 6.0, arm one receive at a time */
+				ring->multishot = FALSE;
+			}
+
+			if ( ! conn->recv_armed) {
+				uring_recv(ring, conn);
+			}
+
+			if (conn->state != CONN_WRITING) {
+				uring_process(ring, conn);
+			}
+
+		}
+
+	} else if (op == URING_OP_SEND || op == URING_OP_SEND_FILE) {
+
+		if (conn->closing) {
+			/* Nothing to do but wait for the rest of operations */
+		} else if (res < 0) {
+
+			debug(conf.output_level,
+				"[%d] DEBUG: unable to send response (%s)\n",
+				ring->id, strerror(-res));
+
+			uring_close(ring, conn);
+
+		} else {
+
+			if (op == URING_OP_SEND) {
+				conn_sent(conn, res);
+			} else {
+				conn->file_offset += res;
+			}
+
+			stats_add(&(stats.bytes_sent), res);
+
+			conn_set_timeout(conn, CONN_TIMEOUT_SEND);
+
+			uring_process(ring, conn);
+
+		}
+
+	} else if (op == URING_OP_READ) {
+
+		if (res < 0 && ! conn->closing) {
+
+			debug(conf.output_level,
+				"[%d] DEBUG: unable to read %s (%s)\n",
+				ring->id, conn->response.file_path, strerror(-res));
+
+		}
+
+		/* On failure the linked send completes with -ECANCELED and closes */
+
+	}
+
+	if (conn->closing && conn->pending == 0) {
+		uring_free(ring, conn);
+	}
+
+}
+
+static void *uring_run(void *arg) {
+
+	uint32_t head, flags;
+
+	uint64_t data, spin_until;
+
+	int res, cpu;
+
+	conn_t *conn;
+	uring_t *ring;
+
+	struct io_uring_cqe *cqe;
+
+	ring = (uring_t *) arg;
+
+	if ((cpu = worker_cpu(ring->id)) >= 0 && pin_thread(cpu) < 0) {
+		debug(conf.output_level, "[%d] DEBUG: unable to pin thread to cpu %d\n", ring->id, cpu);
+	}
+
+	debug(conf.output_level, "[%d] DEBUG: io_uring loop with local id %d running\n", ring->id, ring->id);
+
+	wheel_init(&(ring->wheel), get_time_ns() / 1000000);
+
+	uring_accept(ring, URING_OP_ACCEPT);
+
+	if (ring->unix_sockfd >= 0) {
+		uring_accept(ring, URING_OP_ACCEPT_UNIX);
+	}
+
+	uring_tick(ring);
+
+	spin_until = 0;
+
+	while (1) {
+
+		/* Busy poll for a while after the last completion: entering
+		 * without waiting still runs the completions due (COOP_TASKRUN) */
+		uring_submit(ring, get_time_ns() < spin_until ? 0 : 1);
+
+		head = *(ring->cq_head);
+
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cpu_relax();
+			continue;
+		} else if (conf.busy_poll > 0) {
+			spin_until = get_time_ns() + conf.busy_poll * 1000ULL;
+		}
+
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+
+			cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+
+			data = cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+
+			/* Release the slot before handling, it may submit and wait */
+			head++;
+			__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+			conn = (conn_t *) (uintptr_t) (data & ~((uint64_t) URING_OP_MASK));
+
+			switch (data & URING_OP_MASK) {
+
+				case URING_OP_ACCEPT:
+				case URING_OP_ACCEPT_UNIX:
+
+					if (res >= 0) {
+
+						uring_add(ring, res);
+
+					} else {
+
+						debug(conf.output_level,
+							"[%d] DEBUG: accept failed (%s)\n",
+							ring->id, strerror(-res));
+
+					}
+
+					if ( ! (flags & IORING_CQE_F_MORE) && ! ring->draining) {
+						uring_accept(ring, data & URING_OP_MASK);
+					}
+
+					break;
+
+				case URING_OP_TICK:
+
+					uring_expire(ring);
+					uring_tick(ring);
+
+					if (upgrade_draining() && ! ring->draining) {
+						uring_cancel_accept(ring);
+					}
+
+					break;
+
+				case URING_OP_CANCEL:
+
+					break;
+
+				default:
+
+					uring_complete(ring, conn, data & URING_OP_MASK, res, flags);
+
+					break;
+
+			}
+
+		}
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Starts one io_uring loop per pool thread. Every loop accepts from the
+ * shared listener or from its own SO_REUSEPORT listener, and from the Unix
+ * listener if any. Never returns
+ * unless io_uring is not available, so the caller can fall back to the
+ * epoll engine.
+ *
+ * @param server_sockfd: the shared listening socket
+ * @param listen_sockfds: one listening socket per loop, or NULL
+ * @return: ERROR when the rings can not be set up
+ */
+int uring_server(int server_sockfd, int *listen_sockfds) {
+
+	int i;
+
+	uring_t *ring;
+
+	rings = malloc(conf.thread_pool_size * sizeof(uring_t));
+	memset(rings, 0, conf.thread_pool_size * sizeof(uring_t));
+
+	for (i = 0; i < conf.thread_pool_size; i++) {
+
+		ring = &rings[i];
+
+		ring->id = i;
+		ring->listen_sockfd = listen_sockfds != NULL ? listen_sockfds[i] : server_sockfd;
+		ring->unix_sockfd = listener_unix();
+
+		if (uring_setup(ring) < 0) {
+
+			debug(conf.output_level,
+				"DEBUG: io_uring is not available (%s)\n",
+				strerror(errno));
+
+			/* Nothing has been started yet, leave the rings behind */
+			while (i-- > 0) {
+				close(rings[i].ring_fd);
+			}
+
+			free(rings);
+
+			return ERROR;
+
+		}
+
+	}
+
+	for (i = 0; i < conf.thread_pool_size; i++) {
+
+		if (pthread_create(&(rings[i].thread), NULL, uring_run, &rings[i]) != 0) {
+			handle_error("pthread_create");
+		}
+
+	}
+
+	for (i = 0; i < conf.thread_pool_size; i++) {
+		pthread_join(rings[i].thread, NULL);
+	}
+
+	exit(EXIT_SUCCESS);
+
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __URING_H
+#define __URING_H
+
+#define URING_ENTRIES		1024		// submission queue entries per ring
+#define URING_BUFFERS		512			// provided receive buffers per ring (power of two)
+#define URING_BUFFER_SIZE	4096		// size of each provided receive buffer
+#define URING_BUFFER_GROUP	0			// buffer group id of the receive buffers
+#define URING_FILE_CHUNK	65536		// file bytes read and sent per submission
+#define URING_TICK			100			// expire connection timers every 100 ms (ms)
+
+/* operation encoded in the low bits of the submission user data */
+#define URING_OP_ACCEPT		0
+#define URING_OP_TICK		1
+#define URING_OP_RECV		2
+#define URING_OP_SEND		3
+#define URING_OP_READ		4
+#define URING_OP_SEND_FILE	5
+#define URING_OP_CANCEL		6
+#define URING_OP_ACCEPT_UNIX	7
+#define URING_OP_MASK		0x07
+
+typedef struct uring {
+	int id;
+	int ring_fd;
+	int listen_sockfd;
+	int unix_sockfd;
+	int multishot;
+	uint8_t draining;
+	uint32_t sq_entries;
+	uint32_t sq_local_tail;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_array;
+	struct io_uring_sqe *sqes;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring;
+	uint16_t buf_tail;
+	char *buffers;
+	struct __kernel_timespec tick;
+	uint32_t num_conns;
+	wheel_t wheel;
+	pthread_t thread;
+} uring_t;
+
+int uring_server(int server_sockfd, int *listen_sockfds);
+
+#endif
\ No newline at end of file
@@ -2,6 +2,7 @@
  * @author dhuertas
  * @email huertas.dani@gmail.com
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,12 +13,29 @@
 #include <sys/time.h>
 #include <time.h>
 #include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 #include "constants.h"
 #include "config.h"
+#include "stats.h"
 #include "util.h"
 
 extern config_t conf;
+extern __thread vhost_t *request_vhost;
+
+/* last date formatted by the calling thread, one per format */
+static __thread struct {
+	char *format;
+	time_t second;
+	char text[MAX_DATE_SIZE];
+} date_cache[DATE_CACHE_SLOTS];
 
 /*
  * Converts an "unknown" integer to a string buffer
@@ -51,51 +69,52 @@ void integer_to_ascii(int number, char **result) {
  * @param format: the date format
  *
  * More info: man 2 date
+ *
+ * The date only changes once per second, so each thread keeps the last one
+ * it formatted instead of calling localtime() (which takes a process wide
+ * lock) for every request.
  */
 void get_date(char *buffer, char *format) {
 
+	int i;
+
 	struct timeval tv;
+	struct tm tm;
 	time_t curtime;
 
 	gettimeofday(&tv, NULL);
 	curtime = tv.tv_sec;
 
-	strftime(buffer, MAX_DATE_SIZE, format, localtime(&curtime));
+	/* The slot of this format, a free one, or else the last one */
+	for (i = 0; i < DATE_CACHE_SLOTS - 1; i++) {
+		if (date_cache[i].format == format || date_cache[i].format == NULL) break;
+	}
 
-}
+	if (date_cache[i].format != format || date_cache[i].second != curtime) {
 
-/*
- * Sends a file through a socket stream
- * 
- * @param sockfd: Socket file descriptor
- * @param file_path: absolute path to file
- */
-void send_file(int sockfd, char *file_path) {
-
-	char buffer[MAX_BUFFER];
+		date_cache[i].format = format;
+		date_cache[i].second = curtime;
 
-	int fd, r, w;
+		strftime(date_cache[i].text, MAX_DATE_SIZE, format, localtime_r(&curtime, &tm));
 
-	if ((fd = open(file_path, O_RDONLY, 0644)) < 0) {
-		handle_error("open");
 	}
 
-	memset(buffer, 0, sizeof(buffer));
+	strcpy(buffer, date_cache[i].text);
 
-	/* Send file */
-	while ((r = read(fd, buffer, MAX_BUFFER)) > 0) {
+}
 
-		if ((w = send(sockfd, buffer, r, 0)) != r) {
-			handle_error("send");
-		}
+/*
+ * Gets a monotonic timestamp
+ *
+ * @return: nanoseconds since an arbitrary point in the past
+ */
+uint64_t get_time_ns(void) {
 
-	}
+	struct timespec ts;
 
-	if (r < 0) {
-		handle_error("read");
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	close(fd);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 
 }
 
@@ -155,24 +174,24 @@ int resource_path(char *resource, char **path) {
 
 	if (resource[0] == '/') {
 
-		string_length = strlen(conf.document_root)
+		string_length = strlen(request_vhost->document_root)
 			+ strlen(resource);
 
 		*path = malloc(string_length + 1);
 
 		memset(*path, 0, string_length + 1);
-		strncpy(*path, conf.document_root, strlen(conf.document_root));
+		strncpy(*path, request_vhost->document_root, strlen(request_vhost->document_root));
 		strncat(*path, resource, strlen(resource));
 
 	} else {
 
-		string_length = strlen(conf.document_root) + 1
+		string_length = strlen(request_vhost->document_root) + 1
 			+ strlen(resource);
 
 		*path = malloc(string_length + 1);
 
 		memset(*path, 0, string_length + 1);
-		strncpy(*path, conf.document_root, strlen(conf.document_root));
+		strncpy(*path, request_vhost->document_root, strlen(request_vhost->document_root));
 		strncat(*path, "/", 1);
 		strncat(*path, resource, strlen(resource));
 
@@ -203,10 +222,10 @@ int directory_index_lookup(char *dir_path, char **file_path) {
 		return -1;
 	}
 
-	for (i = 0; i < conf.directory_index_count; i++) {
+	for (i = 0; i < request_vhost->directory_index_count; i++) {
 
 		string_length = strlen(dir_path) + ( ! IS_DS_LAST(dir_path) ? 1 : 0)
-			+ strlen(conf.directory_index[i]);
+			+ strlen(request_vhost->directory_index[i]);
 
 		*file_path = malloc(string_length + 1);
 		memset(*file_path, 0, string_length + 1);
@@ -215,7 +234,7 @@ int directory_index_lookup(char *dir_path, char **file_path) {
 
 		if ( ! IS_DS_LAST(dir_path)) strncat(*file_path, "/", 1);
 
-		strncat(*file_path, conf.directory_index[i], strlen(conf.directory_index[i]));
+		strncat(*file_path, request_vhost->directory_index[i], strlen(request_vhost->directory_index[i]));
 
 		s = stat(*file_path, &file_info);
 
@@ -264,4 +283,333 @@ void paranoid_free_string(char *s) {
 	memset(s, 0, strlen(s) + 1);
 	free(s);
 
+}
+
+/*
+ * Binds the calling thread to a CPU
+ *
+ * @param cpu: the cpu number
+ * @return: 0 on success, -1 on error
+ */
+int pin_thread(int cpu) {
+
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		return -1;
+	}
+
+	return 0;
+
+}
+
+/*
+ * Parses a list of CPUs such as "0-3,8,10"
+ *
+ * @param list: the CPU list
+ * @param cpus: where the CPU numbers are stored
+ * @return: number of CPUs in the list
+ *
+ * WARNING: this function allocates memory. Remember to free it when not
+ * in use.
+ */
+int parse_cpu_list(char *list, int **cpus) {
+
+	int count, first, last, cpu;
+
+	char *end;
+
+	count = 0;
+	*cpus = NULL;
+
+	while (*list != '\0') {
+
+		if (*list < '0' || *list > '9') {
+			list++;
+			continue;
+		}
+
+		first = strtol(list, &end, 10);
+		last = first;
+
+		if (*end == '-') {
+			last = strtol(end + 1, &end, 10);
+		}
+
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+
+			if ((*cpus = realloc(*cpus, (count + 1) * sizeof(int))) == NULL) {
+				handle_error("realloc");
+			}
+
+			(*cpus)[count++] = cpu;
+
+		}
+
+		list = end;
+
+	}
+
+	return count;
+
+}
+
+/*
+ * Lists the CPUs the process is allowed to run on, in ascending order
+ *
+ * @param cpus: where the CPU numbers are stored
+ * @return: number of CPUs
+ *
+ * WARNING: this function allocates memory. Remember to free it when not
+ * in use.
+ */
+int allowed_cpus(int **cpus) {
+
+	int count, cpu;
+
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		CPU_ZERO(&set);
+		CPU_SET(0, &set);
+	}
+
+	count = 0;
+
+	if ((*cpus = malloc(CPU_COUNT(&set) * sizeof(int))) == NULL) {
+		handle_error("malloc");
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			(*cpus)[count++] = cpu;
+		}
+	}
+
+	return count;
+
+}
+
+/*
+ * Tells which CPU a worker is pinned to. Worker i runs on the i-th CPU of
+ * the CpuAffinity list, wrapping around when there are more workers.
+ *
+ * @param worker_id: the worker id
+ * @return: the CPU number, -1 when workers are not pinned
+ */
+int worker_cpu(int worker_id) {
+
+	if (conf.cpu_affinity_count == 0) {
+		return -1;
+	}
+
+	return conf.cpu_affinity[worker_id % conf.cpu_affinity_count];
+
+}
+
+/*
+ * Looks up the NUMA node a CPU belongs to
+ *
+ * @param cpu: the CPU number
+ * @return: the node number, -1 when unknown (e.g. no NUMA support)
+ */
+int cpu_node(int cpu) {
+
+	int node;
+
+	char path[64];
+
+	DIR *dir;
+
+	struct dirent *entry;
+
+	node = -1;
+
+	if (cpu < 0) {
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+	if ((dir = opendir(path)) == NULL) {
+		return -1;
+	}
+
+	/* The CPU directory holds a "nodeN" link to its node */
+	while ((entry = readdir(dir)) != NULL) {
+
+		if (strncmp(entry->d_name, "node", strlen("node")) == 0
+			&& sscanf(entry->d_name + strlen("node"), "%d", &node) == 1) {
+			break;
+		}
+
+	}
+
+	closedir(dir);
+
+	return node;
+
+}
+
+/*
+ * Tells the NUMA node of the CPU a worker is pinned to
+ *
+ * @param worker_id: the worker id
+ * @return: the node number, -1 when the worker is not pinned or unknown
+ */
+int worker_node(int worker_id) {
+
+	return cpu_node(worker_cpu(worker_id));
+
+}
+
+/*
+ * Allocates memory whose pages are placed on a NUMA node. The policy is
+ * only a preference: when the node runs out of memory pages come from
+ * anywhere else. The memory is never released.
+ *
+ * @param size: number of bytes
+ * @param node: the NUMA node, -1 for the default placement
+ * @return: the allocated memory, filled with zeros
+ */
+void *node_alloc(size_t size, int node) {
+
+	void *ptr;
+
+	unsigned long mask;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (ptr == MAP_FAILED) {
+		handle_error("mmap");
+	}
+
+	if (node >= 0 && node < sizeof(mask) * 8) {
+
+		mask = 1UL << node;
+
+		/* Not fatal: without NUMA support pages are placed as usual */
+		syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+
+	}
+
+	return ptr;
+
+}
+
+/*
+ * Tells how many CPUs the server may use: the cgroup CPU quota of the
+ * container (cgroup v2 cpu.max, or v1 cfs quota) rounded up, bounded by
+ * the CPUs the process is allowed to run on.
+ *
+ * @return: number of CPUs, at least 1
+ */
+int cpu_count(void) {
+
+	int count, quota_cpus;
+
+	long quota, period;
+
+	FILE *file;
+
+	cpu_set_t set;
+
+	count = 0;
+	quota = -1;
+	period = 0;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		count = CPU_COUNT(&set);
+	}
+
+	if (count < 1 && (count = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		count = 1;
+	}
+
+	if ((file = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL) {
+
+		/* "max 100000" when there is no limit */
+		if (fscanf(file, "%ld %ld", &quota, &period) != 2) {
+			quota = -1;
+		}
+
+		fclose(file);
+
+	} else if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+
+		if (fscanf(file, "%ld", &quota) != 1) {
+			quota = -1;
+		}
+
+		fclose(file);
+
+		if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+
+			if (fscanf(file, "%ld", &period) != 1) {
+				period = 0;
+			}
+
+			fclose(file);
+
+		}
+
+	}
+
+	if (quota > 0 && period > 0) {
+
+		quota_cpus = (quota + period - 1) / period;
+
+		if (quota_cpus < count) {
+			count = quota_cpus;
+		}
+
+	}
+
+	return count;
+
+}
+
+/*
+ * Tells the CPU that the thread is spinning (see BusyPoll), which saves
+ * power and lets a sibling hyperthread run meanwhile
+ */
+void cpu_relax(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+
+}
+
+/*
+ * Sleeps while the futex word still holds the expected value
+ *
+ * @param addr: the futex word
+ * @param value: the expected value
+ */
+void futex_wait(uint32_t *addr, uint32_t value) {
+
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+
+}
+
+/*
+ * Wakes up threads sleeping on a futex word
+ *
+ * @param addr: the futex word
+ * @param count: maximum number of threads to wake up
+ */
+void futex_wake(uint32_t *addr, int count) {
+
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+
 }
\ No newline at end of file
@@ -7,10 +7,21 @@
 
 void integer_to_ascii(int number, char **result);
 void get_date(char *buffer, char *format);
-void send_file(int sockfd, char *file_path);
+uint64_t get_time_ns(void);
 int is_dir(char *path);
 int directory_index_lookup(char *dir_path, char **file_path);
 int resource_path(char *resource, char **path);
 void paranoid_free_string(char *s);
+int pin_thread(int cpu);
+int parse_cpu_list(char *list, int **cpus);
+int allowed_cpus(int **cpus);
+int worker_cpu(int worker_id);
+int cpu_node(int cpu);
+int worker_node(int worker_id);
+void *node_alloc(size_t size, int node);
+int cpu_count(void);
+void cpu_relax(void);
+void futex_wait(uint32_t *addr, uint32_t value);
+void futex_wake(uint32_t *addr, int count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,137 @@
+/*
+ * Deadlines of the threads server mode. Workers block on their sockets, so
+ * a single thread keeps the timers of every connection in one timer wheel
+ * and shuts the socket down once its deadline is over: the worker (or the
+ * parking area) holding the connection wakes up with an end of file and
+ * closes it. Arming and cancelling a timer is O(1) and needs no system
+ * call.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* local header files */
+#include "constants.h"
+#include "config.h"
+#include "headers.h"
+#include "request.h"
+#include "response.h"
+#include "wheel.h"
+#include "conn.h"
+#include "watchdog.h"
+#include "stats.h"
+#include "util.h"
+
+extern config_t conf;
+
+static wheel_t wheel;
+static pthread_mutex_t mutex_wheel = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t thread;
+
+static void *watchdog_run(void *arg) {
+
+	conn_t *conn;
+
+	wheel_timer_t *timer, *next;
+
+	struct timespec tick;
+
+	tick.tv_sec = 0;
+	tick.tv_nsec = WHEEL_TICK * 1000000;
+
+	while (1) {
+
+		nanosleep(&tick, NULL);
+
+		/*
+		 * Shut down under the lock: a connection can not be freed while its
+		 * timer is being handled, see watchdog_cancel()
+		 */
+		pthread_mutex_lock(&mutex_wheel);
+
+		timer = wheel_advance(&wheel, get_time_ns() / 1000000);
+
+		while (timer != NULL) {
+
+			next = timer->next;
+
+			conn = WHEEL_ENTRY(timer, conn_t, timer);
+
+			debug(conf.output_level,
+				"DEBUG: connection at socket %d timed out\n",
+				conn->sockfd);
+
+			stats_add(&(stats.timed_out), 1);
+
+			shutdown(conn->sockfd, SHUT_RDWR);
+
+			timer = next;
+
+		}
+
+		pthread_mutex_unlock(&mutex_wheel);
+
+	}
+
+	return NULL;
+
+}
+
+/*
+ * Creates the timer wheel and starts its thread
+ */
+void watchdog_init(void) {
+
+	wheel_init(&wheel, get_time_ns() / 1000000);
+
+	if (pthread_create(&thread, NULL, watchdog_run, NULL) != 0) {
+		handle_error("pthread_create");
+	}
+
+	pthread_detach(thread);
+
+}
+
+/*
+ * Arms the connection deadline, replacing the previous one
+ *
+ * @param conn: the connection state
+ * @param timeout: the deadline (CONN_TIMEOUT_*)
+ */
+void watchdog_arm(conn_t *conn, int timeout) {
+
+	pthread_mutex_lock(&mutex_wheel);
+
+	conn->wheel = &wheel;
+	conn_set_timeout(conn, timeout);
+
+	pthread_mutex_unlock(&mutex_wheel);
+
+}
+
+/*
+ * Disarms the connection deadline. Must be called before the connection
+ * is freed.
+ *
+ * @param conn: the connection state
+ */
+void watchdog_cancel(conn_t *conn) {
+
+	pthread_mutex_lock(&mutex_wheel);
+
+	wheel_cancel(&(conn->timer));
+
+	pthread_mutex_unlock(&mutex_wheel);
+
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __WATCHDOG_H
+#define __WATCHDOG_H
+
+void watchdog_init(void);
+void watchdog_arm(conn_t *conn, int timeout);
+void watchdog_cancel(conn_t *conn);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,173 @@
+/*
+ * Hierarchical timer wheel. Timers are kept in WHEEL_LEVELS rings of
+ * WHEEL_SLOTS lists; level n holds the timers due within 64^(n+1) ticks,
+ * hashed by the level n digit of their expiration tick. Arming and
+ * cancelling a timer are O(1), and advancing the clock only looks at the
+ * slot of each elapsed tick, moving the timers of a higher level slot down
+ * when the lower level wraps around.
+ *
+ * A wheel is not thread safe, it belongs to the thread advancing it.
+ *
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* local header files */
+#include "wheel.h"
+
+/*
+ * Links the timer into the slot matching its expiration tick
+ *
+ * @param wheel: the timer wheel
+ * @param timer: the timer, not armed, due now (while cascading) or later
+ */
+static void wheel_link(wheel_t *wheel, wheel_timer_t *timer) {
+
+	int level;
+
+	uint64_t delta;
+
+	wheel_timer_t *slot;
+
+	delta = timer->expires - wheel->now;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << (WHEEL_BITS * (level + 1)))) break;
+	}
+
+	if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS))) {
+		/* Beyond the wheel span, fire as late as possible */
+		timer->expires = wheel->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+
+	slot = &(wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+
+	timer->prev = slot->prev;
+	timer->next = slot;
+	slot->prev->next = timer;
+	slot->prev = timer;
+
+}
+
+/*
+ * Initializes an empty timer wheel
+ *
+ * @param wheel: the timer wheel
+ * @param now: current time (ms, monotonic)
+ */
+void wheel_init(wheel_t *wheel, uint64_t now) {
+
+	int level, i;
+
+	wheel->now = now / WHEEL_TICK;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+
+		for (i = 0; i < WHEEL_SLOTS; i++) {
+			wheel->slots[level][i].prev = &(wheel->slots[level][i]);
+			wheel->slots[level][i].next = &(wheel->slots[level][i]);
+		}
+
+	}
+
+}
+
+/*
+ * Arms a timer, or moves it when it is armed already
+ *
+ * @param wheel: the timer wheel
+ * @param timer: the timer
+ * @param expires: expiration time (ms, monotonic), rounded up to the next
+ * tick so that a timer never fires early
+ */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires) {
+
+	wheel_cancel(timer);
+
+	timer->expires = (expires + WHEEL_TICK - 1) / WHEEL_TICK;
+
+	/* The slot of the current tick has been handled already */
+	if (timer->expires <= wheel->now) {
+		timer->expires = wheel->now + 1;
+	}
+
+	wheel_link(wheel, timer);
+
+}
+
+/*
+ * Disarms a timer. Nothing happens when it is not armed.
+ *
+ * @param timer: the timer
+ */
+void wheel_cancel(wheel_timer_t *timer) {
+
+	if (timer->prev == NULL) {
+		return;
+	}
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+
+	timer->prev = NULL;
+	timer->next = NULL;
+
+}
+
+/*
+ * Moves the clock forward and collects the timers due
+ *
+ * @param wheel: the timer wheel
+ * @param now: current time (ms, monotonic)
+ * @return: list of expired timers linked by their next field, they are not
+ * armed anymore
+ */
+wheel_timer_t *wheel_advance(wheel_t *wheel, uint64_t now) {
+
+	int level;
+
+	wheel_timer_t *slot, *timer, *expired;
+
+	expired = NULL;
+
+	now /= WHEEL_TICK;
+
+	while (wheel->now < now) {
+
+		wheel->now++;
+
+		/* Entering a new period of a level, spread its slot over the lower ones */
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+
+			if ((wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0) {
+				break;
+			}
+
+			slot = &(wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+
+			while ((timer = slot->next) != slot) {
+				wheel_cancel(timer);
+				wheel_link(wheel, timer);
+			}
+
+		}
+
+		slot = &(wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)]);
+
+		while ((timer = slot->next) != slot) {
+
+			wheel_cancel(timer);
+
+			timer->next = expired;
+			expired = timer;
+
+		}
+
+	}
+
+	return expired;
+
+}
\ No newline at end of file
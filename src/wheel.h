@@ -0,0 +1,32 @@
+/*
+ * @author dhuertas
+ * @email huertas.dani@gmail.com
+ */
+#ifndef __WHEEL_H
+#define __WHEEL_H
+
+#define WHEEL_TICK		100			// timer resolution (ms)
+#define WHEEL_BITS		6
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)	// slots per level
+#define WHEEL_LEVELS	4			// 64^4 ticks, about 19 days
+
+/* the structure embedding a timer, given the timer */
+#define WHEEL_ENTRY(timer, type, member)	((type *) ((char *) (timer) - offsetof(type, member)))
+
+typedef struct wheel_timer {
+	uint64_t expires;				// tick
+	struct wheel_timer *prev;		// NULL when the timer is not armed
+	struct wheel_timer *next;
+} wheel_timer_t;
+
+typedef struct wheel {
+	uint64_t now;					// tick
+	wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+void wheel_init(wheel_t *wheel, uint64_t now);
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires);
+void wheel_cancel(wheel_timer_t *timer);
+wheel_timer_t *wheel_advance(wheel_t *wheel, uint64_t now);
+
+#endif
\ No newline at end of file